@@ -0,0 +1,251 @@
+#!/usr/bin/perl
+
+#------------------------------------------------------------------------------
+# Copyright (c) 2007-2011, Stanford University
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#     * Redistributions of source code must retain the above copyright
+#       notice, this list of conditions and the following disclaimer.
+#     * Redistributions in binary form must reproduce the above copyright
+#       notice, this list of conditions and the following disclaimer in the
+#       documentation and/or other materials provided with the distribution.
+#     * Neither the name of Stanford University nor the names of its 
+#       contributors may be used to endorse or promote products derived from 
+#       this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+# EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+# DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#------------------------------------------------------------------------------ 
+
+# Runs every Phoenix++ sample application over a thread-count sweep on 
+# deterministic synthetic inputs from gendata and reports wall time, 
+# throughput, speedup and parallel efficiency as CSV or JSON.
+
+use strict;
+use Getopt::Long;
+use Time::HiRes qw(time);
+use Cwd qw(abs_path);
+use File::Basename qw(dirname);
+
+my $bench_dir = dirname(abs_path($0));
+my $tests_dir = "$bench_dir/../tests";
+my $data_dir = "$bench_dir/data";
+
+my $size = "64m";
+my $reps = 3;
+my $seed = 1;
+my $format = "csv";
+my $threads = "";
+my $apps = "";
+my $out = "";
+my $skew = 1.0;
+my $keys = "";
+
+GetOptions ("size=s" => \$size,
+            "reps=i" => \$reps,
+            "seed=i" => \$seed,
+            "format=s" => \$format,
+            "threads=s" => \$threads,
+            "apps=s" => \$apps,
+            "out=s" => \$out,
+            "skew=f" => \$skew,
+            "keys=s" => \$keys)
+    or die "Usage: bench.pl [--size=64m] [--reps=3] [--seed=1] " .
+           "[--format=csv|json] [--threads=1,2,4] [--apps=a,b] " .
+           "[--skew=1.0] [--keys=n] [--out=file]\n";
+
+die "Unknown format [$format]\n" if ($format ne "csv" && $format ne "json");
+die "--reps must be positive\n" if ($reps < 1);
+
+sub parse_size {
+    my ($s) = @_;
+    my %mult = ( "k" => 1 << 10, "m" => 1 << 20, "g" => 1 << 30 );
+    $s =~ /^(\d+)([kmgKMG]?)$/ or die "Bad size [$s]\n";
+    return $1 * ($2 ne "" ? $mult{lc($2)} : 1);
+}
+
+my $bytes = parse_size($size);
+
+# Default sweep: powers of two up to the number of online CPUs, plus the
+# CPU count itself.
+my $ncpus = `getconf _NPROCESSORS_ONLN`;
+chomp ($ncpus);
+$ncpus = 1 if ($ncpus < 1);
+my @threads;
+if ($threads ne "") {
+    @threads = split (/,/, $threads);
+} else {
+    for (my $t = 1; $t < $ncpus; $t *= 2) {
+        push (@threads, $t);
+    }
+    push (@threads, $ncpus);
+}
+
+# Synthetic inputs, keyed by everything that determines their contents.
+my $key_opt = ($keys ne "") ? " -k $keys" : "";
+my $tag = "$size-s$seed-z$skew" . (($keys ne "") ? "-k$keys" : "");
+my %inputs = (
+    "text"   => [ "text-$tag.txt", "-s $size -S $seed -z $skew$key_opt" ],
+    "bmp"    => [ "image-$size-s$seed.bmp", "-s $size -S $seed" ],
+    "points" => [ "points-$size-s$seed.txt", "-s $size -S $seed" ],
+    "adlog"  => [ "adlog-$tag.txt", "-s $size -S $seed -z $skew$key_opt" ],
+);
+
+# Applications that generate their own input are scaled so their input 
+# footprint is roughly the requested size.
+my $km_points = int ($bytes / 256) || 1;
+my $pca_rows = 256;
+my $pca_cols = int ($bytes / 4 / $pca_rows / 16) || 1;
+my $mm_len = int (sqrt ($bytes / 64)) || 1;
+
+# name => [ binary, input kind or "", arguments, input bytes ]
+my %apps = (
+    "histogram"         => [ "histogram", "bmp", "%f", 0 ],
+    "linear_regression" => [ "linear_regression", "points", "%f", 0 ],
+    "word_count"        => [ "word_count", "text", "%f", 0 ],
+    "string_match"      => [ "string_match", "text", "%f", 0 ],
+    "adrecord"          => [ "adrecord", "adlog", "%f", 0 ],
+    "kmeans"            => [ "kmeans", "", "-p $km_points", 
+                             $km_points * 3 * 4 ],
+    "pca"               => [ "pca", "", "-r $pca_rows -c $pca_cols", 
+                             $pca_rows * $pca_cols * 4 ],
+    "matrix_multiply"   => [ "matrix_multiply", "", "$mm_len 1 1", 
+                             2 * $mm_len * $mm_len * 4 ],
+);
+my @order = ( "histogram", "linear_regression", "word_count", "string_match",
+              "adrecord", "kmeans", "pca", "matrix_multiply" );
+@order = split (/,/, $apps) if ($apps ne "");
+
+mkdir ($data_dir) unless (-d $data_dir);
+
+sub make_input {
+    my ($kind) = @_;
+    my ($file, $args) = @{$inputs{$kind}};
+    my $path = "$data_dir/$file";
+    if (! -e $path) {
+        system ("$bench_dir/gendata $kind $path $args > /dev/null") == 0 
+            or die "gendata failed for [$kind]\n";
+    }
+    return $path;
+}
+
+sub median {
+    my @s = sort { $a <=> $b } @_;
+    my $n = scalar (@s);
+    return ($n % 2) ? $s[$n/2] : ($s[$n/2-1] + $s[$n/2]) / 2;
+}
+
+sub stddev {
+    my $n = scalar (@_);
+    return 0 if ($n < 2);
+    my $mean = 0;
+    $mean += $_ foreach (@_);
+    $mean /= $n;
+    my $var = 0;
+    $var += ($_ - $mean) ** 2 foreach (@_);
+    return sqrt ($var / ($n - 1));
+}
+
+my @results;
+foreach my $app (@order) {
+    die "Unknown application [$app]\n" unless (exists $apps{$app});
+    my ($bin, $kind, $args, $in_bytes) = @{$apps{$app}};
+    my $exe = "$tests_dir/$app/$bin";
+    die "[$exe] not built, run make first\n" unless (-x $exe);
+
+    if ($kind ne "") {
+        my $path = make_input ($kind);
+        $args =~ s/%f/$path/;
+        $in_bytes = -s $path;
+    }
+
+    my $base;
+    foreach my $t (@threads) {
+        my @times;
+        my $status = "ok";
+        for (my $r = 0; $r < $reps; ++$r) {
+            # matrix_multiply writes its matrices to the working directory
+            my $begin = time ();
+            my $ret = system ("cd $data_dir && MR_NUMTHREADS=$t $exe $args " .
+                              "> /dev/null 2>&1");
+            my $elapsed = time () - $begin;
+            if ($ret != 0) {
+                $status = "failed";
+                last;
+            }
+            push (@times, $elapsed);
+        }
+
+        my %row = ( "app" => $app, "threads" => $t, "status" => $status,
+                    "input_bytes" => $in_bytes, "reps" => scalar (@times) );
+        if ($status eq "ok") {
+            my @sorted = sort { $a <=> $b } @times;
+            my $med = median (@times);
+            $base = [ $t, $med ] unless (defined $base);
+            my $speedup = $base->[1] / $med;
+            $row{"median_s"} = $med;
+            $row{"min_s"} = $sorted[0];
+            $row{"max_s"} = $sorted[-1];
+            $row{"stddev_s"} = stddev (@times);
+            $row{"throughput_mbps"} = $in_bytes / $med / (1 << 20);
+            $row{"speedup"} = $speedup;
+            $row{"efficiency"} = $speedup * $base->[0] / $t;
+        }
+        push (@results, \%row);
+        print STDERR "$app: $t threads: $status\n";
+    }
+}
+
+my @cols = ( "app", "threads", "status", "reps", "input_bytes", "median_s", 
+             "min_s", "max_s", "stddev_s", "throughput_mbps", "speedup", 
+             "efficiency" );
+my %numeric = map { $_ => 1 } ( "median_s", "min_s", "max_s", "stddev_s",
+                                "throughput_mbps", "speedup", "efficiency" );
+
+sub field {
+    my ($row, $col) = @_;
+    return "" unless (defined $row->{$col});
+    return exists $numeric{$col} ? sprintf ("%.6f", $row->{$col}) 
+                                 : $row->{$col};
+}
+
+my $fh;
+if ($out ne "") {
+    open ($fh, ">", $out) || die "Could not open file [$out]";
+} else {
+    $fh = \*STDOUT;
+}
+
+if ($format eq "csv") {
+    print $fh join (",", @cols) . "\n";
+    foreach my $row (@results) {
+        print $fh join (",", map { field ($row, $_) } @cols) . "\n";
+    }
+} else {
+    print $fh "{\n  \"size\": $bytes,\n  \"seed\": $seed,\n" .
+              "  \"skew\": $skew,\n  \"cpus\": $ncpus,\n  \"results\": [\n";
+    my @objs;
+    foreach my $row (@results) {
+        my @kv;
+        foreach my $col (@cols) {
+            next unless (defined $row->{$col});
+            my $v = field ($row, $col);
+            $v = "\"$v\"" if ($col eq "app" || $col eq "status");
+            push (@kv, "\"$col\": $v");
+        }
+        push (@objs, "    { " . join (", ", @kv) . " }");
+    }
+    print $fh join (",\n", @objs) . "\n  ]\n}\n";
+}
+
+close ($fh) if ($out ne "");
@@ -0,0 +1,376 @@
+/* Copyright (c) 2007-2011, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+/* Deterministic, size-parameterized input generators for the Phoenix++ 
+ * sample applications. Output is produced in fixed-size blocks, each seeded 
+ * from (seed, block index), so the bytes written depend only on the 
+ * arguments and never on the number of generator threads. 
+ */
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "stddefines.h"
+
+#define BLOCK_SIZE              (1 << 20)
+#define BMP_HEADER_SIZE         54
+#define BMP_WIDTH               1024
+#define DEF_SIZE                (64 << 20)
+#define DEF_VOCAB               100000
+#define DEF_VIEWS               100000
+#define DEF_SKEW                1.0
+#define WORDS_PER_LINE          12
+
+static char const* STATES[] = {
+    "AL","AK","AZ","AR","CA","CO","CT","DE","FL","GA",
+    "HI","ID","IL","IN","IA","KS","KY","LA","ME","MD",
+    "MA","MI","MN","MS","MO","MT","NE","NV","NH","NJ",
+    "NM","NY","NC","ND","OH","OK","OR","PA","RI","SC",
+    "SD","TN","TX","UT","VT","VA","WA","WV","WI","WY"};
+
+// splitmix64, small and good enough to seed and drive every block
+struct rng
+{
+    uint64_t s;
+    explicit rng(uint64_t seed) : s(seed) {}
+    uint64_t next() {
+        uint64_t z = (s += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    uint32_t below(uint32_t n) { return (uint32_t)(next() % n); }
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+    rng r(a ^ (b * 0xD6E8FEB86659FD93ULL));
+    return r.next();
+}
+
+// Samples ranks 0..n-1 with probability proportional to 1/(rank+1)^skew.
+// A skew of 0 is uniform.
+class zipf_table
+{
+    std::vector<double> cdf;
+public:
+    zipf_table(uint64_t n, double skew) : cdf(n) {
+        double total = 0;
+        for(uint64_t i = 0; i < n; i++) {
+            total += (skew == 0) ? 1.0 : pow((double)(i+1), -skew);
+            cdf[i] = total;
+        }
+        for(uint64_t i = 0; i < n; i++)
+            cdf[i] /= total;
+    }
+    uint64_t sample(rng& r) const {
+        uint64_t i = std::upper_bound(cdf.begin(), cdf.end(), r.uniform()) 
+            - cdf.begin();
+        return std::min(i, (uint64_t)cdf.size()-1);
+    }
+};
+
+enum gen_kind { GEN_TEXT, GEN_BMP, GEN_POINTS, GEN_ADLOG };
+
+struct gen_args
+{
+    gen_kind kind;
+    char const* fname;
+    uint64_t size;          // payload bytes (pixel bytes for bmp)
+    uint64_t seed;
+    uint64_t keys;          // vocabulary size or distinct view ids
+    double skew;
+    int threads;
+};
+
+struct gen_state
+{
+    gen_args const* args;
+    zipf_table const* zipf;
+    std::vector<std::string> const* words;
+    int fd;
+    uint64_t offset;        // where the payload starts in the file
+    uint64_t num_blocks;
+    unsigned int next_block;
+};
+
+/* Rank r of the vocabulary is the bijective base-26 spelling of r+1, so the
+ * most frequent words are also the shortest, as in natural text. */
+static void make_vocabulary(uint64_t n, std::vector<std::string>& words)
+{
+    words.resize(n);
+    for(uint64_t i = 0; i < n; i++) {
+        uint64_t v = i + 1;
+        std::string& w = words[i];
+        while(v > 0) {
+            v--;
+            w.push_back('a' + (char)(v % 26));
+            v /= 26;
+        }
+    }
+}
+
+static void fill_text(gen_state const& st, rng& r, char* buf, uint64_t len)
+{
+    uint64_t pos = 0;
+    int in_line = 0;
+    while(true) {
+        std::string const& w = (*st.words)[st.zipf->sample(r)];
+        if(pos + w.size() + 1 > len)
+            break;
+        memcpy(buf + pos, w.data(), w.size());
+        pos += w.size();
+        buf[pos++] = (++in_line % WORDS_PER_LINE == 0) ? '\n' : ' ';
+    }
+    memset(buf + pos, '\n', len - pos);
+}
+
+/* Smooth per-channel gradients plus noise, so the histogram is not flat. */
+static void fill_bmp(gen_state const& st, rng& r, char* buf, uint64_t len, 
+    uint64_t block_offset)
+{
+    for(uint64_t i = 0; i < len; i++) {
+        uint64_t pixel = (block_offset + i) / 3;
+        int channel = (block_offset + i) % 3;
+        uint64_t x = pixel % BMP_WIDTH, y = pixel / BMP_WIDTH;
+        uint64_t base = (channel == 0) ? x / 4 : 
+                        (channel == 1) ? y / 4 : (x + y) / 8;
+        buf[i] = (char)((base + r.below(32)) & 0xff);
+    }
+}
+
+/* Pairs of signed chars around y = 2x/3 + 10, linear_regression's POINT_T. */
+static void fill_points(gen_state const& st, rng& r, char* buf, uint64_t len)
+{
+    for(uint64_t i = 0; i + 1 < len; i += 2) {
+        int x = r.below(100);
+        int y = (2 * x) / 3 + 10 + (int)r.below(15) - 7;
+        buf[i] = (char)x;
+        buf[i+1] = (char)y;
+    }
+    if(len % 2)
+        buf[len-1] = 0;
+}
+
+/* Tab separated ad records. View ids follow a Zipf distribution whose skew 
+ * controls how unbalanced the reduce keys are. State and ad id are a 
+ * function of the view id, as adrecord's reducer assumes. */
+static void fill_adlog(gen_state const& st, rng& r, char* buf, uint64_t len)
+{
+    char line[64];
+    uint64_t pos = 0;
+    while(true) {
+        uint64_t view = st.zipf->sample(r);
+        // odd multiplier keeps view ids distinct while scattering them
+        uint32_t id = (uint32_t)((view + 1) * 2654435761ULL) | 0x10000000;
+        uint64_t h = mix(st.args->seed, view);
+        int n = snprintf(line, sizeof(line), "%08X\t%s\t%4d\t%d\t%d.%02d\n",
+            id, STATES[h % 50], (int)((h >> 8) % 10000), 
+            (int)r.below(10), (int)r.below(100), (int)r.below(100));
+        if(pos + n > len)
+            break;
+        memcpy(buf + pos, line, n);
+        pos += n;
+    }
+    memset(buf + pos, '\n', len - pos);
+}
+
+static void* gen_worker(void* arg)
+{
+    gen_state* st = (gen_state*)arg;
+    char* buf = new char[BLOCK_SIZE];
+
+    while(true) {
+        uint64_t block = __sync_fetch_and_add(&st->next_block, 1);
+        if(block >= st->num_blocks)
+            break;
+
+        uint64_t begin = block * BLOCK_SIZE;
+        uint64_t len = std::min((uint64_t)BLOCK_SIZE, st->args->size - begin);
+        rng r(mix(st->args->seed, block));
+
+        switch(st->args->kind) {
+            case GEN_TEXT: fill_text(*st, r, buf, len); break;
+            case GEN_BMP: fill_bmp(*st, r, buf, len, begin); break;
+            case GEN_POINTS: fill_points(*st, r, buf, len); break;
+            case GEN_ADLOG: fill_adlog(*st, r, buf, len); break;
+        }
+
+        uint64_t w = 0;
+        while(w < len) {
+            ssize_t ret = pwrite(st->fd, buf + w, len - w, 
+                st->offset + begin + w);
+            CHECK_ERROR(ret <= 0);
+            w += ret;
+        }
+    }
+
+    delete [] buf;
+    return NULL;
+}
+
+static void put_le(unsigned char* p, uint32_t v, int bytes)
+{
+    for(int i = 0; i < bytes; i++)
+        p[i] = (v >> (8*i)) & 0xff;
+}
+
+static void write_bmp_header(int fd, uint64_t pixel_bytes)
+{
+    unsigned char h[BMP_HEADER_SIZE];
+    uint32_t height = pixel_bytes / (3 * BMP_WIDTH);
+    memset(h, 0, sizeof(h));
+    h[0] = 'B'; h[1] = 'M';
+    put_le(h + 2, BMP_HEADER_SIZE + pixel_bytes, 4);
+    put_le(h + 10, BMP_HEADER_SIZE, 4);     // pixel data offset
+    put_le(h + 14, 40, 4);                  // info header size
+    put_le(h + 18, BMP_WIDTH, 4);
+    put_le(h + 22, height, 4);
+    put_le(h + 26, 1, 2);                   // planes
+    put_le(h + 28, 24, 2);                  // bits per pixel
+    put_le(h + 34, pixel_bytes, 4);
+    CHECK_ERROR(pwrite(fd, h, sizeof(h), 0) != sizeof(h));
+}
+
+static uint64_t parse_size(char const* s)
+{
+    char* end;
+    uint64_t v = strtoull(s, &end, 10);
+    switch(*end) {
+        case 'g': case 'G': v <<= 10;
+        case 'm': case 'M': v <<= 10;
+        case 'k': case 'K': v <<= 10;
+    }
+    return v;
+}
+
+static void usage(char const* prog)
+{
+    printf("USAGE: %s <text|bmp|points|adlog> <output file> [-s size[k|m|g]] "
+        "[-S seed] [-t threads] [-k keys] [-z skew]\n", prog);
+    printf("  text:   Zipf distributed words (word_count, string_match)\n");
+    printf("  bmp:    24-bit bitmap (histogram)\n");
+    printf("  points: 2-byte points (linear_regression)\n");
+    printf("  adlog:  ad click records with skewed view ids (adrecord)\n");
+    printf("  -k is the vocabulary size for text and the number of distinct "
+        "view ids for adlog; -z is the Zipf exponent (0 = uniform).\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    gen_args args;
+    int c;
+
+    if(argc < 3)
+        usage(argv[0]);
+
+    std::string kind = argv[1];
+    if(kind == "text") args.kind = GEN_TEXT;
+    else if(kind == "bmp") args.kind = GEN_BMP;
+    else if(kind == "points") args.kind = GEN_POINTS;
+    else if(kind == "adlog") args.kind = GEN_ADLOG;
+    else usage(argv[0]);
+
+    args.fname = argv[2];
+    args.size = DEF_SIZE;
+    args.seed = 1;
+    args.keys = (args.kind == GEN_ADLOG) ? DEF_VIEWS : DEF_VOCAB;
+    args.skew = DEF_SKEW;
+    args.threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    optind = 3;
+    while((c = getopt(argc, argv, "s:S:t:k:z:")) != EOF) {
+        switch(c) {
+            case 's': args.size = parse_size(optarg); break;
+            case 'S': args.seed = strtoull(optarg, NULL, 10); break;
+            case 't': args.threads = atoi(optarg); break;
+            case 'k': args.keys = parse_size(optarg); break;
+            case 'z': args.skew = atof(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if(optind != argc || args.size == 0 || args.keys == 0 || 
+        args.threads <= 0 || args.skew < 0)
+        usage(argv[0]);
+
+    gen_state st;
+    st.args = &args;
+    st.offset = 0;
+    if(args.kind == GEN_BMP) {
+        // whole rows only; BMP_WIDTH*3 is a multiple of 4, so rows need no 
+        // padding
+        uint64_t row = 3 * BMP_WIDTH;
+        args.size = std::max(row, args.size / row * row);
+        st.offset = BMP_HEADER_SIZE;
+    }
+    st.num_blocks = (args.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    st.next_block = 0;
+
+    std::vector<std::string> words;
+    zipf_table* zipf = NULL;
+    if(args.kind == GEN_TEXT || args.kind == GEN_ADLOG) {
+        zipf = new zipf_table(args.keys, args.skew);
+        if(args.kind == GEN_TEXT)
+            make_vocabulary(args.keys, words);
+    }
+    st.zipf = zipf;
+    st.words = &words;
+
+    CHECK_ERROR((st.fd = open(args.fname, O_CREAT | O_TRUNC | O_WRONLY, 
+        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0);
+    CHECK_ERROR(ftruncate(st.fd, st.offset + args.size) < 0);
+    if(args.kind == GEN_BMP)
+        write_bmp_header(st.fd, args.size);
+
+    int threads = (int)std::min((uint64_t)args.threads, st.num_blocks);
+    pthread_t* tids = new pthread_t[threads];
+    for(int i = 0; i < threads; i++)
+        CHECK_ERROR(pthread_create(&tids[i], NULL, gen_worker, &st));
+    for(int i = 0; i < threads; i++)
+        CHECK_ERROR(pthread_join(tids[i], NULL));
+    delete [] tids;
+
+    CHECK_ERROR(close(st.fd) < 0);
+    delete zipf;
+
+    printf("%s: wrote %lu bytes of %s data (seed %lu)\n", args.fname, 
+        (unsigned long)(st.offset + args.size), kind.c_str(), 
+        (unsigned long)args.seed);
+    return 0;
+}
+
+// vim: ts=8 sw=4 sts=4 smarttab smartindent
@@ -0,0 +1,554 @@
+/* Copyright (c) 2007-2011, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+/* Microbenchmarks for the Phoenix++ building blocks: hash_table lookups, 
+ * combiner adds, task_queue dequeues with and without stealing, thread_pool 
+ * dispatch latency and the MapReduceSort merge. Every measurement is 
+ * repeated after a warmup run and reported with its median, mean, standard 
+ * deviation and 95% confidence interval as CSV or JSON. 
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "map_reduce.h"
+
+#define DEF_REPS        10
+#define DEF_OPS         (1 << 20)
+#define DEF_ROUNDS      10000
+#define ZIPF_SKEW       1.0
+
+static inline double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// splitmix64
+struct rng
+{
+    uint64_t s;
+    explicit rng(uint64_t seed) : s(seed) {}
+    uint64_t next() {
+        uint64_t z = (s += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+enum key_dist { DIST_UNIFORM, DIST_ZIPF };
+static char const* dist_name[] = { "uniform", "zipf" };
+
+/* Fills keys with values in [0, card). Zipf ranks are scattered over the 
+ * key space so hot keys do not share cache lines. */
+static void make_keys(std::vector<uint64_t>& keys, uint64_t n, uint64_t card, 
+    key_dist dist, uint64_t seed)
+{
+    rng r(seed);
+    keys.resize(n);
+    if(dist == DIST_UNIFORM) {
+        for(uint64_t i = 0; i < n; i++)
+            keys[i] = r.next() % card;
+        return;
+    }
+
+    std::vector<double> cdf(card);
+    double total = 0;
+    for(uint64_t i = 0; i < card; i++) {
+        total += pow((double)(i+1), -ZIPF_SKEW);
+        cdf[i] = total;
+    }
+    for(uint64_t i = 0; i < n; i++) {
+        uint64_t rank = std::upper_bound(cdf.begin(), cdf.end(), 
+            r.uniform() * total) - cdf.begin();
+        rank = std::min(rank, card-1);
+        keys[i] = (rank * 2654435761ULL) % card;
+    }
+}
+
+/* Summary statistics over the timed repetitions. */
+struct stats
+{
+    double median, mean, stddev, ci95, min, max;
+    int reps;
+
+    explicit stats(std::vector<double> v) {
+        reps = v.size();
+        std::sort(v.begin(), v.end());
+        median = (reps % 2) ? v[reps/2] : (v[reps/2-1] + v[reps/2]) / 2;
+        min = v.front();
+        max = v.back();
+        mean = 0;
+        for(int i = 0; i < reps; i++) mean += v[i];
+        mean /= reps;
+        double var = 0;
+        for(int i = 0; i < reps; i++) var += (v[i]-mean) * (v[i]-mean);
+        stddev = reps > 1 ? sqrt(var / (reps-1)) : 0;
+        ci95 = reps > 1 ? t_quantile(reps-1) * stddev / sqrt(reps) : 0;
+    }
+
+    // two sided 97.5% quantile of Student's t distribution
+    static double t_quantile(int df) {
+        static double const t[] = { 0, 12.706, 4.303, 3.182, 2.776, 2.571, 
+            2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 
+            2.131, 2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 
+            2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+        return df <= 30 ? t[df] : 1.960;
+    }
+};
+
+struct config
+{
+    std::vector<int> threads;
+    std::vector<uint64_t> cards;
+    std::vector<std::string> benches;
+    int reps;
+    uint64_t ops;
+    int rounds;
+    bool json;
+};
+
+class reporter
+{
+    bool json;
+    int rows;
+public:
+    explicit reporter(bool json) : json(json), rows(0) {
+        if(json)
+            printf("[\n");
+        else
+            printf("bench,variant,dist,cardinality,threads,unit,"
+                "median,mean,stddev,ci95,min,max,reps\n");
+    }
+    ~reporter() {
+        if(json)
+            printf("\n]\n");
+    }
+    void row(char const* bench, char const* variant, char const* dist, 
+        uint64_t card, int threads, char const* unit, stats const& s) {
+        if(json) {
+            printf("%s  { \"bench\": \"%s\", \"variant\": \"%s\", "
+                "\"dist\": \"%s\", \"cardinality\": %lu, \"threads\": %d, "
+                "\"unit\": \"%s\", \"median\": %.6g, \"mean\": %.6g, "
+                "\"stddev\": %.6g, \"ci95\": %.6g, \"min\": %.6g, "
+                "\"max\": %.6g, \"reps\": %d }", rows ? ",\n" : "", 
+                bench, variant, dist, (unsigned long)card, threads, unit, 
+                s.median, s.mean, s.stddev, s.ci95, s.min, s.max, s.reps);
+        } else {
+            printf("%s,%s,%s,%lu,%d,%s,%.6g,%.6g,%.6g,%.6g,%.6g,%.6g,%d\n", 
+                bench, variant, dist, (unsigned long)card, threads, unit, 
+                s.median, s.mean, s.stddev, s.ci95, s.min, s.max, s.reps);
+        }
+        rows++;
+        fflush(stdout);
+    }
+};
+
+/* Runs FUNC on NUM_THREADS pool workers once, returning the wall time from
+ * begin() to the end of wait(). */
+static double run_pool(thread_pool& pool, thread_func func, void** args, 
+    int num_threads)
+{
+    CHECK_ERROR(pool.set(func, args, num_threads));
+    double begin = now();
+    CHECK_ERROR(pool.begin());
+    CHECK_ERROR(pool.wait());
+    return now() - begin;
+}
+
+/* One warmup plus REPS timed runs of BODY, which returns a measurement. */
+template<typename Body>
+static stats repeat(int reps, Body body)
+{
+    std::vector<double> v;
+    body();
+    for(int i = 0; i < reps; i++)
+        v.push_back(body());
+    return stats(v);
+}
+
+// hash_table::operator[], one private table per thread as in the map phase
+struct hash_arg
+{
+    std::vector<uint64_t> const* keys;
+};
+
+static void hash_worker(void* arg, thread_loc const& loc)
+{
+    hash_arg* a = (hash_arg*)arg;
+    hash_table<uint64_t, uint64_t> table;
+    std::vector<uint64_t> const& keys = *a->keys;
+    for(size_t i = 0; i < keys.size(); i++)
+        table[keys[i]] += 1;
+}
+
+// The same updates as map-side emits into hash_container's table of 
+// sum_combiners, applied directly or through the batched emit path, which
+// prefetches the slots of a window of emits before applying them
+template<bool Batched>
+static void hash_emit_worker(void* arg, thread_loc const& loc)
+{
+    hash_arg* a = (hash_arg*)arg;
+    batched_hash_table<uint64_t, sum_combiner<uint64_t, std::allocator>, 
+        uint64_t, std::tr1::hash<uint64_t>, std::allocator> table;
+    std::vector<uint64_t> const& keys = *a->keys;
+    for(size_t i = 0; i < keys.size(); i++) {
+        if(Batched)
+            table.emit(keys[i], 1);
+        else
+            table[keys[i]].add(1);
+    }
+    table.flush();
+}
+
+/* Combiner::add on a dense per-thread array of combiners, as on the map side
+ * of array_container. The combiners are allocated once per configuration, 
+ * outside the timed region; buffer_combiner never releases its storage, so 
+ * reallocating them per repetition would mostly measure the allocator. */
+template<template<typename, template<class> class> class Combiner>
+struct combiner_bench
+{
+    typedef Combiner<uint64_t, std::allocator> combiner;
+
+    struct arg_t
+    {
+        std::vector<uint64_t> const* keys;
+        combiner* c;
+    };
+
+    static void worker(void* arg, thread_loc const& loc)
+    {
+        arg_t* a = (arg_t*)arg;
+        combiner* c = a->c;
+        std::vector<uint64_t> const& keys = *a->keys;
+        for(size_t i = 0; i < keys.size(); i++)
+            c[keys[i]].add(1);
+    }
+
+    static stats run(config const& cfg, thread_pool& pool, int t, 
+        uint64_t card, std::vector< std::vector<uint64_t> > const& keys)
+    {
+        std::vector<arg_t> a(t);
+        std::vector<void*> args(t);
+        for(int i = 0; i < t; i++) {
+            a[i].keys = &keys[i];
+            a[i].c = new combiner[card];
+            args[i] = &a[i];
+        }
+        double total_ops = (double)cfg.ops * t;
+        stats s = repeat(cfg.reps, [&]() { 
+            return total_ops / run_pool(pool, worker, &args[0], t) / 1e6; });
+        for(int i = 0; i < t; i++)
+            delete [] a[i].c;
+        return s;
+    }
+};
+
+// task_queue::dequeue until the queue is drained
+struct queue_arg
+{
+    task_queue* q;
+};
+
+static void queue_worker(void* arg, thread_loc const& loc)
+{
+    queue_arg* a = (queue_arg*)arg;
+    task_queue::task_t task;
+    uint64_t sum = 0;
+    while(a->q->dequeue(task, loc))
+        sum += task.id;
+    __asm__ __volatile__("" :: "r" (sum));
+}
+
+static void empty_worker(void* arg, thread_loc const& loc)
+{
+}
+
+// Exposes MapReduceSort::run_merge on pre-built per-thread reduce output
+class MergeBench : public MapReduceSort<MergeBench, uint64_t, uint64_t, uint64_t>
+{
+public:
+    double merge(std::vector<keyval> const* input) {
+        this->final_vals = new std::vector<keyval>[this->num_threads];
+        for(uint64_t i = 0; i < this->num_threads; i++)
+            this->final_vals[i] = input[i];
+        double begin = now();
+        this->run_merge();
+        double elapsed = now() - begin;
+        delete [] this->final_vals;
+        return elapsed;
+    }
+};
+
+static bool enabled(config const& cfg, char const* name)
+{
+    if(cfg.benches.empty())
+        return true;
+    return std::find(cfg.benches.begin(), cfg.benches.end(), name) 
+        != cfg.benches.end();
+}
+
+static void bench_keyed(config const& cfg, reporter& rep)
+{
+    sched_policy_strand_fill policy(0);
+
+    for(size_t ti = 0; ti < cfg.threads.size(); ti++) {
+        int t = cfg.threads[ti];
+        thread_pool pool(t, &policy);
+        std::vector<void*> args(t);
+
+        for(size_t ci = 0; ci < cfg.cards.size(); ci++) {
+            uint64_t card = cfg.cards[ci];
+            for(int d = DIST_UNIFORM; d <= DIST_ZIPF; d++) {
+                std::vector< std::vector<uint64_t> > keys(t);
+                for(int i = 0; i < t; i++)
+                    make_keys(keys[i], cfg.ops, card, (key_dist)d, 
+                        card * 131 + i * 7 + d);
+                double total_ops = (double)cfg.ops * t;
+
+                if(enabled(cfg, "hash_table")) {
+                    std::vector<hash_arg> a(t);
+                    for(int i = 0; i < t; i++) {
+                        a[i].keys = &keys[i];
+                        args[i] = &a[i];
+                    }
+                    stats s = repeat(cfg.reps, [&]() { return total_ops / 
+                        run_pool(pool, hash_worker, &args[0], t) / 1e6; });
+                    rep.row("hash_table", "operator[]", dist_name[d], card, 
+                        t, "Mops/s", s);
+                    s = repeat(cfg.reps, [&]() { return total_ops / 
+                        run_pool(pool, hash_emit_worker<false>, &args[0], t) /
+                        1e6; });
+                    rep.row("hash_table", "emit", dist_name[d], card, 
+                        t, "Mops/s", s);
+                    s = repeat(cfg.reps, [&]() { return total_ops / 
+                        run_pool(pool, hash_emit_worker<true>, &args[0], t) /
+                        1e6; });
+                    rep.row("hash_table", "emit_batched", dist_name[d], card, 
+                        t, "Mops/s", s);
+                }
+
+                if(enabled(cfg, "buffer_combiner")) {
+                    stats s = combiner_bench<buffer_combiner>::run(
+                        cfg, pool, t, card, keys);
+                    rep.row("buffer_combiner", "add", dist_name[d], card, t, 
+                        "Mops/s", s);
+                }
+
+                if(enabled(cfg, "sum_combiner")) {
+                    stats s = combiner_bench<sum_combiner>::run(
+                        cfg, pool, t, card, keys);
+                    rep.row("sum_combiner", "add", dist_name[d], card, t, 
+                        "Mops/s", s);
+                }
+            }
+        }
+    }
+}
+
+static void bench_task_queue(config const& cfg, reporter& rep)
+{
+    sched_policy_strand_fill policy(0);
+    uint64_t tasks = cfg.ops / 16;
+
+    for(size_t ti = 0; ti < cfg.threads.size(); ti++) {
+        int t = cfg.threads[ti];
+        thread_pool pool(t, &policy);
+        std::vector<queue_arg> a(t);
+        std::vector<void*> args(t);
+
+        // "local": tasks spread over all sub-queues as the engine enqueues
+        // them; "steal": every task on sub-queue 0, so all other threads 
+        // steal from one lock.
+        for(int steal = 0; steal <= 1; steal++) {
+            stats s = repeat(cfg.reps, [&]() {
+                task_queue q(t, t);
+                for(uint64_t i = 0; i < tasks; i++) {
+                    task_queue::task_t task = { i, 1, i, 0 };
+                    q.enqueue_seq(task, tasks, steal ? 0 : -1);
+                }
+                for(int i = 0; i < t; i++) {
+                    a[i].q = &q;
+                    args[i] = &a[i];
+                }
+                return tasks / run_pool(pool, queue_worker, &args[0], t) / 1e6;
+            });
+            rep.row("task_queue", steal ? "dequeue_steal" : "dequeue_local",
+                "-", tasks, t, "Mops/s", s);
+        }
+    }
+}
+
+static void bench_thread_pool(config const& cfg, reporter& rep)
+{
+    sched_policy_strand_fill policy(0);
+
+    for(size_t ti = 0; ti < cfg.threads.size(); ti++) {
+        int t = cfg.threads[ti];
+        thread_pool pool(t, &policy);
+        std::vector<void*> args(t, (void*)NULL);
+
+        stats s = repeat(cfg.reps, [&]() {
+            double total = 0;
+            for(int i = 0; i < cfg.rounds; i++)
+                total += run_pool(pool, empty_worker, &args[0], t);
+            return total / cfg.rounds * 1e6;
+        });
+        rep.row("thread_pool", "begin_wait", "-", cfg.rounds, t, "us", s);
+    }
+}
+
+static void bench_merge(config const& cfg, reporter& rep)
+{
+    for(size_t ti = 0; ti < cfg.threads.size(); ti++) {
+        int t = cfg.threads[ti];
+        MergeBench mr;
+        mr.setThreads(t);
+
+        for(size_t ci = 0; ci < cfg.cards.size(); ci++) {
+            uint64_t card = cfg.cards[ci];
+            for(int d = DIST_UNIFORM; d <= DIST_ZIPF; d++) {
+                // ops keyvals in total, as reduce would leave them
+                std::vector<MergeBench::keyval>* input = 
+                    new std::vector<MergeBench::keyval>[t];
+                for(int i = 0; i < t; i++) {
+                    std::vector<uint64_t> keys;
+                    make_keys(keys, cfg.ops / t, card, (key_dist)d, 
+                        card * 17 + i * 3 + d);
+                    input[i].resize(keys.size());
+                    for(size_t j = 0; j < keys.size(); j++) {
+                        MergeBench::keyval kv = { keys[j], j };
+                        input[i][j] = kv;
+                    }
+                }
+                stats s = repeat(cfg.reps, [&]() { 
+                    return (cfg.ops / t) * t / mr.merge(input) / 1e6; });
+                rep.row("MapReduceSort", "run_merge", dist_name[d], card, t, 
+                    "Mkeyvals/s", s);
+                delete [] input;
+            }
+        }
+    }
+}
+
+template<typename T>
+static void parse_list(char const* s, std::vector<T>& out)
+{
+    out.clear();
+    std::string str(s);
+    size_t pos = 0;
+    while(pos <= str.size()) {
+        size_t end = str.find(',', pos);
+        if(end == std::string::npos) end = str.size();
+        std::string item = str.substr(pos, end - pos);
+        if(!item.empty())
+            out.push_back((T)strtoull(item.c_str(), NULL, 10));
+        pos = end + 1;
+    }
+}
+
+static void usage(char const* prog)
+{
+    printf("USAGE: %s [-t threads,...] [-c cardinality,...] [-n ops] "
+        "[-r reps] [-R rounds] [-b bench,...] [-j]\n", prog);
+    printf("  benches: hash_table buffer_combiner sum_combiner task_queue "
+        "thread_pool merge\n");
+    printf("  -n ops per thread, -R thread pool rounds per rep, "
+        "-j JSON output (default CSV)\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    config cfg;
+    int c;
+
+    int ncpus = proc_get_num_cpus();
+    for(int t = 1; t < ncpus; t *= 2)
+        cfg.threads.push_back(t);
+    cfg.threads.push_back(ncpus);
+    cfg.cards.push_back(1 << 10);
+    cfg.cards.push_back(1 << 14);
+    cfg.cards.push_back(1 << 18);
+    cfg.reps = DEF_REPS;
+    cfg.ops = DEF_OPS;
+    cfg.rounds = DEF_ROUNDS;
+    cfg.json = false;
+
+    while((c = getopt(argc, argv, "t:c:n:r:R:b:j")) != EOF) {
+        switch(c) {
+            case 't': parse_list(optarg, cfg.threads); break;
+            case 'c': parse_list(optarg, cfg.cards); break;
+            case 'n': cfg.ops = strtoull(optarg, NULL, 10); break;
+            case 'r': cfg.reps = atoi(optarg); break;
+            case 'R': cfg.rounds = atoi(optarg); break;
+            case 'b': {
+                std::string str(optarg);
+                size_t pos = 0;
+                while(pos <= str.size()) {
+                    size_t end = str.find(',', pos);
+                    if(end == std::string::npos) end = str.size();
+                    cfg.benches.push_back(str.substr(pos, end - pos));
+                    pos = end + 1;
+                }
+                break;
+            }
+            case 'j': cfg.json = true; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if(cfg.threads.empty() || cfg.cards.empty() || cfg.reps <= 0 || 
+        cfg.ops == 0 || cfg.rounds <= 0)
+        usage(argv[0]);
+    for(size_t i = 0; i < cfg.threads.size(); i++)
+        if(cfg.threads[i] <= 0) usage(argv[0]);
+    for(size_t i = 0; i < cfg.cards.size(); i++)
+        if(cfg.cards[i] == 0) usage(argv[0]);
+
+    reporter rep(cfg.json);
+    if(enabled(cfg, "hash_table") || enabled(cfg, "buffer_combiner") || 
+        enabled(cfg, "sum_combiner"))
+        bench_keyed(cfg, rep);
+    if(enabled(cfg, "task_queue"))
+        bench_task_queue(cfg, rep);
+    if(enabled(cfg, "thread_pool"))
+        bench_thread_pool(cfg, rep);
+    if(enabled(cfg, "merge"))
+        bench_merge(cfg, rep);
+
+    return 0;
+}
+
+// vim: ts=8 sw=4 sts=4 smarttab smartindent
@@ -0,0 +1,174 @@
+/* Copyright (c) 2007-2011, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the names of its 
+*       contributors may be used to endorse or promote products derived from 
+*       this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#ifndef ACCOUNTING_H_
+#define ACCOUNTING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <atomic>
+
+#include "stddefines.h"
+
+// Bytes held by one thread in one account. Frees are charged to the thread
+// that makes them, so a thread's bytes can go negative when it frees what
+// another thread allocated; the account's total is still exact.
+struct mem_counter
+{
+    int64_t bytes;
+    int64_t peak;           // high-water mark of bytes since reset_peaks()
+    int64_t limit;          // this thread's share of the limit, 0 for none
+    std::atomic<bool>* exceeded;
+    char pad[L2_CACHE_LINE_SIZE - 3*sizeof(int64_t) - sizeof(void*)];
+
+    void add(int64_t n) {
+        bytes += n;
+        if(bytes > peak) {
+            peak = bytes;
+            if(limit != 0 && bytes > limit)
+                exceeded->store(true, std::memory_order_relaxed);
+        }
+    }
+};
+
+/* Byte counters for the memory a job holds, one per worker thread plus one
+ * for the master. Allocations are charged to the account a thread has
+ * entered with mem_account::scope, through counted_allocator (the default
+ * allocator of the containers and combiners) or explicit charge() calls;
+ * outside any scope nothing is counted. With a soft limit set, a thread
+ * that holds more than its share of it marks the account exceeded(), which
+ * the engine checks between tasks. */
+class mem_account
+{
+    mem_counter* counters;
+    int n;
+    int64_t limit;
+    std::atomic<bool> over;     // set by any thread, read between tasks
+public:
+    mem_account() : counters(NULL), n(0), limit(0), over(false) {}
+    ~mem_account() { delete [] counters; }
+
+    // Clears the counters for THREADS workers and, at index THREADS, the
+    // master.
+    void reset(int threads, int64_t limit) {
+        delete [] counters;
+        n = threads + 1;
+        counters = new mem_counter[n];
+        this->limit = limit;
+        over.store(false, std::memory_order_relaxed);
+        for(int i = 0; i < n; i++) {
+            counters[i].bytes = counters[i].peak = 0;
+            counters[i].limit = limit / (threads > 0 ? threads : 1);
+            counters[i].exceeded = &over;
+        }
+    }
+
+    // Starts a new high-water mark from the bytes now held.
+    void reset_peaks() {
+        for(int i = 0; i < n; i++)
+            counters[i].peak = counters[i].bytes;
+    }
+
+    int threads() const { return n; }
+    mem_counter const& counter(int thread) const { return counters[thread]; }
+    bool exceeded() const { return over.load(std::memory_order_relaxed); }
+    int64_t get_limit() const { return limit; }
+
+    int64_t bytes() const {
+        int64_t b = 0;
+        for(int i = 0; i < n; i++) b += counters[i].bytes;
+        return b;
+    }
+
+    // Sum of the per-thread high-water marks; a bound on the account's own.
+    int64_t peak() const {
+        int64_t b = 0;
+        for(int i = 0; i < n; i++) b += counters[i].peak;
+        return b;
+    }
+
+    // The counter this thread charges, if any.
+    static mem_counter*& current() {
+        static __thread mem_counter* c = NULL;
+        return c;
+    }
+
+    static void charge(int64_t bytes) {
+        mem_counter* c = current();
+        if(c != NULL) c->add(bytes);
+    }
+
+    // Charges the calling thread's allocations to THREAD's counter of an
+    // account until destroyed.
+    class scope
+    {
+        mem_counter* saved;
+    public:
+        scope(mem_account& a, int thread) : saved(current()) {
+            current() = &a.counters[thread];
+        }
+        ~scope() { current() = saved; }
+    };
+};
+
+// std::allocator that charges what it allocates to the current account.
+template<class T>
+class counted_allocator : public std::allocator<T>
+{
+public:
+    template<class U> struct rebind { typedef counted_allocator<U> other; };
+
+    counted_allocator() {}
+    counted_allocator(counted_allocator const&) {}
+    template<class U> counted_allocator(counted_allocator<U> const&) {}
+
+    T* allocate(size_t n, void const* hint = 0) {
+        mem_account::charge((int64_t)(n * sizeof(T)));
+        return std::allocator<T>::allocate(n);
+    }
+
+    void deallocate(T* p, size_t n) {
+        mem_account::charge(-(int64_t)(n * sizeof(T)));
+        std::allocator<T>::deallocate(p, n);
+    }
+};
+
+template<class T, class U>
+inline bool operator==(counted_allocator<T> const&, counted_allocator<U> const&)
+{
+    return true;
+}
+
+template<class T, class U>
+inline bool operator!=(counted_allocator<T> const&, counted_allocator<U> const&)
+{
+    return false;
+}
+
+#endif /* ACCOUNTING_H_ */
+
+// vim: ts=8 sw=4 sts=4 smarttab smartindent
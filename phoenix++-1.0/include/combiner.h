@@ -30,19 +30,30 @@
 #include <deque>
 #include <vector>
 
+#include "accounting.h"
+
 // The assumption with a combiner is that it will be very cheap to copy 
 // (e.g. as cheap as a pointer or two)
 
 // the buffer combiner does no combining, it just queues up the values 
 // for the reducer.
-template<typename V, template<class> class Allocator = std::allocator>
+template<typename V, template<class> class Allocator = counted_allocator>
 class buffer_combiner
 {
     std::deque<V, Allocator<V> >* data;
 
 public:    
-    buffer_combiner() : data(new std::deque<V, Allocator<V> >) {}
+    // whether the combiner keeps every value it is given, and about how 
+    // many bytes of storage it allocates besides them once it has any
+    static const bool buffered = true;
+    static const size_t storage_bytes = 
+        sizeof(std::deque<V, Allocator<V> >) + 512 + 8*sizeof(V*);
+
+    // the buffer is allocated on the first add, so the empty combiners
+    // filling a table's free slots cost no storage
+    buffer_combiner() : data(NULL) {}
     void add(V const& v) {
+        if (data == NULL) data = new std::deque<V, Allocator<V> >;
         // add some randomness here...
         if (rand() % 100 > 50) {
             data->push_back(v);
@@ -53,7 +64,13 @@ public:
     }
 
     bool empty() const {
-        return data->size() == 0;
+        return data == NULL || data->size() == 0;
+    }
+
+    // frees the values; for combiners no combined refers to any more
+    void release() {
+        delete data;
+        data = NULL;
     }
 
     class combined
@@ -66,6 +83,7 @@ public:
         combined() : current_list(0), current_index(0), n_items(0) {}
 
         void add(buffer_combiner<V, Allocator> const* c) {
+            if(c->data == NULL) return;
             items.push_back(c->data);
             n_items += c->data->size();
         }
@@ -119,13 +137,16 @@ public:
 
 #ifndef MUST_REDUCE
 
-template<class Impl, typename V, template<class> class Allocator = std::allocator>
+template<class Impl, typename V, template<class> class Allocator = counted_allocator>
 class associative_combiner
 {
 public:
     V data;
     bool _empty;
 public:
+    static const bool buffered = false;
+    static const size_t storage_bytes = 0;
+
     associative_combiner() : _empty(true) {Impl::Init(data);}
 
     void add(V const& v) {
@@ -133,10 +154,24 @@ public:
         _empty = false;
     }
 
+    // add() for a combiner that already holds a value, while other threads
+    // may be adding to it too. V must be trivially copyable.
+    void add_atomic(V const& v) {
+        V seen, next;
+        __atomic_load(&data, &seen, __ATOMIC_RELAXED);
+        do {
+            next = seen;
+            Impl::F(next, v);
+        } while(!__atomic_compare_exchange(&data, &seen, &next, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
     bool empty() const {
         return _empty;
     }
 
+    void release() {}
+
     class combined
     {
         V m;
@@ -178,19 +213,28 @@ public:
 
 #else
 
-template<class Impl, typename V, template<class> class Allocator = std::allocator>
+template<class Impl, typename V, template<class> class Allocator = counted_allocator>
 class associative_combiner
 {
     std::vector<V, Allocator<V> >* data;
 
 public:    
-    associative_combiner() : data(new std::vector<V, Allocator<V> >) {}
+    static const bool buffered = true;
+    static const size_t storage_bytes = sizeof(std::vector<V, Allocator<V> >);
+
+    associative_combiner() : data(NULL) {}
     void add(V const& v) {
+        if (data == NULL) data = new std::vector<V, Allocator<V> >;
         data->push_back(v);
     }
 
     bool empty() const {
-        return data->size() == 0;
+        return data == NULL || data->size() == 0;
+    }
+
+    void release() {
+        delete data;
+        data = NULL;
     }
 
     class combined
@@ -203,6 +247,7 @@ public:
         combined() : done(false), n_items(0) {}
 
         void add(associative_combiner<Impl, V, Allocator> const* c) {
+            if(c->data == NULL) return;
             items.push_back(c->data);
             n_items += c->data->size();
         }
@@ -248,7 +293,7 @@ public:
 
 #endif
 
-template<class V, template<class> class Allocator = std::allocator>
+template<class V, template<class> class Allocator = counted_allocator>
 class sum_combiner : public associative_combiner<sum_combiner<V, Allocator>, V, Allocator> 
 {
 public:
@@ -256,7 +301,7 @@ public:
      static void Init(V& a) { a = 0; }
 };
 
-template<class V, template<class> class Allocator = std::allocator>
+template<class V, template<class> class Allocator = counted_allocator>
 class one_combiner : public associative_combiner<one_combiner<V, Allocator>, V, Allocator> 
 {
 public:
@@ -30,10 +30,25 @@
 #include <tr1/unordered_map>
 #include <list>
 #include <map>
+#include <queue>
+#include <string>
+#include <fstream>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <unistd.h>
+
+#include "stddefines.h"
+#include "processor.h"
+#include "accounting.h"
+#include "serialize.h"
 
 // storage for flexible cardinality keys
 template<typename K, typename V, class Hash=std::tr1::hash<K>, 
-    template<class> class Allocator = std::allocator>
+    template<class> class Allocator = counted_allocator>
 class hash_table
 {
 private:
@@ -74,7 +89,34 @@ public:
 
     V& operator[] (K const& key) 
     {
-        uint64_t index = kh(key) & (size-1);
+        return find(key, kh(key));
+    }
+
+    uint64_t capacity() const
+    {
+        return size;
+    }
+
+    uint64_t count() const
+    {
+        return load;
+    }
+
+    // Two-phase access for batched updates: hash() a key once, prefetch()
+    // its slot, and find() it later, when the slot is likely in cache.
+    uint64_t hash(K const& key) const
+    {
+        return kh(key);
+    }
+
+    void prefetch(uint64_t hash) const
+    {
+        __builtin_prefetch(&table[hash & (size-1)], 1);
+    }
+
+    V& find(K const& key, uint64_t hash)
+    {
+        uint64_t index = hash & (size-1);
         while(occupied[index] && !(table[index].first == key)) {
             index = (index+1) & (size-1);
         }
@@ -85,7 +127,7 @@ public:
             load++;
             if(load >= size>>1) {
                 rehash(size<<1);
-                index = kh(key) & (size-1);
+                index = hash & (size-1);
                 while(occupied[index] && !(table[index].first == key)) {
                     index = (index+1) & (size-1);
                 }
@@ -137,10 +179,79 @@ public:
     }
 };
 
+// A hash_table of combiners that takes emits in batches. Emits are hashed,
+// their slots prefetched, and held until WINDOW of them are pending; the
+// batch is then applied, by which time most of its slots are in cache, so
+// the cache misses of independent lookups overlap instead of stalling each
+// emit in turn. A table that still fits in L2 gains nothing from this and
+// takes its emits directly. Emits are applied in order, so each key gets
+// its values in the order they were emitted. flush() applies the pending 
+// emits.
+template<typename K, typename C, typename V, class Hash, 
+    template<class> class Allocator, int WINDOW = 16>
+class batched_hash_table : public hash_table<K, C, Hash, Allocator>
+{
+    struct pending
+    {
+        uint64_t hash;
+        K key;
+        V value;
+    };
+    pending window[WINDOW];
+    int queued;
+    uint64_t direct_size;
+public:
+    static const int window_size = WINDOW;
+
+    batched_hash_table() : queued(0)
+    {
+        direct_size = proc_get_cache_size(2) / sizeof(std::pair<K, C>);
+    }
+
+    void emit(K const& key, V const& value)
+    {
+        uint64_t h = this->hash(key);
+        if(this->capacity() <= direct_size) {
+            this->find(key, h).add(value);
+            return;
+        }
+        this->prefetch(h);
+        pending& p = window[queued];
+        p.hash = h;
+        p.key = key;
+        p.value = value;
+        if(++queued == WINDOW)
+            flush();
+    }
+
+    void flush()
+    {
+        for(int i = 0; i < queued; i++)
+            this->find(window[i].key, window[i].hash).add(window[i].value);
+        queued = 0;
+    }
+};
+
+// Applies an emit to a map-side container: the combiner of the key, for
+// the array and hash tables, or the window of a batched_hash_table.
+template<typename In, typename K, typename V>
+inline void emit_into(In& i, K const& key, V const& value)
+{
+    i[key].add(value);
+}
+
+template<typename K, typename C, typename V, class Hash, 
+    template<class> class Allocator, int WINDOW>
+inline void emit_into(batched_hash_table<K, C, V, Hash, Allocator, WINDOW>& i,
+    K const& key, V const& value)
+{
+    i.emit(key, value);
+}
+
 template<typename K, typename V, 
     template<typename, template<class> class> class Combiner, 
     class Hash = std::tr1::hash<K>, 
-    template<class> class Allocator = std::allocator>
+    template<class> class Allocator = counted_allocator>
 class hash_container
 {
 public:
@@ -148,12 +259,13 @@ public:
     typedef V value_type;
     typedef std::pair<const K, Combiner<V, Allocator> > constKCV;
     typedef std::pair<K, Combiner<V, Allocator> > KCV;
-private:
+protected:
     std::vector< KCV, Allocator<KCV> >* vals; 
     uint64_t in_size, out_size;
 public:
 
-    typedef hash_table<K, Combiner<V, Allocator>, Hash, Allocator > input_type;
+    typedef batched_hash_table<K, Combiner<V, Allocator>, V, Hash, Allocator > 
+        input_type;
     typedef typename Combiner<V, Allocator>::combined output_type;
 
     hash_container() : vals(NULL), in_size(0), out_size(0) {}
@@ -176,8 +288,9 @@ public:
         return i;
     }
 
-    void add(uint64_t in_index, input_type const& j)
+    void add(uint64_t in_index, input_type& j)
     {
+        j.flush();
         Hash kh;
         for(typename input_type::const_iterator i = j.begin(); i != j.end(); ++i)
         {
@@ -228,15 +341,365 @@ public:
     }
 };
 
-// Storage for fixed cardinality keys
+// A map thread's handle on a shared table, which batches its emits like 
+// batched_hash_table: an emit's slot is prefetched and the emit held until
+// WINDOW are pending; the batch then prefetches the nodes its slots point
+// at before applying the emits in order. flush() applies pending emits.
+template<class Table, int WINDOW = 16>
+class shared_hash_emitter
+{
+    typedef typename Table::key_type K;
+    typedef typename Table::value_type V;
+    struct pending
+    {
+        uint64_t hash;
+        K key;
+        V value;
+    };
+    Table* t;
+    pending window[WINDOW];
+    int queued;
+public:
+    explicit shared_hash_emitter(Table* t) : t(t), queued(0) {}
+
+    void emit(K const& key, V const& value)
+    {
+        uint64_t h = t->hash(key);
+        t->prefetch_slot(h);
+        pending& p = window[queued];
+        p.hash = h;
+        p.key = key;
+        p.value = value;
+        if(++queued == WINDOW)
+            flush();
+    }
+
+    void flush()
+    {
+        for(int i = 0; i < queued; i++)
+            t->prefetch_node(window[i].hash);
+        for(int i = 0; i < queued; i++)
+            t->emit(window[i].key, window[i].value, window[i].hash);
+        queued = 0;
+    }
+};
+
+template<class Table, int WINDOW, typename K, typename V>
+inline void emit_into(shared_hash_emitter<Table, WINDOW>& i, K const& key, 
+    V const& value)
+{
+    i.emit(key, value);
+}
+
+// Storage for flexible cardinality keys in one table shared by all map 
+// threads rather than a table per thread, so each key is stored once no 
+// matter how many threads emit it, and reduce tasks have nothing to merge.
+// The table is split by hash into segments, each with a lock that only 
+// inserts take. Lookups don't lock: keys live in nodes that never move, 
+// and a segment that grows publishes a new slot array but keeps the old 
+// ones until the container is cleared, so a lookup on a stale array is 
+// safe and, on a miss, retries under the lock. When the combiner is 
+// associative and V fits a lock-free atomic, values are combined into an
+// existing key in place with compare-and-swap, so only a key's first emit
+// locks; other combiners add under the segment lock. Reduce task i takes 
+// segments i, i + out_size, i + 2*out_size...
 template<typename K, typename V, 
-	template<typename, template<class> class> class Combiner, int N, 
-	template<class> class Allocator = std::allocator>
-class array_container
+    template<typename, template<class> class> class Combiner, 
+    class Hash = std::tr1::hash<K>, 
+    template<class> class Allocator = counted_allocator>
+class shared_hash_container
+{
+public:
+    typedef K key_type;
+    typedef V value_type;
+    typedef Combiner<V, Allocator> combiner_type;
+    typedef shared_hash_emitter<shared_hash_container> input_type;
+    typedef typename combiner_type::combined output_type;
+
+    // whether emits to keys already present skip the lock
+    static const bool in_place = !combiner_type::buffered &&
+        std::is_trivially_copyable<V>::value && 
+        __atomic_always_lock_free(sizeof(V), 0);
+
+private:
+    struct node
+    {
+        K key;
+        uint64_t hash;
+        combiner_type c;
+    };
+
+    struct table
+    {
+        uint64_t size;
+        std::atomic<node*>* slots;
+        table* prev;                    // the table this one replaced
+    };
+
+    static const int BLOCK = 64;
+    struct block
+    {
+        node nodes[BLOCK];
+        block* next;
+    };
+
+    struct segment
+    {
+        std::mutex m;
+        std::atomic<table*> current;
+        uint64_t count;
+        block* blocks;                  // newest first
+        int used;                       // nodes used in the newest block
+    };
+
+    segment* segments;
+    uint64_t num_segments;
+    int segment_bits;
+    uint64_t in_size, out_size;
+    Hash kh;
+
+    table* new_table(uint64_t size, table* prev)
+    {
+        table* t = Allocator<table>().allocate(1);
+        t->size = size;
+        t->prev = prev;
+        t->slots = Allocator< std::atomic<node*> >().allocate(size);
+        for(uint64_t i = 0; i < size; i++)
+            new (&t->slots[i]) std::atomic<node*>(NULL);
+        return t;
+    }
+
+    node* find(table const* t, K const& key, uint64_t h) const
+    {
+        uint64_t mask = t->size - 1;
+        for(uint64_t i = (h >> segment_bits) & mask;; i = (i+1) & mask) {
+            node* n = t->slots[i].load(std::memory_order_acquire);
+            if(n == NULL)
+                return NULL;
+            if(n->hash == h && n->key == key)
+                return n;
+        }
+    }
+
+    void place(table* t, node* n)
+    {
+        uint64_t mask = t->size - 1;
+        uint64_t i = (n->hash >> segment_bits) & mask;
+        while(t->slots[i].load(std::memory_order_relaxed) != NULL)
+            i = (i+1) & mask;
+        t->slots[i].store(n, std::memory_order_release);
+    }
+
+    // Adds N, filled in, to the segment; with its lock held.
+    void insert(segment& s, table* t, node* n)
+    {
+        if(++s.count * 2 > t->size) {
+            table* g = new_table(t->size * 2, t);
+            for(uint64_t i = 0; i < t->size; i++) {
+                node* o = t->slots[i].load(std::memory_order_relaxed);
+                if(o != NULL)
+                    place(g, o);
+            }
+            place(g, n);
+            s.current.store(g, std::memory_order_release);
+        } else {
+            place(t, n);
+        }
+    }
+
+    node* new_node(segment& s, K const& key, uint64_t h)
+    {
+        if(s.blocks == NULL || s.used == BLOCK) {
+            block* b = Allocator<block>().allocate(1);
+            b->next = s.blocks;
+            s.blocks = b;
+            s.used = 0;
+        }
+        node* n = new (&s.blocks->nodes[s.used++]) node();
+        n->key = key;
+        n->hash = h;
+        return n;
+    }
+
+    static void combine(combiner_type& c, V const& v, std::true_type)
+    {
+        c.add_atomic(v);
+    }
+
+    static void combine(combiner_type& c, V const& v, std::false_type)
+    {
+        c.add(v);
+    }
+
+    void clear()
+    {
+        for(uint64_t i = 0; i < num_segments; i++) {
+            segment& s = segments[i];
+            int used = s.used;
+            for(block* b = s.blocks; b != NULL; ) {
+                for(int j = 0; j < used; j++) {
+                    b->nodes[j].c.release();
+                    b->nodes[j].~node();
+                }
+                block* next = b->next;
+                Allocator<block>().deallocate(b, 1);
+                b = next;
+                used = BLOCK;
+            }
+            for(table* t = s.current.load(); t != NULL; ) {
+                table* prev = t->prev;
+                Allocator< std::atomic<node*> >().deallocate(t->slots, t->size);
+                Allocator<table>().deallocate(t, 1);
+                t = prev;
+            }
+        }
+        delete [] segments;
+        mem_account::charge(-(int64_t)(num_segments * sizeof(segment)));
+        segments = NULL;
+        num_segments = 0;
+    }
+
+public:
+    shared_hash_container() : segments(NULL), num_segments(0), 
+        segment_bits(0), in_size(0), out_size(0) {}
+
+    virtual ~shared_hash_container()
+    {
+        clear();
+    }
+
+    void init(uint64_t in_size, uint64_t out_size)
+    {
+        clear();
+        this->in_size = in_size;
+        this->out_size = out_size;
+        // enough segments that threads seldom meet on a lock, and at least
+        // one per reduce task
+        segment_bits = 8;
+        while((1ULL << segment_bits) < std::max(64 * in_size, out_size))
+            segment_bits++;
+        num_segments = 1ULL << segment_bits;
+        segments = new segment[num_segments];
+        mem_account::charge(num_segments * sizeof(segment));
+        for(uint64_t i = 0; i < num_segments; i++) {
+            segments[i].current.store(new_table(16, NULL));
+            segments[i].count = 0;
+            segments[i].blocks = NULL;
+            segments[i].used = 0;
+        }
+    }
+
+    input_type get(uint64_t in_index)
+    {
+        return input_type(this);
+    }
+
+    void add(uint64_t in_index, input_type& j)
+    {
+        j.flush();
+    }
+
+    // Emits in three steps, so a batch of them can overlap their cache 
+    // misses: hash() the key, prefetch its slot and then the node in the
+    // slot, and emit() it.
+    uint64_t hash(K const& key) const
+    {
+        return kh(key);
+    }
+
+    void prefetch_slot(uint64_t h) const
+    {
+        table const* t = segments[h & (num_segments-1)].current.load(
+            std::memory_order_acquire);
+        __builtin_prefetch(&t->slots[(h >> segment_bits) & (t->size-1)]);
+    }
+
+    void prefetch_node(uint64_t h) const
+    {
+        table const* t = segments[h & (num_segments-1)].current.load(
+            std::memory_order_acquire);
+        node const* n = t->slots[(h >> segment_bits) & (t->size-1)].load(
+            std::memory_order_acquire);
+        if(n != NULL)
+            __builtin_prefetch(n);
+    }
+
+    void emit(K const& key, V const& value, uint64_t h)
+    {
+        segment& s = segments[h & (num_segments-1)];
+        if(in_place) {
+            node* n = find(s.current.load(std::memory_order_acquire), key, h);
+            if(n != NULL) {
+                combine(n->c, value, std::integral_constant<bool, in_place>());
+                return;
+            }
+        }
+
+        std::lock_guard<std::mutex> l(s.m);
+        table* t = s.current.load(std::memory_order_relaxed);
+        node* n = find(t, key, h);
+        if(n != NULL) {
+            combine(n->c, value, std::integral_constant<bool, in_place>());
+            return;
+        }
+        // a new key is published only after its first value is in, so an
+        // in-place add never finds an empty combiner
+        n = new_node(s, key, h);
+        n->c.add(value);
+        insert(s, t, n);
+    }
+
+    class iterator
+    {
+    private:
+        shared_hash_container const* c;
+        uint64_t index, slot;
+    public:
+        iterator(shared_hash_container const* c, uint64_t index) : 
+            c(c), index(index), slot(0) {}
+
+        bool next(K& key, output_type& values)
+        {
+            while(index < c->num_segments) {
+                table const* t = c->segments[index].current.load(
+                    std::memory_order_acquire);
+                while(slot < t->size) {
+                    node const* n = 
+                        t->slots[slot++].load(std::memory_order_acquire);
+                    if(n != NULL) {
+                        key = n->key;
+                        values.clear();
+                        values.add(&n->c);
+                        return true;
+                    }
+                }
+                index += c->out_size;
+                slot = 0;
+            }
+            return false;
+        }
+    };
+
+    iterator begin(uint64_t out_index)
+    {
+        return iterator(this, out_index);
+    }
+};
+
+// Storage for dense keys whose range is only known at run time. Each 
+// thread fills its own array of combiners, which are laid out by key 
+// across threads for the reduce. The key range [0, num_keys) must be set 
+// with set_num_keys() before the MapReduce runs, e.g. in the constructor
+// of the MapReduce implementation.
+template<typename K, typename V, 
+    template<typename, template<class> class> class Combiner, 
+    template<class> class Allocator = counted_allocator>
+class dynamic_array_container
 {
 private:
     Combiner<V, Allocator>* vals;
     uint64_t in_size, out_size;
+    uint64_t num_keys;
 public:
 
     typedef K key_type;
@@ -245,62 +708,70 @@ public:
     typedef Combiner<V, Allocator>* input_type;
     typedef typename Combiner<V, Allocator>::combined output_type;
 
-    array_container() : vals(NULL), in_size(0), out_size(0) {}
+    dynamic_array_container() : 
+        vals(NULL), in_size(0), out_size(0), num_keys(0) {}
+
+    void set_num_keys(uint64_t num_keys)
+    {
+        this->num_keys = num_keys;
+    }
+
+    uint64_t get_num_keys() const { return num_keys; }
 
     void init(uint64_t in_size, uint64_t out_size)
     {
         this->in_size = in_size;
         this->out_size = out_size;
-        vals = new Combiner<V, Allocator>[this->in_size * N];
+        delete [] vals;
+        vals = new Combiner<V, Allocator>[this->in_size * num_keys];
+        mem_account::charge(
+            this->in_size * num_keys * sizeof(Combiner<V, Allocator>));
     }
  
-    virtual ~array_container() 
+    virtual ~dynamic_array_container() 
     {
         delete [] vals;
     }
 
-
     void add(uint64_t in_index, input_type const& j)
     {
-        for(uint64_t i = 0; i < N; ++i)
+        for(uint64_t i = 0; i < num_keys; ++i)
         {
-	    vals[i*in_size + in_index] = j[i];
+            vals[i*in_size + in_index] = j[i];
         }
         delete [] j;
+        mem_account::charge(
+            -(int64_t)(num_keys * sizeof(Combiner<V, Allocator>)));
     }
 
     input_type get(uint64_t in_index)
     {
-	//switch to use allocator here...
-        input_type r = new Combiner<V, Allocator>[N];
-        for(uint64_t i = 0; i < N; ++i)
-        {
-	    r[i] = Combiner<V, Allocator>();
-        }
-        return r;
+        mem_account::charge(num_keys * sizeof(Combiner<V, Allocator>));
+        return new Combiner<V, Allocator>[num_keys];
     }
 
     class iterator
     {
     private:
-        array_container<K, V, Combiner, N, Allocator> const* ac;
-        uint64_t index, i;
+        dynamic_array_container<K, V, Combiner, Allocator> const* ac;
+        uint64_t i;
     public:
-        iterator(array_container const* ac, uint64_t index) : 
-            ac(ac), index(index), i(index) {}
+        iterator(dynamic_array_container const* ac, uint64_t index) : 
+            ac(ac), i(index) {}
        
         bool next(K& key, output_type& values)
         {
-            if(i >= N)
+            if(i >= ac->num_keys)
                 return false;
             key = (K)i;
             values.clear();
+            Combiner<V, Allocator> const* c = &ac->vals[i*ac->in_size];
             for(size_t j = 0; j < ac->in_size; j++)
             {
-                if(!ac->vals[i*ac->in_size+j].empty())
-                    values.add(&ac->vals[i*ac->in_size+j]);
+                if(!c[j].empty())
+                    values.add(&c[j]);
             }
-            i += ac->in_size;	// XXX: in_size == num reduce threads
+            i += ac->out_size;
             return true;
         }
     };
@@ -311,16 +782,30 @@ public:
     }
 };
 
-// Unlocked storage, everyone writes to the same array. 
-// Assumes that only a single task needs to write to an entry.
+// Storage for fixed cardinality keys
 template<typename K, typename V, 
-    template<typename, template<class> class> class Combiner, int N, 
-    template<class> class Allocator = std::allocator>
-class common_array_container
+	template<typename, template<class> class> class Combiner, int N, 
+	template<class> class Allocator = counted_allocator>
+class array_container : 
+    public dynamic_array_container<K, V, Combiner, Allocator>
+{
+public:
+    array_container() { this->set_num_keys(N); }
+};
+
+// Unlocked storage for dense keys whose range is only known at run time.
+// Everyone writes to the same array, so only a single task may write to 
+// an entry. The key range [0, num_keys) must be set with set_num_keys() 
+// before the MapReduce runs.
+template<typename K, typename V, 
+    template<typename, template<class> class> class Combiner, 
+    template<class> class Allocator = counted_allocator>
+class dynamic_common_array_container
 {
 private:
     Combiner<V, Allocator>* vals;
     uint64_t in_size, out_size;
+    uint64_t num_keys;
 public:
 
     typedef K key_type;
@@ -329,20 +814,26 @@ public:
     typedef Combiner<V, Allocator>* input_type;
     typedef typename Combiner<V, Allocator>::combined output_type;
 
-    common_array_container() : vals(NULL), in_size(0), out_size(0) {}
+    dynamic_common_array_container() : 
+        vals(NULL), in_size(0), out_size(0), num_keys(0) {}
+
+    void set_num_keys(uint64_t num_keys)
+    {
+        this->num_keys = num_keys;
+    }
+
+    uint64_t get_num_keys() const { return num_keys; }
 
     void init(uint64_t in_size, uint64_t out_size)
     {
         this->in_size = in_size;
         this->out_size = out_size;
-        vals = new Combiner<V, Allocator>[N];
-        for(uint64_t i = 0; i < N; ++i)
-        {
-	    vals[i] = Combiner<V, Allocator>();
-        }
+        delete [] vals;
+        vals = new Combiner<V, Allocator>[num_keys];
+        mem_account::charge(num_keys * sizeof(Combiner<V, Allocator>));
     }
  
-    virtual ~common_array_container() 
+    virtual ~dynamic_common_array_container() 
     {
         delete [] vals;
     }
@@ -360,20 +851,122 @@ public:
     class iterator
     {
     private:
-        common_array_container<K, V, Combiner, N, Allocator> const* ac;
-        uint64_t index, i;
+        dynamic_common_array_container<K, V, Combiner, Allocator> const* ac;
+        uint64_t i;
     public:
-        iterator(common_array_container const* ac, uint64_t index) : 
-            ac(ac), index(index), i(index) {}
+        iterator(dynamic_common_array_container const* ac, uint64_t index) :
+            ac(ac), i(index) {}
        
         bool next(K& key, output_type& values)
         {
-            if(i >= N)
+            if(i >= ac->num_keys)
                 return false;
             key = (K)i;
             values.clear();
             values.add(&ac->vals[i]);
-            i += ac->in_size;
+            i += ac->out_size;
+            return true;
+        }
+    };
+
+    iterator begin(uint64_t out_index)
+    {
+        return iterator(this, out_index);
+    }
+};
+
+// Unlocked storage, everyone writes to the same array. 
+// Assumes that only a single task needs to write to an entry.
+template<typename K, typename V, 
+    template<typename, template<class> class> class Combiner, int N, 
+    template<class> class Allocator = counted_allocator>
+class common_array_container : 
+    public dynamic_common_array_container<K, V, Combiner, Allocator>
+{
+public:
+    common_array_container() { this->set_num_keys(N); }
+};
+
+// Storage for dense keys whose range isn't known in advance, such as the
+// ids of a string_interner. Each thread fills its own array of combiners,
+// which grows as larger keys arrive; the reduce combines key i of every 
+// thread's array, with no hashing or key comparison.
+template<typename K, typename V, 
+    template<typename, template<class> class> class Combiner, 
+    template<class> class Allocator = counted_allocator>
+class id_array_container
+{
+    typedef Combiner<V, Allocator> combiner_type;
+    typedef std::vector<combiner_type, Allocator<combiner_type> > array_type;
+
+    std::vector<array_type> vals;
+    uint64_t in_size, out_size;
+public:
+
+    typedef K key_type;
+    typedef V value_type;
+
+    class input_type
+    {
+        array_type vals;
+        friend class id_array_container;
+    public:
+        combiner_type& operator[](K const& key)
+        {
+            if((uint64_t)key >= vals.size())
+                vals.resize(std::max<uint64_t>((uint64_t)key + 1, 
+                    vals.size() * 2));
+            return vals[key];
+        }
+    };
+    typedef typename combiner_type::combined output_type;
+
+    id_array_container() : in_size(0), out_size(0) {}
+
+    void init(uint64_t in_size, uint64_t out_size)
+    {
+        this->in_size = in_size;
+        this->out_size = out_size;
+        vals.clear();
+        vals.resize(in_size);
+    }
+
+    input_type get(uint64_t in_index)
+    {
+        return input_type();
+    }
+
+    void add(uint64_t in_index, input_type& j)
+    {
+        vals[in_index].swap(j.vals);
+    }
+
+    class iterator
+    {
+    private:
+        id_array_container<K, V, Combiner, Allocator> const* ac;
+        uint64_t i, num_keys;
+    public:
+        iterator(id_array_container const* ac, uint64_t index) : 
+            ac(ac), i(index), num_keys(0)
+        {
+            for(size_t j = 0; j < ac->in_size; j++)
+                num_keys = std::max<uint64_t>(num_keys, ac->vals[j].size());
+        }
+
+        bool next(K& key, output_type& values)
+        {
+            if(i >= num_keys)
+                return false;
+            key = (K)i;
+            values.clear();
+            for(size_t j = 0; j < ac->in_size; j++)
+            {
+                array_type const& v = ac->vals[j];
+                if(i < v.size() && !v[i].empty())
+                    values.add(&v[i]);
+            }
+            i += ac->out_size;
             return true;
         }
     };
@@ -388,7 +981,7 @@ public:
 template<typename K, typename V, 
     template<typename, template<class> class> class Combiner, int N, 
     class Hash = std::tr1::hash<K>,
-    template<class> class Allocator = std::allocator>
+    template<class> class Allocator = counted_allocator>
 class fixed_hash_container
 {
 private:
@@ -410,11 +1003,13 @@ private:
                 // NOTE: These buckets will be freed during the reduce phase
                 buckets[i] = new hash_bucket();
             }
+            mem_account::charge(N * (sizeof(hash_bucket*) + sizeof(hash_bucket)));
         }
 
         ~hash_table()
         {
             delete [] buckets;
+            mem_account::charge(-(int64_t)(N * sizeof(hash_bucket*)));
         }
 
         Combiner<V, Allocator>& operator[] (K const& key) 
@@ -549,6 +1144,7 @@ public:
                     input_type& table = fc->hash_tables[i];
                     hash_bucket* bucket = table.buckets[bucket_idx];
                     delete bucket;
+                    mem_account::charge(-(int64_t)sizeof(hash_bucket));
                 }
             }
         }
@@ -560,6 +1156,377 @@ public:
     }
 };
 
+// A batched_hash_table that keeps within a byte limit by handing itself to
+// its owner to be spilled, before an emit could grow it past the limit.
+// The footprint is estimated as the slots of the table, plus the storage 
+// and values held by buffering combiners. A limit of 0 never spills.
+template<typename K, typename C, typename V, class Hash, 
+    template<class> class Allocator, class Owner>
+class spill_hash_table : public batched_hash_table<K, C, V, Hash, Allocator>
+{
+    typedef batched_hash_table<K, C, V, Hash, Allocator> base;
+    Owner* owner;
+    uint64_t in_index;
+    uint64_t limit;
+    uint64_t values;
+public:
+    spill_hash_table(Owner* owner = NULL, uint64_t in_index = 0, 
+        uint64_t limit = 0) : owner(owner), in_index(in_index), 
+        limit(limit), values(0) {}
+
+    uint64_t footprint() const
+    {
+        uint64_t slots = this->capacity();
+        if(this->count() + base::window_size + 1 >= slots>>1)
+            slots <<= 1;
+        return slots * sizeof(std::pair<K, C>) + 
+            this->count() * C::storage_bytes + 
+            (C::buffered ? values * sizeof(V) : 0);
+    }
+
+    void emit(K const& key, V const& value)
+    {
+        if(limit != 0 && this->count() > 0 && footprint() > limit)
+            owner->spill(in_index, *this);
+        base::emit(key, value);
+        values++;
+    }
+
+    // Empties the table, releasing its combiners; called by the owner 
+    // once they are spilled.
+    void clear()
+    {
+        this->flush();
+        for(typename base::const_iterator i = this->begin(); 
+            i != this->end(); ++i)
+            const_cast<C&>((*i).second).release();
+        static_cast<hash_table<K, C, Hash, Allocator>&>(*this) = 
+            hash_table<K, C, Hash, Allocator>();
+        values = 0;
+    }
+};
+
+template<typename K, typename C, typename V, class Hash, 
+    template<class> class Allocator, class Owner>
+inline void emit_into(spill_hash_table<K, C, V, Hash, Allocator, Owner>& i,
+    K const& key, V const& value)
+{
+    i.emit(key, value);
+}
+
+// Storage for flexible cardinality keys under a memory budget. Runs as a
+// hash_container until a thread's table outgrows its share of the budget;
+// the table is then written to a scratch file as a run of (key, values) 
+// records, sorted by key within each reduce partition, and the thread 
+// starts over with an empty table. Each reduce task merges its partition 
+// of every run with the in-memory tables, one key at a time, so reduce 
+// input is bounded by the number of runs rather than the number of keys. 
+// K must be ordered by operator<, and K and V must be supported by 
+// Serializer. The budget is MR_MEMORY_BUDGET megabytes and the scratch 
+// directory MR_SPILL_DIR (else TMPDIR, else /tmp), unless a job sets them
+// with set_memory_budget() and set_spill_dir(). A run that spills nothing 
+// reduces exactly as hash_container.
+template<typename K, typename V, 
+    template<typename, template<class> class> class Combiner, 
+    class Hash = std::tr1::hash<K>, 
+    template<class> class Allocator = counted_allocator>
+class spill_hash_container 
+    : public hash_container<K, V, Combiner, Hash, Allocator>
+{
+    typedef hash_container<K, V, Combiner, Hash, Allocator> base;
+public:
+    typedef Combiner<V, Allocator> combiner_type;
+    typedef typename base::KCV KCV;
+    typedef spill_hash_table<K, combiner_type, V, Hash, Allocator, 
+        spill_hash_container> input_type;
+    typedef typename base::output_type output_type;
+
+private:
+    // A spill file; records of partition p start at offsets[p] and there
+    // are records[p] of them.
+    struct run
+    {
+        std::string path;
+        std::vector<uint64_t> offsets;
+        std::vector<uint64_t> records;
+    };
+
+    uint64_t budget;
+    std::string dir;
+    std::vector< std::vector<run> > runs;   // per map thread
+
+    void remove_runs()
+    {
+        for(size_t i = 0; i < runs.size(); i++)
+            for(size_t j = 0; j < runs[i].size(); j++)
+                unlink(runs[i][j].path.c_str());
+        runs.clear();
+    }
+
+    struct by_partition
+    {
+        bool operator()(std::pair<uint64_t, KCV const*> const& a, 
+            std::pair<uint64_t, KCV const*> const& b) const {
+            return a.first < b.first || 
+                (a.first == b.first && a.second->first < b.second->first);
+        }
+    };
+
+public:
+    spill_hash_container()
+    {
+        budget = (uint64_t)atoll(GETENV("MR_MEMORY_BUDGET")) << 20;
+        char const* d = getenv("MR_SPILL_DIR");
+        if(d == NULL) d = getenv("TMPDIR");
+        dir = d != NULL ? d : "/tmp";
+    }
+
+    virtual ~spill_hash_container()
+    {
+        remove_runs();
+    }
+
+    // bytes of intermediate data the map threads may hold; 0 for no limit
+    void set_memory_budget(uint64_t bytes)
+    {
+        budget = bytes;
+    }
+
+    uint64_t get_memory_budget() const
+    {
+        return budget;
+    }
+
+    void set_spill_dir(std::string const& dir)
+    {
+        this->dir = dir;
+    }
+
+    // number of runs written by the last map phase
+    uint64_t spills() const
+    {
+        uint64_t n = 0;
+        for(size_t i = 0; i < runs.size(); i++)
+            n += runs[i].size();
+        return n;
+    }
+
+    void init(uint64_t in_size, uint64_t out_size)
+    {
+        base::init(in_size, out_size);
+        remove_runs();
+        runs.resize(in_size);
+    }
+
+    input_type get(uint64_t in_index)
+    {
+        return input_type(this, in_index, budget / this->in_size);
+    }
+
+    void add(uint64_t in_index, input_type& j)
+    {
+        base::add(in_index, j);
+    }
+
+    void spill(uint64_t in_index, input_type& t)
+    {
+        t.flush();
+        Hash kh;
+        std::vector< std::pair<uint64_t, KCV const*> > order;
+        order.reserve(t.count());
+        for(typename input_type::const_iterator i = t.begin(); 
+            i != t.end(); ++i) {
+            if(!(*i).second.empty())
+                order.push_back(std::make_pair(
+                    kh((*i).first) % this->out_size, &*i));
+        }
+        std::sort(order.begin(), order.end(), by_partition());
+
+        run r;
+        r.path = dir + "/phoenix-spill-XXXXXX";
+        int fd;
+        CHECK_ERROR((fd = mkstemp(&r.path[0])) < 0);
+        close(fd);
+        std::ofstream out(r.path.c_str(), 
+            std::ios::binary | std::ios::trunc);
+        CHECK_ERROR(!out);
+
+        r.offsets.assign(this->out_size, 0);
+        r.records.assign(this->out_size, 0);
+        std::vector<V> vs;
+        uint64_t p = 0;
+        for(size_t i = 0; i < order.size(); i++) {
+            while(p <= order[i].first)
+                r.offsets[p++] = (uint64_t)out.tellp();
+            r.records[order[i].first]++;
+
+            typename combiner_type::combined c;
+            c.add(&order[i].second->second);
+            V v;
+            vs.clear();
+            while(c.next(v))
+                vs.push_back(v);
+            uint64_t n = vs.size();
+            Serializer<K>::serialize(out, order[i].second->first);
+            out.write((char const*)&n, sizeof(n));
+            for(size_t k = 0; k < vs.size(); k++)
+                Serializer<V>::serialize(out, vs[k]);
+        }
+        out.close();
+        CHECK_ERROR(!out);
+        runs[in_index].push_back(r);
+        t.clear();
+    }
+
+    class iterator
+    {
+        // one sorted input of the merge: a map thread's in-memory table 
+        // or its partition of a run
+        struct source
+        {
+            std::vector< KCV, Allocator<KCV> > const* mem;
+            size_t pos;
+            std::ifstream* in;
+            uint64_t left;
+            K key;
+
+            bool advance()
+            {
+                if(mem != NULL) {
+                    if(++pos >= mem->size()) return false;
+                    key = (*mem)[pos].first;
+                    return true;
+                }
+                if(left == 0) return false;
+                left--;
+                Serializer<K>::deserialize(*in, key);
+                return true;
+            }
+        };
+
+        struct merge_state
+        {
+            std::vector<source> sources;
+            std::vector<combiner_type> scratch;
+
+            // min-heap of sources by current key
+            struct greater 
+            {
+                std::vector<source> const* s;
+                bool operator()(size_t a, size_t b) const {
+                    return (*s)[b].key < (*s)[a].key;
+                }
+            };
+            std::priority_queue<size_t, std::vector<size_t>, greater> heap;
+
+            merge_state() : heap(greater()) {}
+            ~merge_state()
+            {
+                for(size_t i = 0; i < sources.size(); i++)
+                    delete sources[i].in;
+                release();
+            }
+            void release()
+            {
+                for(size_t i = 0; i < scratch.size(); i++)
+                    scratch[i].release();
+                scratch.clear();
+            }
+        private:
+            merge_state(merge_state const&);
+            void operator=(merge_state const&);
+        };
+
+        std::shared_ptr<typename base::iterator> hashed;
+        std::shared_ptr<merge_state> merge;
+
+    public:
+        iterator(spill_hash_container* ac, uint64_t index)
+        {
+            if(ac->spills() == 0) {
+                hashed.reset(new typename base::iterator(ac, index));
+                return;
+            }
+
+            merge.reset(new merge_state());
+            std::vector<source>& sources = merge->sources;
+            for(uint64_t i = 0; i < ac->in_size; i++) {
+                std::vector< KCV, Allocator<KCV> >& iv = 
+                    ac->vals[index*ac->in_size + i];
+                std::sort(iv.begin(), iv.end(), by_key());
+                source s = { &iv, (size_t)-1, NULL, 0, K() };
+                sources.push_back(s);
+
+                for(size_t j = 0; j < ac->runs[i].size(); j++) {
+                    run const& r = ac->runs[i][j];
+                    if(r.records[index] == 0) continue;
+                    source f = { NULL, 0, new std::ifstream(r.path.c_str(), 
+                        std::ios::binary), r.records[index], K() };
+                    CHECK_ERROR(!*f.in);
+                    f.in->seekg(r.offsets[index]);
+                    sources.push_back(f);
+                }
+            }
+
+            typename merge_state::greater g = { &sources };
+            merge->heap = std::priority_queue<size_t, std::vector<size_t>, 
+                typename merge_state::greater>(g);
+            for(size_t i = 0; i < sources.size(); i++) {
+                if(sources[i].advance())
+                    merge->heap.push(i);
+            }
+        }
+
+        bool next(K& key, output_type& values)
+        {
+            if(hashed)
+                return hashed->next(key, values);
+
+            merge->release();
+            if(merge->heap.empty())
+                return false;
+
+            std::vector<source>& sources = merge->sources;
+            key = sources[merge->heap.top()].key;
+            values = output_type();
+            while(!merge->heap.empty() && 
+                !(key < sources[merge->heap.top()].key)) {
+                size_t i = merge->heap.top();
+                merge->heap.pop();
+                source& s = sources[i];
+                if(s.mem != NULL) {
+                    values.add(&(*s.mem)[s.pos].second);
+                } else {
+                    uint64_t n;
+                    s.in->read((char*)&n, sizeof(n));
+                    merge->scratch.push_back(combiner_type());
+                    for(uint64_t k = 0; k < n; k++) {
+                        V v;
+                        Serializer<V>::deserialize(*s.in, v);
+                        merge->scratch.back().add(v);
+                    }
+                    values.add(&merge->scratch.back());
+                }
+                if(s.advance())
+                    merge->heap.push(i);
+            }
+            return true;
+        }
+    };
+
+    struct by_key
+    {
+        bool operator()(KCV const& a, KCV const& b) const {
+            return a.first < b.first;
+        }
+    };
+
+    iterator begin(uint64_t out_index)
+    {
+        return iterator(this, out_index);
+    }
+};
+
 #endif /* CONTAINER_H_ */
 
 // vim: ts=8 sw=4 sts=4 smarttab smartindent
@@ -199,8 +199,18 @@ public:
     }
 };
 
-template<typename T>
+// keys without a printable form (e.g. user structs) are traced anonymously
+template<typename T, typename T2 = T>
 class ReduceTracer{
+public:
+    static void print(int workerId, const T& key, const char* prompt, double time, char* buf) {
+        sprintf(buf, "%f: worker[%d]: reduce[?]: %s\n", time, workerId, prompt);
+    }
+};
+
+template<typename T>
+class ReduceTracer<T,
+    typename std::enable_if<std::is_arithmetic<T>::value, T>::type> {
 public:
     static void print(int workerId, const T& key, const char* prompt, double time, char* buf) {
         sprintf(buf, "%f: worker[%d]: reduce[%s]: %s\n", time, workerId, std::to_string(key).c_str(), prompt);
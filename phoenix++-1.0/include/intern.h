@@ -0,0 +1,304 @@
+/* Copyright (c) 2007-2011, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the names of its 
+*       contributors may be used to endorse or promote products derived from 
+*       this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#ifndef INTERN_H_
+#define INTERN_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "stddefines.h"
+#include "accounting.h"
+
+/* Concurrent table that maps strings to dense 32-bit ids, 0, 1, 2... in 
+ * order of first appearance, so map tasks can emit string keys as integers
+ * into array-style containers and translate them back with str() only for
+ * output. Strings are copied into the table and NUL-terminated.
+ *
+ * Lookups are lock-free: they probe the current open-addressing table of 
+ * (hash tag, id, string) slots with acquire loads, so a hit touches only 
+ * the slot and the string, whose length is stored just before it. Only a 
+ * string that isn't there yet takes the lock, to assign its id and publish
+ * it. Growing builds a new table and publishes it; replaced tables are kept
+ * until the interner is destroyed, so readers still probing them stay safe
+ * and, on a miss, fall through to the locked path, which always sees the 
+ * current table. */
+class string_interner
+{
+    struct slot
+    {
+        std::atomic<uint64_t> key;      // tag << 32 | (id + 1), 0 if free
+        std::atomic<char const*> data;  // set before key
+    };
+
+    struct table
+    {
+        uint64_t size;
+        slot* slots;
+    };
+
+    static const int CHUNK_BITS = 16;
+    static const uint32_t CHUNK = 1 << CHUNK_BITS;
+    static const uint32_t MAX_CHUNKS = 1 << 16;
+    static const size_t ARENA = 1 << 20;
+    static const int BATCH = 16;
+
+    std::atomic<table*> current;
+    std::atomic<char const**>* chunks;  // strings of ids, CHUNK per chunk
+    std::atomic<uint32_t> count;
+    std::mutex m;                       // serializes new strings
+
+    std::vector<table*> tables;
+    std::vector<char*> arenas;
+    char* arena_pos;
+    size_t arena_left;
+
+    static uint64_t hash(char const* s, size_t len)
+    {
+        // FNV-1a
+        uint64_t v = 14695981039346656037ULL;
+        for(size_t i = 0; i < len; i++)
+            v = (v ^ (unsigned char)s[i]) * 1099511628211ULL;
+        return v;
+    }
+
+    static uint32_t len(char const* p)
+    {
+        return ((uint32_t const*)p)[-1];
+    }
+
+    char const* get(uint32_t id) const
+    {
+        return chunks[id >> CHUNK_BITS].load(std::memory_order_acquire)
+            [id & (CHUNK - 1)];
+    }
+
+    static bool find(table const* t, char const* s, size_t n, uint64_t h, 
+        uint32_t& id)
+    {
+        uint64_t mask = t->size - 1;
+        uint32_t tag = (uint32_t)(h >> 32);
+        for(uint64_t i = h & mask;; i = (i+1) & mask) {
+            uint64_t v = t->slots[i].key.load(std::memory_order_acquire);
+            if(v == 0)
+                return false;
+            if((uint32_t)(v >> 32) == tag) {
+                char const* p = 
+                    t->slots[i].data.load(std::memory_order_relaxed);
+                if(len(p) == n && memcmp(p, s, n) == 0) {
+                    id = (uint32_t)v - 1;
+                    return true;
+                }
+            }
+        }
+    }
+
+    static void place(table* t, uint32_t id, char const* p, uint64_t h)
+    {
+        uint64_t mask = t->size - 1;
+        uint64_t i = h & mask;
+        while(t->slots[i].key.load(std::memory_order_relaxed) != 0)
+            i = (i+1) & mask;
+        t->slots[i].data.store(p, std::memory_order_relaxed);
+        t->slots[i].key.store((h >> 32 << 32) | ((uint64_t)id + 1), 
+            std::memory_order_release);
+    }
+
+    table* new_table(uint64_t size)
+    {
+        table* t = new table;
+        t->size = size;
+        t->slots = new slot[size];
+        for(uint64_t i = 0; i < size; i++) {
+            t->slots[i].key.store(0, std::memory_order_relaxed);
+            t->slots[i].data.store(NULL, std::memory_order_relaxed);
+        }
+        mem_account::charge(size * sizeof(slot));
+        tables.push_back(t);
+        return t;
+    }
+
+    // Copies the string behind its 32-bit length, 4-byte aligned.
+    char const* copy(char const* s, size_t n)
+    {
+        size_t bytes = (sizeof(uint32_t) + n + 1 + 3) & ~(size_t)3;
+        if(bytes > arena_left) {
+            size_t a = std::max((size_t)ARENA, bytes);
+            arenas.push_back(new char[a]);
+            mem_account::charge(a);
+            arena_pos = arenas.back();
+            arena_left = a;
+        }
+        *(uint32_t*)arena_pos = (uint32_t)n;
+        char* d = arena_pos + sizeof(uint32_t);
+        memcpy(d, s, n);
+        d[n] = 0;
+        arena_pos += bytes;
+        arena_left -= bytes;
+        return d;
+    }
+
+    uint32_t insert(char const* s, size_t n, uint64_t h)
+    {
+        std::lock_guard<std::mutex> l(m);
+        table* t = current.load(std::memory_order_relaxed);
+        uint32_t id;
+        if(find(t, s, n, h, id))
+            return id;
+
+        id = count.load(std::memory_order_relaxed);
+        assert(id < (uint64_t)MAX_CHUNKS * CHUNK - 1);
+        char const** c = chunks[id >> CHUNK_BITS].load(std::memory_order_relaxed);
+        if(c == NULL) {
+            c = new char const*[CHUNK];
+            mem_account::charge(CHUNK * sizeof(char const*));
+            chunks[id >> CHUNK_BITS].store(c, std::memory_order_release);
+        }
+        char const* p = copy(s, n);
+        c[id & (CHUNK - 1)] = p;
+        count.store(id + 1, std::memory_order_release);
+
+        if((uint64_t)(id + 1) * 2 > t->size) {
+            // keep the load under 1/2; the new table has every id so far
+            table* g = new_table(t->size * 2);
+            for(uint64_t i = 0; i < t->size; i++) {
+                uint64_t v = t->slots[i].key.load(std::memory_order_relaxed);
+                if(v != 0) {
+                    char const* q = 
+                        t->slots[i].data.load(std::memory_order_relaxed);
+                    place(g, (uint32_t)v - 1, q, hash(q, len(q)));
+                }
+            }
+            place(g, id, p, h);
+            current.store(g, std::memory_order_release);
+        } else {
+            place(t, id, p, h);
+        }
+        return id;
+    }
+
+public:
+    // EXPECTED is a hint of the number of distinct strings.
+    explicit string_interner(uint64_t expected = 1 << 16) : 
+        arena_pos(NULL), arena_left(0)
+    {
+        uint64_t size = 16;
+        while(size < expected * 2)
+            size <<= 1;
+        current.store(new_table(size), std::memory_order_relaxed);
+        chunks = new std::atomic<char const**>[MAX_CHUNKS];
+        for(uint32_t i = 0; i < MAX_CHUNKS; i++)
+            chunks[i].store(NULL, std::memory_order_relaxed);
+        count.store(0, std::memory_order_relaxed);
+    }
+
+    ~string_interner()
+    {
+        for(size_t i = 0; i < tables.size(); i++) {
+            delete [] tables[i]->slots;
+            delete tables[i];
+        }
+        for(uint32_t i = 0; i < MAX_CHUNKS; i++)
+            delete [] chunks[i].load(std::memory_order_relaxed);
+        delete [] chunks;
+        for(size_t i = 0; i < arenas.size(); i++)
+            delete [] arenas[i];
+    }
+
+    // The id of the LEN bytes at S, assigning the next id if they are new.
+    uint32_t intern(char const* s, size_t len)
+    {
+        uint64_t h = hash(s, len);
+        uint32_t id;
+        if(find(current.load(std::memory_order_acquire), s, len, h, id))
+            return id;
+        return insert(s, len, h);
+    }
+
+    uint32_t intern(char const* s)
+    {
+        return intern(s, strlen(s));
+    }
+
+    // Interns N strings at once into IDS. The probes are overlapped: every
+    // string's home slot is prefetched, then the strings those slots point
+    // at, before any is compared, so one batch waits about as long as one 
+    // lookup when the table is much bigger than the cache.
+    void intern(char const* const* s, uint32_t const* len, int n, 
+        uint32_t* ids)
+    {
+        uint64_t h[BATCH];
+        for(int b = 0; b < n; b += BATCH) {
+            int m = std::min(n - b, (int)BATCH);
+            table const* t = current.load(std::memory_order_acquire);
+            uint64_t mask = t->size - 1;
+            for(int i = 0; i < m; i++) {
+                h[i] = hash(s[b+i], len[b+i]);
+                __builtin_prefetch(&t->slots[h[i] & mask]);
+            }
+            for(int i = 0; i < m; i++) {
+                slot const& l = t->slots[h[i] & mask];
+                if(l.key.load(std::memory_order_acquire) != 0)
+                    __builtin_prefetch(
+                        l.data.load(std::memory_order_relaxed) - 
+                        sizeof(uint32_t));
+            }
+            for(int i = 0; i < m; i++) {
+                if(!find(t, s[b+i], len[b+i], h[i], ids[b+i]))
+                    ids[b+i] = insert(s[b+i], len[b+i], h[i]);
+            }
+        }
+    }
+
+    // The string of an id returned by intern().
+    char const* str(uint32_t id) const
+    {
+        return get(id);
+    }
+
+    uint32_t length(uint32_t id) const
+    {
+        return len(get(id));
+    }
+
+    // Number of ids assigned so far.
+    uint32_t size() const
+    {
+        return count.load(std::memory_order_acquire);
+    }
+
+private:
+    string_interner(string_interner const&);
+    void operator=(string_interner const&);
+};
+
+#endif /* INTERN_H_ */
+
+// vim: ts=8 sw=4 sts=4 smarttab smartindent
@@ -0,0 +1,275 @@
+/* Copyright (c) 2007-2011, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#ifndef MAP_FOLD_H_
+#define MAP_FOLD_H_
+
+#include <assert.h>
+#include <algorithm>
+#include <vector>
+#include <cmath>
+
+#include "stddefines.h"
+#include "locality.h"
+#include "map_reduce_base.h"
+
+/* A keyless execution mode for jobs whose whole result is one structure of
+ * accumulators (sums, counts, extrema...). Each worker thread folds its map
+ * tasks into its own accumulator of type A, kept on the thread's stack, and
+ * at the end the accumulators are combined pairwise in a tree with the 
+ * user's merge(). There are no keys, containers, reduce tasks or sort.
+ *
+ * The implementation provides, like for MapReduce:
+ *   void map(data_type const& d, accumulator_type& acc) const;
+ *   void merge(accumulator_type& acc, accumulator_type const& other) const;
+ * and optionally init() (default: value-initialized A), split() and 
+ * locate(). A task's elements go through map_range(), which calls map() 
+ * for each of them; implementations can override it to fold a whole task
+ * in one loop. All of these are called through the implementation type, 
+ * so they can be inlined into the worker loop.
+ */
+template<typename Impl, typename D, typename A>
+class MapFold : public MapReduceBase<MapFold<Impl, D, A> >
+{
+    typedef MapReduceBase<MapFold> base;
+
+public:
+    typedef D data_type;
+    typedef A accumulator_type;
+
+protected:
+
+    using base::taskQueue;
+    using base::start_workers;
+    using base::phase_begin;
+    using base::phase_end;
+    typedef typename base::thread_arg_t thread_arg_t;
+
+    std::vector<accumulator_type> accs; // One per worker thread.
+    uint64_t num_map_tasks;
+
+    virtual void run_map(data_type* data, uint64_t len);
+    virtual void run_merge(uint64_t workers);
+
+    virtual void map_worker(thread_loc const& loc, thread_metrics& stats);
+    virtual void merge_worker(thread_loc const& loc, thread_metrics& stats);
+
+    static void map_callback(void* arg, thread_loc const& loc) { 
+        thread_arg_t* t = (thread_arg_t*)arg; 
+        t->job->map_worker(loc, t->stats); 
+    }
+    static void merge_callback(void* arg, thread_loc const& loc) { 
+        thread_arg_t* t = (thread_arg_t*)arg; 
+        t->job->merge_worker(loc, t->stats); 
+    }
+
+    // the default split function...
+    int split(data_type& a) { return 0; }
+
+    // the default map function...
+    void map(data_type const& a, accumulator_type& acc) const {}
+
+    // folds a task's LEN elements; override to work on whole tasks.
+    void map_range(data_type const* data, uint64_t len, 
+        accumulator_type& acc) const {
+        Impl const* impl = static_cast<Impl const*>(this);
+        for (uint64_t i = 0; i < len; ++i)
+            impl->map(data[i], acc);
+    }
+
+    // the default accumulator is value-initialized
+    void init(accumulator_type& acc) const { acc = accumulator_type(); }
+
+    // the default merge function...
+    void merge(accumulator_type& acc, accumulator_type const& o) const {}
+
+    // the default locator function...
+    void* locate(data_type* data, uint64_t) const {
+        return (void*)data;
+    }
+
+public:
+
+    /* Folds COUNT elements of DATA into RESULT. A return value less than 
+     * zero represents an error. This function is not thread safe. */
+    int run(data_type *data, uint64_t count, accumulator_type& result);
+
+    // This version assumes that the split function is provided.
+    int run(accumulator_type& result);
+};
+
+template<typename Impl, typename D, typename A>
+int MapFold<Impl, D, A>::
+run (accumulator_type& result)
+{
+    std::vector<D> data;
+    D chunk;
+
+    double begin = phase_begin();
+    while (static_cast<Impl *>(this)->split(chunk))
+    {
+        data.push_back(chunk);
+    }
+    double split_time = this->collect_metrics ? metrics_now() - begin : 0;
+    print_time("split phase", split_time);
+
+    this->split_wall = split_time;
+    int r = run(&data[0], data.size(), result);
+    this->split_wall = -1;
+    return r;
+}
+
+template<typename Impl, typename D, typename A>
+int MapFold<Impl, D, A>::
+run (D *data, uint64_t count, accumulator_type& result)
+{
+    this->metrics_begin();
+    double run_begin = phase_begin();
+
+    this->num_map_tasks = std::min(count, this->num_threads) * 16;
+    uint64_t workers = std::min(this->num_map_tasks, this->num_threads);
+    this->accs.resize(workers);
+
+    double begin = phase_begin();
+    run_map(data, count);
+    phase_end("map phase", begin);
+
+    begin = phase_begin();
+    if (workers > 0)
+    {
+        run_merge(workers);
+        result = this->accs[0];
+    }
+    else
+    {
+        static_cast<Impl const*>(this)->init(result);
+    }
+    phase_end("merge phase", begin);
+
+    this->metrics_end(run_begin);
+
+    return 0;
+}
+
+/**
+ * Run map tasks, folding them into the accumulators of the workers
+ */
+template<typename Impl, typename D, typename A>
+void MapFold<Impl, D, A>::
+run_map (data_type* data, uint64_t count)
+{
+    uint64_t chunk_size = 
+        std::max(1, (int)ceil((double)count / this->num_map_tasks));
+    
+    for(uint64_t i = 0; i < this->num_map_tasks; i++)
+    {
+        uint64_t start = chunk_size * i;
+
+        if(start < count)
+        {
+            uint64_t len = std::min(chunk_size, count-start);
+            int lgrp = loc_mem_to_lgrp (
+                static_cast<Impl const*>(this)->locate(data+start, len));
+            task_queue::task_t task = 
+                {    i, len, (uint64_t)(data+start), (uint64_t)lgrp };    
+            this->taskQueue->enqueue_seq (task, this->num_map_tasks, lgrp);
+        }
+    }
+
+    start_workers (&map_callback, this->accs.size(), "map phase"); 
+}
+
+template<typename Impl, typename D, typename A>
+void MapFold<Impl, D, A>::
+map_worker(thread_loc const& loc, thread_metrics& stats)
+{
+    metrics_timer worker_timer(stats.time, this->collect_metrics);
+    Impl const* impl = static_cast<Impl const*>(this);
+    accumulator_type acc;
+    impl->init(acc);
+
+    task_queue::task_t task;
+    bool stolen;
+    while (taskQueue->dequeue (task, loc, &stolen)) {
+        stats.tasks++;
+        stats.stolen += stolen;
+        metrics_timer user_timer(stats.busy, this->collect_metrics);
+        impl->map_range((data_type const*)task.data, task.len, acc);
+    }
+
+    this->accs[loc.thread] = acc;
+}
+
+/**
+ * Merge the accumulators pairwise in a tree: in the round with stride s,
+ * accumulator i takes in accumulator i+s for every i that is a multiple 
+ * of 2s, until everything is in accumulator 0.
+ */
+template<typename Impl, typename D, typename A>
+void MapFold<Impl, D, A>::
+run_merge (uint64_t workers)
+{
+    for (uint64_t stride = 1; stride < workers; stride *= 2)
+    {
+        uint64_t pairs = (workers - stride + 2 * stride - 1) / (2 * stride);
+
+        // a single pair is not worth waking the pool for
+        if (pairs == 1)
+        {
+            static_cast<Impl const*>(this)->merge(
+                this->accs[0], this->accs[stride]);
+            continue;
+        }
+
+        for (uint64_t i = 0; i + stride < workers; i += 2 * stride)
+        {
+            task_queue::task_t task = { i, stride, 0, 0 };
+            this->taskQueue->enqueue_seq (task, workers);
+        }
+        start_workers (&merge_callback, 
+            std::min(pairs, this->num_threads), "merge phase");
+    }
+}
+
+template<typename Impl, typename D, typename A>
+void MapFold<Impl, D, A>::
+merge_worker (thread_loc const& loc, thread_metrics& stats)
+{
+    metrics_timer worker_timer(stats.time, this->collect_metrics);
+    task_queue::task_t task;
+    bool stolen;
+    while (this->taskQueue->dequeue (task, loc, &stolen)) {
+        stats.tasks++;
+        stats.stolen += stolen;
+        metrics_timer user_timer(stats.busy, this->collect_metrics);
+        static_cast<Impl const*>(this)->merge(
+            this->accs[task.id], this->accs[task.id + task.len]);
+    }
+}
+
+#endif // MAP_FOLD_H_
+
+// vim: ts=8 sw=4 sts=4 smarttab smartindent
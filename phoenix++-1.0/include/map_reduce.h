@@ -35,20 +35,38 @@
 #include <cmath>
 
 #include "stddefines.h"
-#include "processor.h"
-#include "scheduler.h"
-#include "task_queue.h"
 #include "combiner.h"
 #include "container.h"
 #include "locality.h"
-#include "thread_pool.h"
+#include "map_reduce_base.h"
+#include "accounting.h"
 
 #include "debug.h"
 
+// Containers that can spill take half of a job's memory limit as their 
+// spill budget unless they were given one; other containers ignore it.
+// APPLIED is the budget last taken from a limit, which is replaced when 
+// the limit changes, unlike a budget the job set itself.
+template<class C>
+inline auto limit_spill_budget(C& c, uint64_t bytes, uint64_t& applied, int) 
+    -> decltype(c.get_memory_budget(), void())
+{
+    uint64_t budget = c.get_memory_budget();
+    if(budget == 0 || budget == applied) {
+        c.set_memory_budget(bytes);
+        applied = bytes;
+    }
+}
+
+template<class C>
+inline void limit_spill_budget(C&, uint64_t, uint64_t&, long) {}
+
 template<typename Impl, typename D, typename K, typename V, 
     class Container = hash_container<K, V, buffer_combiner> >
-class MapReduce
+class MapReduce : public MapReduceBase<MapReduce<Impl, D, K, V, Container> >
 {
+    typedef MapReduceBase<MapReduce> base;
+
 public:
 
     /* Standard data types for the function arguments and results */
@@ -70,12 +88,13 @@ public:
 
 protected:
 
-    // Parameters.
-    uint64_t num_threads;               // # of threads to run.
-    uint64_t thread_offset;             // cores to skip when assigning threads.
+    using base::num_threads;
+    using base::taskQueue;
+    using base::start_workers;
+    using base::phase_begin;
+    typedef typename base::thread_arg_t thread_arg_t;
 
-    thread_pool* threadPool;            // Thread pool.
-    task_queue* taskQueue;              // Queues of tasks.
+    uint64_t thread_offset;             // cores to skip when assigning threads.
 
     container_type container; 
     std::vector<keyval>* final_vals;    // Array to send to merge task.    
@@ -83,6 +102,10 @@ protected:
     uint64_t num_map_tasks;
     uint64_t num_reduce_tasks;
 
+    int64_t memory_limit;               // soft limit in bytes, 0 for none
+    uint64_t limit_budget;              // spill budget taken from the limit
+    mem_account memory;                 // bytes held by the last run
+
     ReduceDebuggerBase<K, V, value_container>* reduce_debugger;
     // for debugging
 
@@ -90,38 +113,49 @@ protected:
     virtual void run_reduce();
     virtual void run_merge();
     
-    virtual void map_worker(
-        thread_loc const& loc, double& time, double& user_time, int& tasks);
-    virtual void reduce_worker(
-        thread_loc const& loc, double& time, double& user_time, int& tasks);
-    virtual void merge_worker(
-        thread_loc const& loc, double& time, double& user_time, int& tasks);
-
-    // Data passed to the callback functions.
-    struct thread_arg_t
-    {
-        // in
-        MapReduce* mr;
-        // out
-        double user_time;
-        double time;        
-        int tasks;
-    };
+    virtual void map_worker(thread_loc const& loc, thread_metrics& stats);
+    virtual void reduce_worker(thread_loc const& loc, thread_metrics& stats);
+    virtual void merge_worker(thread_loc const& loc, thread_metrics& stats);
 
     static void map_callback(void* arg, thread_loc const& loc) { 
         thread_arg_t* t = (thread_arg_t*)arg; 
-        t->mr->map_worker(loc, t->time, t->user_time, t->tasks); 
+        t->job->map_worker(loc, t->stats); 
     }
     static void reduce_callback(void* arg, thread_loc const& loc) { 
         thread_arg_t* t = (thread_arg_t*)arg; 
-        t->mr->reduce_worker(loc, t->time, t->user_time, t->tasks);
+        t->job->reduce_worker(loc, t->stats);
     }
     static void merge_callback(void* arg, thread_loc const& loc) { 
         thread_arg_t* t = (thread_arg_t*)arg; 
-        t->mr->merge_worker(loc, t->time, t->user_time, t->tasks); 
+        t->job->merge_worker(loc, t->stats); 
+    }
+
+    // Phase timing, with the memory peak of the phase.
+    void phase_end(char const* phase, double begin) {
+        if(this->collect_metrics)
+            this->metrics.get_phase(phase).mem_peak = this->memory.peak();
+        base::phase_end(phase, begin);
+        this->memory.reset_peaks();
+    }
+
+    // Bytes of N output vectors. They don't use a counted allocator, so 
+    // their capacity is charged as it grows and credited when they go.
+    static int64_t output_bytes(std::vector<keyval> const* v, uint64_t n) {
+        int64_t b = 0;
+        for(uint64_t i = 0; i < n; i++)
+            b += (int64_t)(v[i].capacity() * sizeof(keyval));
+        return b;
+    }
+
+    // Reports a run that went over its memory limit in PHASE.
+    bool over_limit(char const* phase) const {
+        if(!this->memory.exceeded())
+            return false;
+        fprintf(stderr, "MapReduce: %s exceeded the memory limit of %lld "
+            "bytes (%lld held)\n", phase, (long long)this->memory_limit, 
+            (long long)this->memory.bytes());
+        return true;
     }
-    void start_workers (void (*callback)(void*, thread_loc const&), 
-        int num_threads, char const* stage);    
     
     // the default split function...
     int split(data_type &a) { return 0; }
@@ -147,33 +181,25 @@ protected:
 
 public:
 
-    MapReduce() : threadPool(NULL), taskQueue(NULL) {
-        // Determine the number of threads to use. 
-        // First check for an environment variable, then use the 
-        // number of processors
-        int threads = atoi(GETENV("MR_NUMTHREADS"));
-        setThreads(threads > 0 ? threads : proc_get_num_cpus(), 0);
+    MapReduce() : limit_budget(0) {
+        // MR_MEMORY_LIMIT=<megabytes> sets a soft limit on the memory the
+        // containers and reduce output hold; see setMemoryLimit().
+        this->memory_limit = (int64_t)atoll(GETENV("MR_MEMORY_LIMIT")) << 20;
     }
 
-    virtual ~MapReduce() {
-        if(this->threadPool != NULL) delete this->threadPool;
-        if(this->taskQueue != NULL) delete this->taskQueue;
+    // Soft limit on the bytes the containers and reduce output may hold, 
+    // 0 for none. Each thread may hold its share of it; a run that goes 
+    // over stops taking tasks and fails with -1 at the end of the phase. 
+    // A container that can spill is given half the limit as its budget, so
+    // it spills before the limit is reached.
+    MapReduce& setMemoryLimit(int64_t bytes) {
+        this->memory_limit = bytes;
+        return *this;
     }
 
-    // override the default thread offset and thread count.
-    MapReduce& setThreads(int num_threads, sched_policy const* policy = NULL) {
-        this->num_threads = (num_threads > 0) ? num_threads : this->num_threads;
-        
-        if(this->threadPool != NULL) delete this->threadPool;
-        if(this->taskQueue != NULL) delete this->taskQueue;
-
-        // Create thread pool and task queue
-        sched_policy_strand_fill default_policy(0);
-        this->threadPool = new thread_pool(
-            num_threads, policy == NULL ? &default_policy : policy);
-        this->taskQueue = new task_queue(num_threads, num_threads);
-
-        return *this;
+    // byte counters of the last run
+    mem_account const& getMemory() const {
+        return this->memory;
     }
     
     /* The main MapReduce engine. This is the function called by the 
@@ -189,9 +215,41 @@ public:
     // This version assumes that the split function is provided.
     int run(std::vector<keyval>& result);
 
+    // Same as above, additionally collecting the run's metrics into METRICS.
+    int run(data_type *data, uint64_t count, std::vector<keyval>& result, 
+        mr_metrics& metrics) {
+        bool enabled = this->collect_metrics;
+        this->collect_metrics = true;
+        int r = run(data, count, result);
+        this->collect_metrics = enabled;
+        metrics = this->metrics;
+        return r;
+    }
+
+    int run(std::vector<keyval>& result, mr_metrics& metrics) {
+        bool enabled = this->collect_metrics;
+        this->collect_metrics = true;
+        int r = run(result);
+        this->collect_metrics = enabled;
+        metrics = this->metrics;
+        return r;
+    }
+
     void emit_intermediate(typename container_type::input_type& i, 
         key_type const& k, value_type const& v) const {
-	i[k].add(v);
+        emit_into(i, k, v);
+    }
+
+    // Emits a rows x cols tile of values over a row-major key space with 
+    // rows of ld keys: v[r*cols + c] goes to key first + r*ld + c.
+    void emit_intermediate_tile(typename container_type::input_type& i, 
+        key_type const& first, uint64_t ld, value_type const* v, 
+        uint64_t rows, uint64_t cols) const {
+        for(uint64_t r = 0; r < rows; r++) {
+            key_type k = first + r*ld;
+            for(uint64_t c = 0; c < cols; c++, ++k)
+                static_cast<Impl const*>(this)->emit_intermediate(i, k, *v++);
+        }
     }
 };
 
@@ -200,21 +258,25 @@ int MapReduce<Impl, D, K, V, Container>::
 run (std::vector<keyval>& result)
 {
     PerformanceTracer::master_thread_trace("MapReduce_begin");
-    timespec begin;    
     std::vector<D> data;
     uint64_t count;
     D chunk;
 
     // Run splitter to generate chunks
-    get_time (begin);
+    double begin = phase_begin();
     while (static_cast<Impl *>(this)->split(chunk))
     {
         data.push_back(chunk);
     }
     count = data.size();
-    print_time_elapsed("split phase", begin);
+    double split_time = this->collect_metrics ? metrics_now() - begin : 0;
+    print_time("split phase", split_time);
 
+    // the run's record, printed when it ends, includes the split
+    this->split_wall = split_time;
     int r = run(&data[0], count, result);
+    this->split_wall = -1;
+
     PerformanceTracer::master_thread_trace("MapReduce_end");
     return r;
 }
@@ -223,10 +285,16 @@ template<typename Impl, typename D, typename K, typename V, class Container>
 int MapReduce<Impl, D, K, V, Container>::
 run (D *data, uint64_t count, std::vector<keyval>& result)
 {
-    timespec begin;    
-    timespec run_begin = get_time();
+    this->metrics_begin();
+    double run_begin = phase_begin();
+    this->memory.reset(this->num_threads, this->memory_limit);
+    mem_account::scope master(this->memory, this->num_threads);
+    limit_spill_budget(container, 
+        this->memory_limit > 0 ? this->memory_limit / 2 : 0, 
+        this->limit_budget, 0);
+
     // Initialize library
-    get_time (begin);
+    double begin = phase_begin();
 
     // Compute task counts (should make this more adjustable) and then 
     // allocate storage
@@ -241,38 +309,56 @@ run (D *data, uint64_t count, std::vector<keyval>& result)
         // Try to avoid a reallocation. Very costly on Solaris.
         this->final_vals[i].reserve(100);
     }
-    print_time_elapsed("library init", begin);
+    mem_account::charge(output_bytes(this->final_vals, this->num_threads));
+    phase_end("library init", begin);
 
     // Run map tasks and get intermediate values
-    get_time (begin);
+    int64_t heap_begin = this->collect_metrics ? metrics_heap_bytes() : -1;
+    begin = phase_begin();
     PerformanceTracer::master_thread_trace("map_begin");
     run_map(&data[0], count);
     PerformanceTracer::master_thread_trace("map_end");
-    print_time_elapsed("map phase", begin);
+    phase_end("map phase", begin);
+    if (this->collect_metrics && heap_begin >= 0)
+        this->metrics.container_bytes = metrics_heap_bytes() - heap_begin;
+    if (this->collect_metrics)
+        this->metrics.container_mem = this->memory.bytes();
+    if (over_limit("map phase")) {
+        delete [] this->final_vals;
+        return -1;
+    }
 
     dprintf("In scheduler, all map tasks are done, now scheduling reduce tasks\n");
 
     // Run reduce tasks and get final values
-    get_time (begin);
+    begin = phase_begin();
     PerformanceTracer::master_thread_trace("reduce_begin");
     run_reduce();
     PerformanceTracer::master_thread_trace("reduce_end");
-    print_time_elapsed("reduce phase", begin);
+    phase_end("reduce phase", begin);
+    if (over_limit("reduce phase")) {
+        delete [] this->final_vals;
+        return -1;
+    }
 
     dprintf("In scheduler, all reduce tasks are done, now scheduling merge tasks\n");
 
-    get_time (begin);
+    begin = phase_begin();
     PerformanceTracer::master_thread_trace("merge_begin");
     run_merge();
     PerformanceTracer::master_thread_trace("merge_end");
-    print_time_elapsed("merge phase", begin);
+    phase_end("merge phase", begin);
+    if (over_limit("merge phase")) {
+        delete [] this->final_vals;
+        return -1;
+    }
     
     result.swap(*this->final_vals);
     
     // Delete structures
     delete [] this->final_vals;
     
-    print_time_elapsed("run time", run_begin);
+    this->metrics_end(run_begin);
 
     return 0;
 }
@@ -305,7 +391,8 @@ run_map (data_type* data, uint64_t count)
         }
     }
 
-    start_workers (&map_callback, std::min(num_map_tasks, num_threads), "map"); 
+    start_workers (&map_callback, std::min(num_map_tasks, num_threads), 
+        "map phase"); 
 }
 
 /**
@@ -313,26 +400,31 @@ run_map (data_type* data, uint64_t count)
  */
 template<typename Impl, typename D, typename K, typename V, class Container>
 void MapReduce<Impl, D, K, V, Container>::
-map_worker(thread_loc const& loc, double& time, double& user_time, int& tasks)
+map_worker(thread_loc const& loc, thread_metrics& stats)
 {
     PerformanceTracer::worker_thread_trace(loc.thread, "map_begin");
-    timespec begin = get_time();
+    metrics_timer worker_timer(stats.time, this->collect_metrics);
+    mem_account::scope mem(this->memory, loc.thread);
     typename container_type::input_type t = container.get(loc.thread);    
     task_queue::task_t task;
-    while (taskQueue->dequeue (task, loc)) {
-        tasks++;
-    	timespec user_begin = get_time();
+    bool stolen;
+    while (taskQueue->dequeue (task, loc, &stolen)) {
+        // over the memory limit: drain the queue and fail the run
+        if (this->memory.exceeded())
+            continue;
+        stats.tasks++;
+        stats.stolen += stolen;
+        metrics_timer user_timer(stats.busy, this->collect_metrics);
 	for (data_type* data = (data_type*)task.data; 
             data < (data_type*)task.data + task.len; ++data) {
             PerformanceTracer::map_trace(loc.thread, task.id, "begin");
             static_cast<Impl const*>(this)->map(*data, t);
             PerformanceTracer::map_trace(loc.thread, task.id, "end");
         }
-    	user_time += time_elapsed(user_begin);
     }
 
     container.add(loc.thread, t);
-    time += time_elapsed(begin);
+    stats.mem_peak = this->memory.counter(loc.thread).peak;
     PerformanceTracer::worker_thread_trace(loc.thread, "map_end");
 }
 
@@ -362,7 +454,7 @@ void MapReduce<Impl, D, K, V, Container>::run_reduce ()
     }
 
     start_workers (&reduce_callback, 
-        std::min(this->num_reduce_tasks, num_threads), "reduce");
+        std::min(this->num_reduce_tasks, num_threads), "reduce phase");
 
     delete reduce_debugger;
 }
@@ -372,18 +464,27 @@ void MapReduce<Impl, D, K, V, Container>::run_reduce ()
  */
 template<typename Impl, typename D, typename K, typename V, class Container>
 void MapReduce<Impl, D, K, V, Container>::reduce_worker (
-    thread_loc const& loc, double& time, double& user_time, int& tasks)
+    thread_loc const& loc, thread_metrics& stats)
 {
     PerformanceTracer::worker_thread_trace(loc.thread, "reduce_begin");
-    timespec begin = get_time();
+    metrics_timer worker_timer(stats.time, this->collect_metrics);
+    mem_account::scope mem(this->memory, loc.thread);
+    std::vector<keyval>& out = this->final_vals[loc.thread];
 
     task_queue::task_t task;
-    while (taskQueue->dequeue (task, loc)) {
-        tasks++;
+    bool stolen;
+    while (taskQueue->dequeue (task, loc, &stolen)) {
+        if (this->memory.exceeded())
+            continue;
+        stats.tasks++;
+        stats.stolen += stolen;
+        // the output vector doesn't use a counted allocator; charge its
+        // growth instead
+        size_t capacity = out.capacity();
 
         typename container_type::iterator i = container.begin(task.data);
 
-        timespec user_begin = get_time();
+        metrics_timer user_timer(stats.busy, this->collect_metrics);
         K key;
         value_container values;
 
@@ -392,15 +493,15 @@ void MapReduce<Impl, D, K, V, Container>::reduce_worker (
             auto vs = reduce_debugger->get_iterator(key, values);
             if (vs.size() > 0) {
                 PerformanceTracer::reduce_trace(loc.thread, key, "begin");
-                static_cast<Impl const*>(this)->reduce(
-                    key, vs, this->final_vals[loc.thread]);
+                static_cast<Impl const*>(this)->reduce(key, vs, out);
                 PerformanceTracer::reduce_trace(loc.thread, key, "end");
             }
         }
-        user_time += time_elapsed(user_begin);
+        mem_account::charge(
+            (int64_t)((out.capacity() - capacity) * sizeof(keyval)));
     }
+    stats.mem_peak = this->memory.counter(loc.thread).peak;
 
-    time += time_elapsed(begin);
     PerformanceTracer::worker_thread_trace(loc.thread, "reduce_end");
 }
 
@@ -417,72 +518,25 @@ void MapReduce<Impl, D, K, V, Container>::run_merge ()
 
     std::vector<keyval>* final = new std::vector<keyval>[1];
     final[0].reserve(total);
+    mem_account::charge(output_bytes(final, 1));
 
     for(size_t i = 0; i < num_threads; i++) {
         final[0].insert(final[0].end(), this->final_vals[i].begin(), 
             this->final_vals[i].end());
     }
 
+    mem_account::charge(-output_bytes(this->final_vals, num_threads));
     delete [] this->final_vals;
     this->final_vals = final;
 }
 
 template<typename Impl, typename D, typename K, typename V, class Container>
 void MapReduce<Impl, D, K, V, Container>::
-merge_worker (thread_loc const& loc, double& time, double& user_time, int& tasks)
+merge_worker (thread_loc const& loc, thread_metrics& stats)
 {
     // do nothing at all unless it turns out to be a bottleneck to merge in serial.
 }
 
-template<typename Impl, typename D, typename K, typename V, class Container>
-void MapReduce<Impl, D, K, V, Container>::start_workers (void (*func)(void*, thread_loc const&), int num_threads, char const* stage)
-{
-    thread_arg_t* th_arg_array = new thread_arg_t[num_threads];
-    thread_arg_t** th_arg_ptrarray = new thread_arg_t*[num_threads];
-    
-    thread_arg_t args = { this, 0, 0, 0 };
-    for (int thread = 0; thread < num_threads; ++thread) 
-    {
-        th_arg_array[thread] = args;
-        th_arg_ptrarray[thread] = &(th_arg_array[thread]);        
-    }
-    
-    CHECK_ERROR (threadPool->set(func, (void **)th_arg_ptrarray, num_threads));
-    // Start worker threads
-    CHECK_ERROR (threadPool->begin());                
-    dprintf("Status: All %d threads have been created\n", num_threads);    
-    // Barrier, wait for all threads to finish.
-    CHECK_ERROR (threadPool->wait());            
-
-#ifdef TIMING
-    double user_time = 0, work_time = 0, max_user_time = 0, 
-        min_user_time=std::numeric_limits<double>::max(), max_work_time=0, 
-        min_work_time=std::numeric_limits<double>::max();
-    for (int thread = 0; thread < num_threads; ++thread)
-    {
-        dprintf("Thread %d: ran %d in %.3f\n", thread, 
-            th_arg_array[thread].tasks, th_arg_array[thread].time);
-        user_time += th_arg_array[thread].user_time;
-        min_user_time = std::min(min_user_time, th_arg_array[thread].user_time);
-        max_user_time = std::max(max_user_time, th_arg_array[thread].user_time);
-        work_time += th_arg_array[thread].time;
-        min_work_time = std::min(min_work_time, th_arg_array[thread].time);
-        max_work_time = std::max(max_work_time, th_arg_array[thread].time);
-    }
-    if(max_user_time > 0)
-        fprintf (stderr, "%s avg user time: %.3f    (%.3f, %.3f)\n", 
-            stage, user_time / num_threads, min_user_time, max_user_time);
-    if(max_work_time > 0)
-        fprintf (stderr, "%s avg thread time: %.3f    (%.3f, %.3f)\n", 
-            stage, work_time / num_threads, min_work_time, max_work_time);
-#endif
-
-    delete [] th_arg_ptrarray;
-    delete [] th_arg_array;
-    
-    dprintf("Status: All tasks have completed\n"); 
-}
-
 template<typename Impl, typename D, typename K, typename V, 
     class Container = hash_container<K, V, buffer_combiner> >
 class MapReduceSort : public MapReduce<Impl, D, K, V, Container>
@@ -517,7 +571,7 @@ protected:
                 { i, 0, (uint64_t)&this->final_vals[i], 0 };
             this->taskQueue->enqueue_seq(task, merge_queues);
         }
-        start_workers(&this->merge_callback, this->num_threads, "merge");
+        start_workers(&this->merge_callback, this->num_threads, "merge phase");
 
         // Then merge
         std::vector<keyval>* merge_vals;
@@ -549,8 +603,9 @@ protected:
 
             // Run merge tasks and get merge values.
             start_workers (&this->merge_callback, 
-                std::min(resulting_queues, this->num_threads), "merge");
+                std::min(resulting_queues, this->num_threads), "merge phase");
 
+            mem_account::charge(-this->output_bytes(merge_vals, merge_queues));
             delete [] merge_vals;
             merge_queues = resulting_queues;
         }
@@ -558,14 +613,19 @@ protected:
         assert(merge_queues == 1);
     }
 
-    virtual void merge_worker (thread_loc const& loc, double& time, 
-        double& user_time, int& tasks)
+    virtual void merge_worker (thread_loc const& loc, thread_metrics& stats)
     {
         PerformanceTracer::worker_thread_trace(loc.thread, "merge_begin");
-        timespec begin = get_time();
+        metrics_timer worker_timer(stats.time, this->collect_metrics);
+        mem_account::scope mem(this->memory, loc.thread);
         task_queue::task_t task;
-        while (this->taskQueue->dequeue (task, loc)) {
-            tasks++;
+        bool stolen;
+        while (this->taskQueue->dequeue (task, loc, &stolen)) {
+            if (this->memory.exceeded())
+                continue;
+            stats.tasks++;
+            stats.stolen += stolen;
+            metrics_timer user_timer(stats.busy, this->collect_metrics);
             std::vector<keyval>* vals = (std::vector<keyval>*)task.data;
             uint64_t length = task.len;
             uint64_t out_index = task.id;
@@ -576,7 +636,12 @@ protected:
                 // this case really just means sort my list in place. 
                 // stable_sort ensures that the order of same keyvals with 
                 // the same key emitted in reduce remains the same in sort
+                // (it takes a buffer of half the list while it runs)
+                int64_t buffer = 
+                    (int64_t)((vals->size() + 1) / 2 * sizeof(keyval));
+                mem_account::charge(buffer);
                 std::stable_sort(vals->begin(), vals->end(), sort_functor(this));
+                mem_account::charge(-buffer);
             }
             else if(length == 1)
             {
@@ -587,6 +652,8 @@ protected:
             {
                 // stl merge is nice and fast for 2.
                 this->final_vals[out_index].resize(vals[0].size()+vals[1].size());
+                mem_account::charge(
+                    this->output_bytes(&this->final_vals[out_index], 1));
                 std::merge(vals[0].begin(), vals[0].end(), 
                     vals[1].begin(), vals[1].end(), 
                         this->final_vals[out_index].begin(), sort_functor(this));
@@ -598,7 +665,7 @@ protected:
             }
             //PerformanceTracer::merge_trace(loc.thread, out_index, "end");
         }
-        time += time_elapsed(begin);
+        stats.mem_peak = this->memory.counter(loc.thread).peak;
         PerformanceTracer::worker_thread_trace(loc.thread, "merge_end");
     }
 };
@@ -0,0 +1,199 @@
+/* Copyright (c) 2007-2011, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#ifndef MAP_REDUCE_BASE_H_
+#define MAP_REDUCE_BASE_H_
+
+#include <algorithm>
+
+#include "stddefines.h"
+#include "processor.h"
+#include "scheduler.h"
+#include "task_queue.h"
+#include "thread_pool.h"
+#include "metrics.h"
+
+/* What the execution modes (MapReduce, MapFold) share: the thread pool and
+ * task queues, the thread count, starting a round of workers, and the 
+ * metrics of the last run. Self is the execution mode, which setThreads() 
+ * and setMetrics() return and the worker callbacks are handed.
+ */
+template<typename Self>
+class MapReduceBase
+{
+protected:
+
+    // Parameters.
+    uint64_t num_threads;               // # of threads to run.
+
+    thread_pool* threadPool;            // Thread pool.
+    task_queue* taskQueue;              // Queues of tasks.
+
+    bool collect_metrics;               // runtime switch for metrics
+    mr_metrics metrics;                 // metrics of the last run
+    double split_wall;                  // split before this run, < 0 if none
+
+    // Data passed to the callback functions.
+    struct thread_arg_t
+    {
+        // in
+        Self* job;
+        // out
+        thread_metrics stats;
+    };
+
+    void start_workers (void (*callback)(void*, thread_loc const&), 
+        int num_threads, char const* stage);    
+
+    // Phase timing; both are a flag test when metrics are off.
+    double phase_begin() const {
+        return this->collect_metrics ? metrics_now() : 0;
+    }
+    void phase_end(char const* phase, double begin) {
+        if(this->collect_metrics) {
+            double wall = metrics_now() - begin;
+            this->metrics.set_wall(phase, wall);
+            print_time(phase, wall);
+        }
+    }
+
+    // Starts the record of a run, with the split that produced its data
+    // in front if run(result) did one.
+    void metrics_begin() {
+        if(this->collect_metrics) {
+            this->metrics.clear();
+            this->metrics.num_threads = this->num_threads;
+            if(this->split_wall >= 0) {
+                phase_metrics split("split phase");
+                split.wall = this->split_wall;
+                this->metrics.phases.push_back(split);
+            }
+        }
+    }
+
+    // Ends the record of a run that began at RUN_BEGIN.
+    void metrics_end(double run_begin) {
+        if(this->collect_metrics) {
+            this->metrics.total = metrics_now() - run_begin + 
+                std::max(this->split_wall, 0.0);
+            this->metrics.peak_rss = metrics_peak_rss();
+            print_time("run time", this->metrics.total);
+            if (atoi(GETENV("MR_METRICS")) > 0)
+                this->metrics.print_json(stderr);
+        }
+    }
+
+    void create_threads(int num_threads, sched_policy const* policy) {
+        this->num_threads = (num_threads > 0) ? num_threads : this->num_threads;
+        
+        if(this->threadPool != NULL) delete this->threadPool;
+        if(this->taskQueue != NULL) delete this->taskQueue;
+
+        // Create thread pool and task queue
+        sched_policy_strand_fill default_policy(0);
+        this->threadPool = new thread_pool(
+            num_threads, policy == NULL ? &default_policy : policy);
+        this->taskQueue = new task_queue(num_threads, num_threads);
+    }
+
+public:
+
+    MapReduceBase() : threadPool(NULL), taskQueue(NULL), split_wall(-1) {
+        // Determine the number of threads to use. 
+        // First check for an environment variable, then use the 
+        // number of processors
+        int threads = atoi(GETENV("MR_NUMTHREADS"));
+        create_threads(threads > 0 ? threads : proc_get_num_cpus(), 0);
+
+        // MR_METRICS=1 collects metrics and prints them as JSON to stderr
+        // after every run. TIMING builds always collect them.
+#ifdef TIMING
+        this->collect_metrics = true;
+#else
+        this->collect_metrics = atoi(GETENV("MR_METRICS")) > 0;
+#endif
+    }
+
+    virtual ~MapReduceBase() {
+        if(this->threadPool != NULL) delete this->threadPool;
+        if(this->taskQueue != NULL) delete this->taskQueue;
+    }
+
+    // override the default thread offset and thread count.
+    Self& setThreads(int num_threads, sched_policy const* policy = NULL) {
+        create_threads(num_threads, policy);
+        return static_cast<Self&>(*this);
+    }
+
+    // turn run metrics collection on or off.
+    Self& setMetrics(bool enable) {
+        this->collect_metrics = enable;
+        return static_cast<Self&>(*this);
+    }
+
+    // metrics of the last run; empty unless collection was enabled.
+    mr_metrics const& getMetrics() const {
+        return this->metrics;
+    }
+};
+
+template<typename Self>
+void MapReduceBase<Self>::start_workers (
+    void (*func)(void*, thread_loc const&), int num_threads, char const* stage)
+{
+    thread_arg_t* th_arg_array = new thread_arg_t[num_threads];
+    thread_arg_t** th_arg_ptrarray = new thread_arg_t*[num_threads];
+    
+    for (int thread = 0; thread < num_threads; ++thread) 
+    {
+        th_arg_array[thread].job = static_cast<Self*>(this);
+        th_arg_ptrarray[thread] = &(th_arg_array[thread]);        
+    }
+    
+    CHECK_ERROR (threadPool->set(func, (void **)th_arg_ptrarray, num_threads));
+    // Start worker threads
+    CHECK_ERROR (threadPool->begin());                
+    dprintf("Status: All %d threads have been created\n", num_threads);    
+    // Barrier, wait for all threads to finish.
+    CHECK_ERROR (threadPool->wait());            
+
+    if (this->collect_metrics) {
+        thread_metrics* stats = new thread_metrics[num_threads];
+        for (int thread = 0; thread < num_threads; ++thread)
+            stats[thread] = th_arg_array[thread].stats;
+        this->metrics.add_workers(stage, stats, num_threads);
+        delete [] stats;
+    }
+
+    delete [] th_arg_ptrarray;
+    delete [] th_arg_array;
+    
+    dprintf("Status: All tasks have completed\n"); 
+}
+
+#endif // MAP_REDUCE_BASE_H_
+
+// vim: ts=8 sw=4 sts=4 smarttab smartindent
@@ -0,0 +1,141 @@
+/* Copyright (c) 2007-2011, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the names of its 
+*       contributors may be used to endorse or promote products derived from 
+*       this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+
+#ifndef MATCHER_H_
+#define MATCHER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Finds occurrences of many literal patterns in one pass over the data.
+// Patterns are compiled into an Aho-Corasick automaton over byte classes.
+// Whenever the automaton is back at its root, a prefilter on the first 
+// (up to) three bytes of the patterns skips to the next position where a 
+// pattern may start. On x86 CPUs with SSSE3 the prefilter looks at 16 
+// positions at a time, with nibble lookup tables over 8 buckets of patterns
+// (the "Teddy" approach); elsewhere it uses per-byte lookup tables.
+//
+// A matcher is read-only once built, so all map tasks can share one. 
+class multi_matcher
+{
+public:
+    // Empty patterns are ignored, but keep their index.
+    explicit multi_matcher(std::vector<std::string> const& patterns);
+
+    int size() const { return (int)lengths.size(); }
+    uint64_t length(int pattern) const { return lengths[pattern]; }
+
+    // Calls found(pattern, pos) for each occurrence of a pattern in 
+    // data[0, len), where pos is the offset of its first byte. Occurrences
+    // that cross the end of data are not found, so a splitter should 
+    // break the input where no pattern can span the break (e.g. at line 
+    // breaks for patterns without them).
+    template<typename F>
+    void scan(char const* data, uint64_t len, F found) const;
+
+    // Returns the number of occurrences in data[0, len).
+    uint64_t count(char const* data, uint64_t len) const;
+
+private:
+    static const uint32_t MATCH = 0x80000000u;  // flags states with outputs
+    static const int BUCKETS = 8;               // prefilter buckets
+    static const uint64_t PREFILTER_MIN_SKIP = 16;
+    static const uint64_t PREFILTER_BACKOFF = 256;
+
+    typedef uint64_t (*prefilter_t)(multi_matcher const&, 
+        unsigned char const*, uint64_t, uint64_t);
+
+    int num_classes;
+    unsigned char byte_class[256];
+
+    // Transitions, indexed by state*num_classes + class. Targets are 
+    // premultiplied by num_classes and tagged with MATCH if they have outputs.
+    std::vector<uint32_t> delta;
+    std::vector<uint32_t> out_begin;    // outputs of each state in out_ids
+    std::vector<uint32_t> out_ids;
+    std::vector<uint64_t> lengths;
+
+    // Prefilter over the first prefix_len bytes of every pattern.
+    int prefix_len;
+    unsigned char byte_mask[3][256];    // buckets with a pattern byte
+    unsigned char nibble_lo[3][16];     // buckets with a pattern low nibble
+    unsigned char nibble_hi[3][16];     // buckets with a pattern high nibble
+    prefilter_t prefilter;
+
+    static uint64_t prefilter_scalar(multi_matcher const& m, 
+        unsigned char const* s, uint64_t i, uint64_t len);
+#if defined(__x86_64__) || defined(__i386__)
+    static uint64_t prefilter_ssse3(multi_matcher const& m, 
+        unsigned char const* s, uint64_t i, uint64_t len);
+#endif
+
+    template<typename F>
+    void report(uint32_t state, uint64_t end, F& found) const {
+        uint32_t s = state / num_classes;
+        for(uint32_t o = out_begin[s]; o < out_begin[s+1]; o++) {
+            int p = out_ids[o];
+            found(p, end + 1 - lengths[p]);
+        }
+    }
+};
+
+template<typename F>
+void multi_matcher::scan(char const* data, uint64_t len, F found) const
+{
+    unsigned char const* s = (unsigned char const*)data;
+    uint32_t const* d = &delta[0];
+    uint32_t state = 0;
+    uint64_t i = 0, prefilter_pos = 0;
+
+    if(out_ids.empty())
+        return;
+
+    while(i < len) {
+        // Nothing is partially matched, so skip to where a pattern may start.
+        // If that skipped little, candidates are dense, so let the automaton 
+        // run for a while before trying again.
+        if(state == 0 && i >= prefilter_pos) {
+            uint64_t next = prefilter(*this, s, i, len);
+            if(next >= len)
+                break;
+            prefilter_pos = (next - i < PREFILTER_MIN_SKIP) ? 
+                next + PREFILTER_BACKOFF : next;
+            i = next;
+        }
+
+        uint32_t next = d[state + byte_class[s[i]]];
+        state = next & ~MATCH;
+        if(next & MATCH)
+            report(state, i, found);
+        i++;
+    }
+}
+
+#endif /* MATCHER_H_ */
+
+// vim: ts=8 sw=4 sts=4 smarttab smartindent
@@ -0,0 +1,237 @@
+/* Copyright (c) 2007-2011, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#ifdef _LINUX_
+#include <malloc.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "stddefines.h"
+
+// Wall clock for the run metrics. Unlike get_time() this is always compiled;
+// callers only read it when metrics are enabled.
+static inline double metrics_now()
+{
+    using namespace std::chrono;
+    return duration_cast< duration<double> >(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+// Bytes currently allocated from the heap, or -1 where unknown.
+static inline int64_t metrics_heap_bytes()
+{
+#if defined(_LINUX_) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2();
+    return (int64_t)(mi.uordblks + mi.hblkhd);
+#else
+    return -1;
+#endif
+}
+
+// Peak resident set size of the process in bytes, or 0 where unknown.
+static inline uint64_t metrics_peak_rss()
+{
+    struct rusage ru;
+    if(getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+#ifdef _DARWIN_
+    return (uint64_t)ru.ru_maxrss;
+#else
+    return (uint64_t)ru.ru_maxrss * 1024;
+#endif
+}
+
+// Per worker thread counters for one phase.
+struct thread_metrics
+{
+    double busy;        // seconds spent in user map/reduce/merge code
+    double time;        // seconds spent in the worker loop
+    double idle;        // phase wall time not spent busy
+    uint64_t tasks;     // tasks executed
+    uint64_t stolen;    // tasks taken from another thread's queue
+    int64_t mem_peak;   // most bytes the thread held (see accounting.h)
+
+    thread_metrics() : busy(0), time(0), idle(0), tasks(0), stolen(0), 
+        mem_peak(0) {}
+
+    thread_metrics& operator+=(thread_metrics const& o) {
+        busy += o.busy;
+        time += o.time;
+        tasks += o.tasks;
+        stolen += o.stolen;
+        mem_peak = std::max(mem_peak, o.mem_peak);
+        return *this;
+    }
+};
+
+struct phase_metrics
+{
+    std::string name;
+    double wall;                            // seconds
+    int64_t mem_peak;                       // sum of the threads' peaks
+    std::vector<thread_metrics> threads;    // empty for serial phases
+
+    explicit phase_metrics(char const* name) : 
+        name(name), wall(0), mem_peak(0) {}
+
+    uint64_t tasks() const {
+        uint64_t n = 0;
+        for(size_t i = 0; i < threads.size(); i++) n += threads[i].tasks;
+        return n;
+    }
+
+    uint64_t stolen() const {
+        uint64_t n = 0;
+        for(size_t i = 0; i < threads.size(); i++) n += threads[i].stolen;
+        return n;
+    }
+
+    // Slowest thread's busy time over the mean; 1 is perfectly balanced.
+    double imbalance() const {
+        double total = 0, max = 0;
+        for(size_t i = 0; i < threads.size(); i++) {
+            total += threads[i].busy;
+            max = std::max(max, threads[i].busy);
+        }
+        return total > 0 ? max * threads.size() / total : 1;
+    }
+};
+
+/* Structured timing and resource metrics for a single MapReduce::run(). 
+ * Collection is enabled at runtime with MapReduce::setMetrics() or the 
+ * MR_METRICS environment variable; when it is off the engine only tests a 
+ * flag per phase and per task. */
+struct mr_metrics
+{
+    double total;                       // seconds for the whole run
+    uint64_t num_threads;
+    int64_t container_bytes;            // heap growth over the map phase
+                                        // (-1 if the platform can't tell)
+    int64_t container_mem;              // bytes accounted to the containers
+                                        // at the end of the map phase
+    uint64_t peak_rss;                  // bytes
+    std::vector<phase_metrics> phases;  // in execution order
+
+    mr_metrics() { clear(); }
+
+    void clear() {
+        total = 0;
+        num_threads = 0;
+        container_bytes = -1;
+        container_mem = 0;
+        peak_rss = 0;
+        phases.clear();
+    }
+
+    phase_metrics const* phase(char const* name) const {
+        for(size_t i = 0; i < phases.size(); i++)
+            if(phases[i].name == name) return &phases[i];
+        return NULL;
+    }
+
+    phase_metrics& get_phase(char const* name) {
+        for(size_t i = 0; i < phases.size(); i++)
+            if(phases[i].name == name) return phases[i];
+        phases.push_back(phase_metrics(name));
+        return phases.back();
+    }
+
+    // Folds one start_workers() round into PHASE; rounds of the same phase 
+    // (e.g. merge) accumulate per thread.
+    void add_workers(char const* name, thread_metrics const* t, int n) {
+        phase_metrics& p = get_phase(name);
+        if(p.threads.size() < (size_t)n)
+            p.threads.resize(n);
+        for(int i = 0; i < n; i++)
+            p.threads[i] += t[i];
+    }
+
+    void set_wall(char const* name, double wall) {
+        phase_metrics& p = get_phase(name);
+        p.wall = wall;
+        for(size_t i = 0; i < p.threads.size(); i++)
+            p.threads[i].idle = std::max(0.0, wall - p.threads[i].busy);
+    }
+
+    void print_json(FILE* f) const {
+        fprintf(f, "{\"total\": %.6f, \"threads\": %lu, "
+            "\"container_bytes\": %lld, \"container_mem\": %lld, "
+            "\"peak_rss\": %lu, \"phases\": [",
+            total, (unsigned long)num_threads, (long long)container_bytes, 
+            (long long)container_mem, (unsigned long)peak_rss);
+        for(size_t i = 0; i < phases.size(); i++) {
+            phase_metrics const& p = phases[i];
+            fprintf(f, "%s{\"name\": \"%s\", \"wall\": %.6f, "
+                "\"mem_peak\": %lld", i ? ", " : "", p.name.c_str(), p.wall, 
+                (long long)p.mem_peak);
+            if(!p.threads.empty()) {
+                fprintf(f, ", \"tasks\": %lu, \"stolen\": %lu, "
+                    "\"imbalance\": %.3f, \"per_thread\": [", 
+                    (unsigned long)p.tasks(), (unsigned long)p.stolen(), 
+                    p.imbalance());
+                for(size_t j = 0; j < p.threads.size(); j++) {
+                    thread_metrics const& t = p.threads[j];
+                    fprintf(f, "%s{\"busy\": %.6f, \"idle\": %.6f, "
+                        "\"tasks\": %lu, \"stolen\": %lu, "
+                        "\"mem_peak\": %lld}", j ? ", " : "", 
+                        t.busy, t.idle, (unsigned long)t.tasks, 
+                        (unsigned long)t.stolen, (long long)t.mem_peak);
+                }
+                fprintf(f, "]");
+            }
+            fprintf(f, "}");
+        }
+        fprintf(f, "]}\n");
+    }
+};
+
+// Adds the time between construction and destruction to ACC when enabled.
+class metrics_timer
+{
+    double* acc;
+    double begin;
+public:
+    metrics_timer(double& acc, bool enabled) : 
+        acc(enabled ? &acc : NULL), begin(enabled ? metrics_now() : 0) {}
+    ~metrics_timer() {
+        if(acc) *acc += metrics_now() - begin;
+    }
+};
+
+#endif /* METRICS_H_ */
+
+// vim: ts=8 sw=4 sts=4 smarttab smartindent
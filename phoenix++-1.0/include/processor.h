@@ -27,6 +27,10 @@
 #ifndef PROCESSOR_H_
 #define PROCESSOR_H_
 
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
 #ifdef _LINUX_
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
@@ -66,6 +70,93 @@ inline int proc_get_num_cpus (void)
     return num_cpus;
 }
 
+#ifdef _LINUX_
+/* Read the size of the level LEVEL data (or unified) cache of cpu0 from
+   sysfs. Returns 0 if it is not listed. */
+static uint64_t proc_read_cache_size (int level)
+{
+    char path[128], type[32];
+    FILE* f;
+    int index, lvl, n;
+    unsigned long size;
+    char unit;
+
+    for (index = 0; ; index++)
+    {
+        snprintf (path, sizeof (path),
+            "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+        if ((f = fopen (path, "r")) == NULL) return 0;
+        n = fscanf (f, "%d", &lvl);
+        fclose (f);
+        if (n != 1 || lvl != level) continue;
+
+        snprintf (path, sizeof (path),
+            "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+        if ((f = fopen (path, "r")) == NULL) continue;
+        n = fscanf (f, "%31s", type);
+        fclose (f);
+        if (n != 1 || type[0] == 'I') continue;    /* Instruction */
+
+        snprintf (path, sizeof (path),
+            "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+        if ((f = fopen (path, "r")) == NULL) continue;
+        unit = 0;
+        n = fscanf (f, "%lu%c", &size, &unit);
+        fclose (f);
+        if (n < 1) continue;
+        if (unit == 'K') size <<= 10;
+        else if (unit == 'M') size <<= 20;
+        return size;
+    }
+}
+#endif
+
+/* The data cache sizes reported by proc_get_cache_size(), by level. */
+struct proc_cache_sizes
+{
+    uint64_t bytes[4];
+
+    proc_cache_sizes (void)
+    {
+        int i;
+        long size;
+        char const* env[4] = 
+            { NULL, "MAPRED_L1_CACHE", "MAPRED_L2_CACHE", "MAPRED_L3_CACHE" };
+        char* str;
+
+        bytes[0] = 0;
+        for (i = 1; i <= 3; i++)
+        {
+            size = 0;
+#if defined (_LINUX_) && defined (_SC_LEVEL1_DCACHE_SIZE)
+            size = sysconf (i == 1 ? _SC_LEVEL1_DCACHE_SIZE :
+                i == 2 ? _SC_LEVEL2_CACHE_SIZE : _SC_LEVEL3_CACHE_SIZE);
+#endif
+#ifdef _LINUX_
+            if (size <= 0)
+                size = (long)proc_read_cache_size (i);
+#endif
+            if ((str = getenv (env[i])))
+                size = atol (str);
+            bytes[i] = size > 0 ? (uint64_t)size : 0;
+        }
+    }
+};
+
+/* Query the size in bytes of the level LEVEL (1 to 3) data cache of a 
+   CPU. Unknown sizes (e.g. no L3) are returned as 0. The sizes can be 
+   overridden with MAPRED_L1_CACHE, MAPRED_L2_CACHE and MAPRED_L3_CACHE 
+   (in bytes). */
+inline uint64_t proc_get_cache_size (int level)
+{
+    /* Read once, by the first thread to ask; the others wait for it. */
+    static proc_cache_sizes const sizes;
+
+    if (level < 1 || level > 3) return 0;
+
+    return sizes.bytes[level];
+}
+
 #ifdef _LINUX_
 static cpu_set_t    full_cs;
 static cpu_set_t* proc_get_full_set(void)
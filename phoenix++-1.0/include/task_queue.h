@@ -50,7 +50,8 @@ public:
     void enqueue(task_t const& task, thread_loc const& loc, 
         int total_tasks=0, int lgrp=-1);
     void enqueue_seq(task_t const& task, int total_tasks=0, int lgrp=-1);
-    int dequeue(task_t& task, thread_loc const& loc);
+    // STOLEN, if given, is set when the task came from another queue.
+    int dequeue(task_t& task, thread_loc const& loc, bool* stolen = NULL);
 
 private:
 
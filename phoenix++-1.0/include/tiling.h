@@ -0,0 +1,201 @@
+/* Copyright (c) 2007-2011, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the names of its 
+*       contributors may be used to endorse or promote products derived from 
+*       this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#ifndef TILING_H_
+#define TILING_H_
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+
+#include "processor.h"
+
+// One block of a rows x cols x depth iteration space: the half-open 
+// ranges [row_begin, row_end), [col_begin, col_end) and 
+// [depth_begin, depth_end).
+struct tile
+{
+    uint64_t row_begin, row_end;
+    uint64_t col_begin, col_end;
+    uint64_t depth_begin, depth_end;
+};
+
+// Cuts a rows x cols x depth iteration space, such as the i, j and k loops
+// of a matrix product C[i][j] += A[i][k] * B[k][j], into tiles for a 
+// MapReduce split(). The tile shape comes from the cache capacities that
+// proc_get_cache_size() reports:
+//  - depth_block() is the depth for which a register block's slivers of 
+//    A and B (align rows and columns of elem_size bytes) fill half the L1.
+//    Map functions step through the depth of a tile in blocks of this.
+//  - The rows x cols of a tile are square, a multiple of align, and sized
+//    so that the tile of C and the A and B panels of one depth block fill
+//    half the L2. Tiles are shrunk until there are at least min_tiles.
+//  - Tiles are handed out one column band at a time. A band of B (depth 
+//    rows by band columns) fills half the L3, so the tiles that run at the
+//    same time on different cores share it there.
+// By default a tile covers the whole depth, so tiles write disjoint blocks
+// of the output. With split_depth, tiles are 3D blocks one depth block 
+// deep, and their partial results have to be combined, e.g. by emitting 
+// them for reduce().
+//
+// For locate(), a tile's data is best placed by the start of its rows 
+// of the input, e.g. &A[row_begin*lda + depth_begin].
+class tiled_split
+{
+public:
+    tiled_split(uint64_t rows, uint64_t cols, uint64_t depth = 1,
+        uint64_t elem_size = sizeof(int), uint64_t align = 1, 
+        uint64_t min_tiles = 0, bool split_depth = false);
+
+    // Overrides the tile shape. Zero keeps the current size.
+    void set_tile_size(uint64_t rows, uint64_t cols, uint64_t depth = 0);
+
+    uint64_t tile_rows() const { return trows; }
+    uint64_t tile_cols() const { return tcols; }
+    uint64_t tile_depth() const { return tdepth; }
+    uint64_t depth_block() const { return dblock; }
+
+    // Number of tiles in total.
+    uint64_t count() const {
+        return ((rows + trows - 1) / trows) * ((cols + tcols - 1) / tcols) *
+            ((depth + tdepth - 1) / tdepth);
+    }
+
+    // Fills t with the next tile and returns true, or returns false once 
+    // all tiles have been handed out.
+    bool next(tile& t);
+
+    // Starts again from the first tile.
+    void reset() {
+        band = next_col = next_row = next_depth = 0;
+        if (rows == 0 || depth == 0)
+            band = cols;
+    }
+
+private:
+    uint64_t rows, cols, depth;
+    uint64_t elem_size;
+    uint64_t trows, tcols, tdepth;  // tile shape
+    uint64_t dblock;                // depth block
+    uint64_t band_cols;             // width of a column band
+
+    uint64_t band, next_row, next_col, next_depth;
+
+    void set_band();
+};
+
+inline tiled_split::tiled_split(uint64_t rows, uint64_t cols, 
+    uint64_t depth, uint64_t elem_size, uint64_t align, uint64_t min_tiles,
+    bool split_depth) : rows(rows), cols(cols), depth(depth), 
+    elem_size(std::max<uint64_t>(elem_size, 1))
+{
+    uint64_t l1 = proc_get_cache_size(1);
+    uint64_t l2 = proc_get_cache_size(2);
+    if (l1 == 0) l1 = 32*1024;
+    if (l2 == 0) l2 = 256*1024;
+    align = std::max<uint64_t>(align, 1);
+
+    // The A and B slivers of a register block take 2*align elements per
+    // unit of depth.
+    dblock = l1 / 2 / (this->elem_size * 2 * align);
+    dblock = std::max<uint64_t>(std::min(dblock, depth), 1);
+
+    // A t x t tile with its panels takes t*t + 2*t*dblock elements.
+    double cap = (double)l2 / 2 / this->elem_size;
+    uint64_t t = (uint64_t)(sqrt((double)dblock*dblock + cap) - dblock);
+    t = std::max(t / align * align, align);
+
+    trows = std::max<uint64_t>(std::min(t, rows), 1);
+    tcols = std::max<uint64_t>(std::min(t, cols), 1);
+    tdepth = split_depth ? dblock : std::max<uint64_t>(depth, 1);
+    while (count() < min_tiles && (trows > align || tcols > align))
+    {
+        uint64_t& side = trows >= tcols ? trows : tcols;
+        side = std::max((side / 2 + align - 1) / align * align, align);
+    }
+
+    set_band();
+    reset();
+}
+
+inline void tiled_split::set_tile_size(uint64_t rows, uint64_t cols, 
+    uint64_t depth)
+{
+    if (rows > 0) trows = rows;
+    if (cols > 0) tcols = cols;
+    if (depth > 0) tdepth = depth;
+    dblock = std::min(dblock, tdepth);
+    set_band();
+    reset();
+}
+
+inline void tiled_split::set_band()
+{
+    uint64_t l3 = proc_get_cache_size(3);
+
+    band_cols = cols;
+    if (l3 > 0 && depth > 0)
+    {
+        uint64_t tiles = l3 / 2 / (elem_size * depth) / tcols;
+        band_cols = std::min(std::max<uint64_t>(tiles, 1) * tcols, cols);
+    }
+    band_cols = std::max<uint64_t>(band_cols, 1);
+}
+
+inline bool tiled_split::next(tile& t)
+{
+    if (band >= cols)
+        return false;
+
+    uint64_t band_end = std::min(band + band_cols, cols);
+    t.row_begin = next_row;
+    t.row_end = std::min(next_row + trows, rows);
+    t.col_begin = next_col;
+    t.col_end = std::min(next_col + tcols, band_end);
+    t.depth_begin = next_depth;
+    t.depth_end = std::min(next_depth + tdepth, depth);
+
+    // Depth blocks of a tile, then tiles along a row of the band, then 
+    // rows of the band, then bands.
+    if ((next_depth += tdepth) >= depth)
+    {
+        next_depth = 0;
+        if ((next_col += tcols) >= band_end)
+        {
+            next_col = band;
+            if ((next_row += trows) >= rows)
+            {
+                next_row = 0;
+                band = next_col = band_end;
+            }
+        }
+    }
+    return true;
+}
+
+#endif /* TILING_H_ */
+
+// vim: ts=8 sw=4 sts=4 smarttab smartindent
@@ -0,0 +1,220 @@
+/* Copyright (c) 2007-2011, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the names of its 
+*       contributors may be used to endorse or promote products derived from 
+*       this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+
+#include <string.h>
+#include <algorithm>
+#include <deque>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#endif
+
+#include "../include/matcher.h"
+
+multi_matcher::multi_matcher(std::vector<std::string> const& patterns)
+{
+    int num_patterns = (int)patterns.size();
+    
+    // Bytes that appear in no pattern all share class 0
+    memset(byte_class, 0, sizeof(byte_class));
+    num_classes = 1;
+    uint64_t min_len = UINT64_MAX;
+    for(int p = 0; p < num_patterns; p++) {
+        std::string const& pat = patterns[p];
+        for(size_t j = 0; j < pat.size(); j++) {
+            unsigned char c = (unsigned char)pat[j];
+            if(byte_class[c] == 0)
+                byte_class[c] = num_classes++;
+        }
+        lengths.push_back(pat.size());
+        if(pat.size() > 0)
+            min_len = std::min<uint64_t>(min_len, pat.size());
+    }
+
+    // Build the trie; -1 marks a missing edge
+    std::vector<int> trie(num_classes, -1);
+    std::vector< std::vector<int> > outputs(1);
+    for(int p = 0; p < num_patterns; p++) {
+        std::string const& pat = patterns[p];
+        if(pat.empty())
+            continue;
+        int s = 0;
+        for(size_t j = 0; j < pat.size(); j++) {
+            int c = byte_class[(unsigned char)pat[j]];
+            if(trie[s*num_classes + c] < 0) {
+                trie[s*num_classes + c] = (int)outputs.size();
+                outputs.push_back(std::vector<int>());
+                trie.resize(trie.size() + num_classes, -1);
+            }
+            s = trie[s*num_classes + c];
+        }
+        outputs[s].push_back(p);
+    }
+    int num_states = (int)outputs.size();
+
+    // Turn it into a DFA in breadth first order, so the failure state of 
+    // every state is done before it
+    std::vector<int> fail(num_states, 0);
+    std::vector<int> order;
+    std::deque<int> queue;
+    order.reserve(num_states);
+    queue.push_back(0);
+    while(!queue.empty()) {
+        int s = queue.front();
+        queue.pop_front();
+        order.push_back(s);
+        if(s != 0)
+            outputs[s].insert(outputs[s].end(), 
+                outputs[fail[s]].begin(), outputs[fail[s]].end());
+        for(int c = 0; c < num_classes; c++) {
+            int t = trie[s*num_classes + c];
+            if(t >= 0) {
+                fail[t] = (s == 0) ? 0 : trie[fail[s]*num_classes + c];
+                queue.push_back(t);
+            }
+            else {
+                trie[s*num_classes + c] = 
+                    (s == 0) ? 0 : trie[fail[s]*num_classes + c];
+            }
+        }
+    }
+
+    delta.resize(num_states * num_classes);
+    for(int i = 0; i < num_states * num_classes; i++) {
+        int t = trie[i];
+        delta[i] = t * num_classes | (outputs[t].empty() ? 0 : MATCH);
+    }
+    out_begin.resize(num_states + 1);
+    for(int s = 0; s < num_states; s++) {
+        out_begin[s] = out_ids.size();
+        out_ids.insert(out_ids.end(), outputs[s].begin(), outputs[s].end());
+    }
+    out_begin[num_states] = out_ids.size();
+
+    // Patterns with the same prefix go to the same bucket, so that a 
+    // candidate for one is less likely to be a candidate for the others
+    prefix_len = (int)std::min<uint64_t>(3, out_ids.empty() ? 1 : min_len);
+    memset(byte_mask, 0, sizeof(byte_mask));
+    memset(nibble_lo, 0, sizeof(nibble_lo));
+    memset(nibble_hi, 0, sizeof(nibble_hi));
+    for(int p = 0; p < num_patterns; p++) {
+        std::string const& pat = patterns[p];
+        if(pat.empty())
+            continue;
+        uint32_t hash = 0;
+        for(int k = 0; k < prefix_len; k++)
+            hash = hash * 31 + (unsigned char)pat[k];
+        unsigned char bucket = 1 << (hash % BUCKETS);
+        for(int k = 0; k < prefix_len; k++) {
+            unsigned char c = (unsigned char)pat[k];
+            byte_mask[k][c] |= bucket;
+            nibble_lo[k][c & 0xf] |= bucket;
+            nibble_hi[k][c >> 4] |= bucket;
+        }
+    }
+
+    prefilter = prefilter_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    if(__builtin_cpu_supports("ssse3"))
+        prefilter = prefilter_ssse3;
+#endif
+}
+
+uint64_t multi_matcher::count(char const* data, uint64_t len) const
+{
+    uint64_t n = 0;
+    scan(data, len, [&n](int, uint64_t) { n++; });
+    return n;
+}
+
+// Returns the first position from i on where a pattern may start, or len.
+uint64_t multi_matcher::prefilter_scalar(multi_matcher const& m, 
+    unsigned char const* s, uint64_t i, uint64_t len)
+{
+    // Patterns are at least prefix_len long, so none start later
+    if(len < (uint64_t)m.prefix_len)
+        return len;
+    uint64_t last = len - m.prefix_len;
+
+    switch(m.prefix_len) {
+    case 1:
+        for(; i <= last; i++)
+            if(m.byte_mask[0][s[i]])
+                return i;
+        break;
+    case 2:
+        for(; i <= last; i++)
+            if(m.byte_mask[0][s[i]] & m.byte_mask[1][s[i+1]])
+                return i;
+        break;
+    default:
+        for(; i <= last; i++)
+            if(m.byte_mask[0][s[i]] & m.byte_mask[1][s[i+1]] & 
+                m.byte_mask[2][s[i+2]])
+                return i;
+        break;
+    }
+    return len;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+uint64_t multi_matcher::prefilter_ssse3(multi_matcher const& m, 
+    unsigned char const* s, uint64_t i, uint64_t len)
+{
+    __m128i const nibble = _mm_set1_epi8(0xf);
+    __m128i const zero = _mm_setzero_si128();
+    __m128i lo[3], hi[3];
+    int n = m.prefix_len;
+
+    for(int k = 0; k < n; k++) {
+        lo[k] = _mm_loadu_si128((__m128i const*)m.nibble_lo[k]);
+        hi[k] = _mm_loadu_si128((__m128i const*)m.nibble_hi[k]);
+    }
+
+    // Each lane ends up with the buckets that have a pattern whose prefix 
+    // matches the nibbles of the text starting there
+    while(i + 16 + n - 1 <= len) {
+        __m128i res = _mm_set1_epi8(-1);
+        for(int k = 0; k < n; k++) {
+            __m128i t = _mm_loadu_si128((__m128i const*)(s + i + k));
+            __m128i l = _mm_shuffle_epi8(lo[k], _mm_and_si128(t, nibble));
+            __m128i h = _mm_shuffle_epi8(hi[k], 
+                _mm_and_si128(_mm_srli_epi16(t, 4), nibble));
+            res = _mm_and_si128(res, _mm_and_si128(l, h));
+        }
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(res, zero)) ^ 0xffff;
+        if(mask)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+
+    return prefilter_scalar(m, s, i, len);
+}
+#endif
+
+// vim: ts=8 sw=4 sts=4 smarttab smartindent
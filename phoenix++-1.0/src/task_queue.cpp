@@ -78,7 +78,7 @@ void task_queue::enqueue_seq (const task_t& task, int total_tasks, int lgrp)
     queues[index].push_back(task);    
 }
 
-int task_queue::dequeue (task_t& task, thread_loc const& loc)
+int task_queue::dequeue (task_t& task, thread_loc const& loc, bool* stolen)
 {
     int index = (loc.lgrp < 0) ? loc.cpu : loc.lgrp;
     
@@ -102,6 +102,7 @@ int task_queue::dequeue (task_t& task, thread_loc const& loc)
                 this->queues[idx].pop_back();
                 dprintf("Stole task from %d to %d\n", idx, index);
             }
+            if(stolen != NULL) *stolen = (idx != index);
             ret = 1;
         }
         locks[idx]->release(loc.thread);
@@ -131,7 +131,7 @@ int main(int argc, char *argv[]) {
             input.push_back(line);
         }        
     }    
-    printf("This file has %d records\n", input.size());
+    printf("This file has %lu records\n", (unsigned long)input.size());
     get_time(end);
     print_time("initialize", begin, end);
 
@@ -113,11 +113,11 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    if (std::string(argv[2]) == "log") {
+    if (argc > 2 && std::string(argv[2]) == "log") {
         __logging = true;
         __replaying = false;
     }
-    else if (std::string(argv[2]) == "replay") {
+    else if (argc > 2 && std::string(argv[2]) == "replay") {
         __logging = false;
         __replaying = true;
     }
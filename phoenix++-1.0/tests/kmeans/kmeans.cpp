@@ -23,11 +23,12 @@
 * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */ 
-
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <limits>
+#include <limits.h>
+#include <string.h>
+#include <vector>
 
 #include "map_reduce.h"
 
@@ -40,53 +41,34 @@
 #define DEF_DIM 3
 #define DEF_GRID_SIZE 1000
 
+#define POINT_BLOCK 64  // points per block
+#define MEAN_LANES 8    // the means are padded to a multiple of this
 
 int num_points; // number of vectors
 int dim;         // Dimension of each vector
 int num_means; // number of clusters
 int grid_size; // size of each dimension of vector space
-int modified;
-int num_pts = 0;
-
+int num_means_padded;
 
-struct point
+// A block of up to POINT_BLOCK points, stored by dimension (blocked SoA):
+// coordinate k of point i is d[k*POINT_BLOCK + i].
+struct point_block
 {
     int* d;
-    int cluster;  // Cluster id or cluster point count (for means)
-    
-    point() { d = NULL; cluster = -1; }
-    point(int* d, int cluster) { this->d = d; this->cluster = cluster; }
-    
-    point& normalize() {
-	for(int i = 0; i < dim; ++i)
-             d[i] /= cluster;
-        cluster = 1;
-        return *this;
-    }
-    
-    unsigned int sq_dist(point const& p)
-    {
-        unsigned int sum = 0;
-        for (int i = 0; i < dim; i++) 
-        {
-            int diff = d[i] - p.d[i];
-            sum += diff * diff;
-        }
-        return sum;
-    }
-    
-    void dump() {
-        for(int j = 0; j < dim; j++)
-            printf("%5d ", d[j]);
-        printf("\n");
-    }
-    
-    void generate() {
-        for(int j = 0; j < dim; j++)
-            d[j] = rand() % grid_size;
-    }
+    int* cluster;   // cluster of each point, -1 before the first pass
+    int count;      // number of points in the block
 };
 
+// The means are stored by dimension too: coordinate k of mean j is 
+// means[k*num_means_padded + j].
+
+// Keys of the accumulators. For mean j, key j*(dim+1) + k sums coordinate
+// k of its points and key j*(dim+1) + dim counts them. The last key counts
+// the points that moved to another mean.
+inline intptr_t sum_key(int mean, int k) { return (intptr_t)mean*(dim+1) + k; }
+inline intptr_t count_key(int mean) { return sum_key(mean, dim); }
+inline intptr_t changed_key() { return (intptr_t)num_means*(dim+1); }
+
 /** parse_args()
  *  Parse the user arguments
  */
@@ -132,86 +114,166 @@ void parse_args(int argc, char **argv)
     printf("Size of each dimension = %d\n", grid_size);    
 }
 
-template<class V, template<class> class Allocator>
-class point_combiner : public associative_combiner<point_combiner<V, Allocator>, V, Allocator> 
+// Distances to MEAN_LANES means, as a GCC vector.
+typedef unsigned int lanes_t 
+    __attribute__((vector_size(MEAN_LANES * sizeof(unsigned int))));
+
+/** nearest_means()
+ *  Finds the first of the nearest means of each point of a block. The 
+ *  distances to MEAN_LANES means at a time are summed over the dimensions
+ *  in a vector, and each lane keeps its own minimum.
+ */
+static inline __attribute__((always_inline)) 
+void nearest_means_impl(point_block const& b, int const* means, int* nearest)
+{
+    lanes_t first_idx;
+    for (int l = 0; l < MEAN_LANES; l++)
+        first_idx[l] = l;
+
+    for (int i = 0; i < b.count; i++)
+    {
+        lanes_t best = ~(lanes_t){};
+        lanes_t best_idx = first_idx;
+        lanes_t idx = first_idx;
+
+        for (int j0 = 0; j0 < num_means_padded; j0 += MEAN_LANES)
+        {
+            lanes_t acc = {};
+            for (int k = 0; k < dim; k++)
+            {
+                lanes_t m;
+                memcpy(&m, &means[k*num_means_padded + j0], sizeof(m));
+                lanes_t diff = (unsigned int)b.d[k*POINT_BLOCK + i] - m;
+                acc += diff * diff;
+            }
+            // the padding never wins
+            if (j0 + MEAN_LANES > num_means)
+                acc |= (lanes_t)(idx >= (unsigned int)num_means);
+
+            lanes_t less = (lanes_t)(acc < best);
+            best = (acc & less) | (best & ~less);
+            best_idx = (idx & less) | (best_idx & ~less);
+            idx += MEAN_LANES;
+        }
+
+        int l_min = 0;
+        for (int l = 1; l < MEAN_LANES; l++)
+        {
+            if (best[l] < best[l_min] || 
+                (best[l] == best[l_min] && best_idx[l] < best_idx[l_min]))
+                l_min = l;
+        }
+        nearest[i] = best_idx[l_min];
+    }
+}
+
+static void nearest_means_generic(point_block const& b, int const* means, 
+    int* nearest)
 {
-public:
-     static void F(point& a, point const& b) { 
-         a.cluster += b.cluster;
-         for(int i = 0; i < dim; i++) a.d[i] += b.d[i]; 
-     }
-     static void Init(point& a) { 
-         a.cluster = 0;
-         a.d = (int*)calloc(dim, sizeof(int)); 
-     }
-     static bool Empty(point const& a) { 
-         return a.cluster == 0; 
-     }
-};
+    nearest_means_impl(b, means, nearest);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Without SSE4.1 there is no vector 32-bit multiply or unsigned minimum.
+__attribute__((target("avx2")))
+static void nearest_means_avx2(point_block const& b, int const* means, 
+    int* nearest)
+{
+    nearest_means_impl(b, means, nearest);
+}
+
+__attribute__((target("sse4.1")))
+static void nearest_means_sse41(point_block const& b, int const* means, 
+    int* nearest)
+{
+    nearest_means_impl(b, means, nearest);
+}
+#endif
+
+typedef void (*nearest_means_t)(point_block const&, int const*, int*);
+
+static nearest_means_t select_nearest_means()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        return nearest_means_avx2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return nearest_means_sse41;
+#endif
+    return nearest_means_generic;
+}
 
 #ifdef MUST_USE_HASH
-class KmeansMR : public MapReduce<KmeansMR, point, intptr_t, point, hash_container<intptr_t, point, point_combiner, std::tr1::hash<intptr_t>
+class KmeansMR : public MapReduce<KmeansMR, point_block, intptr_t, long long, hash_container<intptr_t, long long, sum_combiner, std::tr1::hash<intptr_t>
 #elif defined(MUST_USE_FIXED_HASH)
-class KmeansMR : public MapReduce<KmeansMR, point, intptr_t, point, fixed_hash_container<intptr_t, point, point_combiner, 256, std::tr1::hash<intptr_t>
+class KmeansMR : public MapReduce<KmeansMR, point_block, intptr_t, long long, fixed_hash_container<intptr_t, long long, sum_combiner, 256, std::tr1::hash<intptr_t>
 #else
-class KmeansMR : public MapReduce<KmeansMR, point, intptr_t, point, array_container<intptr_t, point, point_combiner, DEF_NUM_MEANS
+class KmeansMR : public MapReduce<KmeansMR, point_block, intptr_t, long long, dynamic_array_container<intptr_t, long long, sum_combiner
 #endif
 #ifdef TBB
     , tbb::scalable_allocator
 #endif
 > >
 {
-    std::vector<point> const& means;
+    std::vector<int> const& means;
+    nearest_means_t nearest_means;
 public:    
 
-    void* locate(data_type* d, uint64_t len) const
+    explicit KmeansMR(std::vector<int> const& means) : 
+        means(means), nearest_means(select_nearest_means())
     {
-        return d->d;
+#if !defined(MUST_USE_HASH) && !defined(MUST_USE_FIXED_HASH)
+        this->container.set_num_keys(changed_key() + 1);
+#endif
     }
 
-    void map(data_type& p, map_container& out) const
+    void* locate(data_type* b, uint64_t len) const
     {
-        unsigned int min_dist = std::numeric_limits<unsigned int>::max();
-        uint64_t min_idx = 0;
+        return b->d;
+    }
 
-        for (size_t j = 0; j < means.size(); j++)
+    /** kmeans_map()
+     *  Assigns each point of a block to its nearest mean. Each point is 
+     *  added to the sums of its mean, in the accumulators of the thread,
+     *  and the points that changed mean are counted there as well.
+     */
+    void map(data_type const& b, map_container& out) const
+    {
+        int nearest[POINT_BLOCK];
+        long long changed = 0;
+
+        nearest_means(b, &means[0], nearest);
+        for (int i = 0; i < b.count; i++)
         {
-            unsigned int cur_dist = p.sq_dist(means[j]);
-            if (cur_dist < min_dist) 
+            int j = nearest[i];
+            if (b.cluster[i] != j)
             {
-                min_dist = cur_dist;
-                min_idx = j; 
+                b.cluster[i] = j;
+                changed++;
             }
-        }
 
-        if (p.cluster != (int)min_idx) 
-        {
-            p.cluster = (int)min_idx;
-            modified = true;
+            for (int k = 0; k < dim; k++)
+                emit_intermediate(out, sum_key(j, k), b.d[k*POINT_BLOCK + i]);
+            emit_intermediate(out, count_key(j), 1);
         }
 
-        emit_intermediate(out, min_idx, point(p.d, 1));
+        if (changed > 0)
+            emit_intermediate(out, changed_key(), changed);
     }
-    
-    KmeansMR(std::vector<point> const& means)
-#ifdef MUST_USE_HASH 
-        : MapReduce<KmeansMR, point, intptr_t, point, hash_container<intptr_t, point, point_combiner, std::tr1::hash<intptr_t>
-#elif defined(MUST_USE_FIXED_HASH)
-        : MapReduce<KmeansMR, point, intptr_t, point, fixed_hash_container<intptr_t, point, point_combiner, 256, std::tr1::hash<intptr_t>
-#else
-        : MapReduce<KmeansMR, point, intptr_t, point, array_container<intptr_t, point, point_combiner, DEF_NUM_MEANS
-#endif
-#ifdef TBB
-    , tbb::scalable_allocator
-#endif
-    > >(), means(means)
-    {}
 };
 
+void dump_means(std::vector<int> const& means)
+{
+    for (int j = 0; j < num_means; j++)
+    {
+        for (int k = 0; k < dim; k++)
+            printf("%5d ", means[k*num_means_padded + j]);
+        printf("\n");
+    }
+}
+
 int main(int argc, char **argv)
 {
-    std::vector<point> means;
-    
     struct timespec begin, end, ibegin, iend;
     double library_time = 0;
     double inter_library_time = 0;
@@ -219,45 +281,64 @@ int main(int argc, char **argv)
     get_time (begin);
     
     parse_args(argc, argv);    
-    
+    num_means_padded = (num_means + MEAN_LANES - 1) / MEAN_LANES * MEAN_LANES;
+
     // get points
-    int* pointdata = (int *)malloc(sizeof(int) * num_points * dim);
-    point* points = new point[num_points];
-    for(int i = 0; i < num_points; i++) {
-        points[i] = point(&pointdata[i*dim], -1);
-        points[i].generate();
+    int num_blocks = (num_points + POINT_BLOCK - 1) / POINT_BLOCK;
+    int* pointdata = (int *)malloc(sizeof(int) * num_blocks * POINT_BLOCK * dim);
+    int* clusters = (int *)malloc(sizeof(int) * num_points);
+    point_block* blocks = new point_block[num_blocks];
+    for (int b = 0; b < num_blocks; b++) {
+        blocks[b].d = &pointdata[b * POINT_BLOCK * dim];
+        blocks[b].cluster = &clusters[b * POINT_BLOCK];
+        blocks[b].count = std::min(POINT_BLOCK, num_points - b * POINT_BLOCK);
+    }
+    for (int i = 0; i < num_points; i++) {
+        int* d = blocks[i / POINT_BLOCK].d + i % POINT_BLOCK;
+        for (int k = 0; k < dim; k++)
+            d[k * POINT_BLOCK] = rand() % grid_size;
+        clusters[i] = -1;
     }
 
     // get means
-    for (int i=0; i<num_means; i++) {
-        means.push_back(point((int*)malloc(sizeof(int) * dim), 0));
-        means[i].generate();
-    } 
+    std::vector<int> means(dim * num_means_padded, 0);
+    for (int j = 0; j < num_means; j++) {
+        for (int k = 0; k < dim; k++)
+            means[k * num_means_padded + j] = rand() % grid_size;
+    }
     
-    modified = true;
-
     get_time (end);
     print_time("initialize", begin, end);
 
     printf("KMeans: Calling MapReduce Scheduler\n");
 
     KmeansMR* mapReduce = new KmeansMR(means);
-    while (modified == true)
+    std::vector<long long> sums(changed_key() + 1);
+    long long changed = 1;
+    while (changed > 0)
     {
         get_time (ibegin);
-        modified = false;
-        //dprintf(".");
         std::vector<KmeansMR::keyval> result;
         get_time (begin);        
-        CHECK_ERROR( mapReduce->run(points, num_points, result) < 0);
+        CHECK_ERROR( mapReduce->run(blocks, num_blocks, result) < 0);
         get_time (end);
         library_time += time_diff (end, begin);
 
+        std::fill(sums.begin(), sums.end(), 0);
         for (size_t i = 0; i < result.size(); i++)
+            sums[result[i].key] = result[i].val;
+
+        // Means without points stay where they are
+        for (int j = 0; j < num_means; j++)
         {
-            free(means[result[i].key].d);
-            means[result[i].key] = result[i].val.normalize();
+            long long count = sums[count_key(j)];
+            if (count == 0)
+                continue;
+            for (int k = 0; k < dim; k++)
+                means[k * num_means_padded + j] = 
+                    (int)(sums[sum_key(j, k)] / count);
         }
+        changed = sums[changed_key()];
         get_time (iend);
         inter_library_time += time_diff (iend, ibegin) - time_diff(end, begin);
     } 
@@ -272,11 +353,11 @@ int main(int argc, char **argv)
     printf("KMeans: MapReduce Completed\n");  
 
     printf("\n\nFinal means:\n");
-    for(int i = 0; i < num_means; i++)
-        means[i].dump();
+    dump_means(means);
 
     free(pointdata);
-    delete [] points;
+    free(clusters);
+    delete [] blocks;
     
     get_time (end);
 
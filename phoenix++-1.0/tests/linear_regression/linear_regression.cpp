@@ -28,47 +28,68 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-#include "map_reduce.h"
-
-#ifdef TBB
-#include "tbb/scalable_allocator.h"
-#endif
+#include "map_fold.h"
 
 struct POINT_T {
     char x;
     char y;
 };
 
-enum {
-    KEY_SX = 0,
-    KEY_SY,
-    KEY_SXX,
-    KEY_SYY,
-    KEY_SXY,
-    KEY_COUNT
+// The running sums of the regression.
+struct lr_sums {
+    uint64_t sx, sy, sxx, syy, sxy;
 };
 
-#ifdef MUST_USE_HASH
-class lrMR : public MapReduce<lrMR, POINT_T, unsigned char, uint64_t, hash_container< unsigned char, uint64_t, sum_combiner, std::tr1::hash<unsigned char>
-#elif defined(MUST_USE_FIXED_HASH)
-class lrMR : public MapReduce<lrMR, POINT_T, unsigned char, uint64_t, fixed_hash_container< unsigned char, uint64_t, sum_combiner, 32768, std::tr1::hash<unsigned char>
-#else
-class lrMR : public MapReduce<lrMR, POINT_T, unsigned char, uint64_t, array_container< unsigned char, uint64_t, sum_combiner, KEY_COUNT
-#endif
-#ifdef TBB
-    , tbb::scalable_allocator
-#endif
-> >
+class lrMF : public MapFold<lrMF, POINT_T, lr_sums>
 {
 public:
-    void map(data_type const& p, map_container& out) const
+    void map(data_type const& p, accumulator_type& acc) const
     {
         uint64_t px = p.x, py = p.y;        // cast first so multiply happens in 64-bits
-        emit_intermediate(out, KEY_SXX, px*px);
-        emit_intermediate(out, KEY_SYY, py*py);
-        emit_intermediate(out, KEY_SXY, px*py);
-        emit_intermediate(out, KEY_SX,  px);
-        emit_intermediate(out, KEY_SY,  py);
+        acc.sxx += px*px;
+        acc.syy += py*py;
+        acc.sxy += px*py;
+        acc.sx  += px;
+        acc.sy  += py;
+    }
+
+    /** lr_map_range()
+     *  Folds the points of a task in blocks that are summed in ints, which
+     *  cannot overflow for so few points and lets the compiler vectorize.
+     */
+    void map_range(data_type const* p, uint64_t len, accumulator_type& acc) const
+    {
+        // 255*255*BLOCK < 2^31, whether char is signed or not
+        static const uint64_t BLOCK = 32768;
+        for (uint64_t b = 0; b < len; b += BLOCK)
+        {
+            uint64_t end = std::min(len, b + BLOCK);
+            int sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+            for (uint64_t i = b; i < end; i++)
+            {
+                int x = p[i].x, y = p[i].y;
+                sx += x;
+                sy += y;
+                sxx += x*x;
+                syy += y*y;
+                sxy += x*y;
+            }
+            // extend as map() does, for either signedness of char
+            acc.sx  += (int64_t)sx;
+            acc.sy  += (int64_t)sy;
+            acc.sxx += (int64_t)sxx;
+            acc.syy += (int64_t)syy;
+            acc.sxy += (int64_t)sxy;
+        }
+    }
+
+    void merge(accumulator_type& acc, accumulator_type const& o) const
+    {
+        acc.sx  += o.sx;
+        acc.sy  += o.sy;
+        acc.sxx += o.sxx;
+        acc.syy += o.syy;
+        acc.sxy += o.sxy;
     }
 };
 
@@ -120,15 +141,15 @@ int main(int argc, char *argv[]) {
 
     int data_size = finfo.st_size / sizeof(POINT_T);
     printf("data size: %d\n", data_size);
-    printf("Linear Regression: Calling MapReduce Scheduler\n");
+    printf("Linear Regression: Calling MapFold Scheduler\n");
 
     get_time (end);
     print_time("initialize", begin, end);
 
-    std::vector<lrMR::keyval> result;
+    lr_sums result;
     get_time (begin);
-    lrMR mapReduce;
-    CHECK_ERROR( mapReduce.run((POINT_T*)fdata, data_size, result) < 0);    
+    lrMF mapFold;
+    CHECK_ERROR( mapFold.run((POINT_T*)fdata, data_size, result) < 0);    
     get_time (end);
     print_time("library", begin, end);
 
@@ -136,34 +157,8 @@ int main(int argc, char *argv[]) {
 
     long long n;
     double a, b, xbar, ybar, r2;
-    long long SX_ll = 0, SY_ll = 0, SXX_ll = 0, SYY_ll = 0, SXY_ll = 0;
-    
-    // PULL OUT RESULTS
-    for (size_t i = 0; i < result.size(); i++)
-    {
-        switch (result[i].key)
-        {
-        case KEY_SX:
-             SX_ll = result[i].val;
-             break;
-        case KEY_SY:
-             SY_ll = result[i].val;
-             break;
-        case KEY_SXX:
-             SXX_ll = result[i].val;
-             break;
-        case KEY_SYY:
-             SYY_ll = result[i].val;
-             break;
-        case KEY_SXY:
-             SXY_ll = result[i].val;
-             break;
-        default:
-             // INVALID KEY
-             CHECK_ERROR(1);
-            break;
-        }
-    }
+    long long SX_ll = result.sx, SY_ll = result.sy, SXX_ll = result.sxx, 
+        SYY_ll = result.syy, SXY_ll = result.sxy;
 
     double SX = (double)SX_ll;
     double SY = (double)SY_ll;
@@ -29,71 +29,120 @@
 #include <fcntl.h>
 #include <assert.h>
 
+#include <vector>
+
 #include "map_reduce.h"
+#include "tiling.h"
 
 struct mm_data_t {
-    int row_num;
-    int rows;
-    int *matrix_A;
-    int *matrix_B;
-    int matrix_len;
-    int* output;
+    tile t;
 };
 
 class MatrixMulMR : public MapReduce<MatrixMulMR, mm_data_t, int, int>
 {
+public:
+    static const int MR = 4;        // rows of a register block
+    static const int NR = 8;        // columns of a register block
+
+private:
     int *matrix_A, *matrix_B;
-    int matrix_size;
-    int row;
+    uint64_t matrix_size;
     int *output;
+    tiled_split tiles;
+
+    /** kernel()
+     *  Adds the product of R rows of A (k_len long) and a packed 
+     *  k_len x NR sliver of B to the first cols columns of R rows of C.
+     *  The sums are kept in an R x NR block of locals, which the compiler 
+     *  keeps in vector registers.
+     */
+    template<int R>
+    static inline void kernel(int const* a, uint64_t lda, int const* b, 
+        uint64_t k_len, int* c, uint64_t ldc, uint64_t cols)
+    {
+        int acc[R][NR] = {};
+        for(uint64_t k = 0; k < k_len; k++, b += NR) {
+            for(int r = 0; r < R; r++) {
+                int a_rk = a[r*lda + k];
+                for(int j = 0; j < NR; j++)
+                    acc[r][j] += a_rk * b[j];
+            }
+        }
+        for(int r = 0; r < R; r++) {
+            for(uint64_t j = 0; j < cols; j++)
+                c[r*ldc + j] += acc[r][j];
+        }
+    }
 
 public:
     explicit MatrixMulMR(int* _mA, int* _mB, int size, int* out) : 
-        matrix_A(_mA), matrix_B(_mB), matrix_size(size), row(0), output(out) {}
-        
+        matrix_A(_mA), matrix_B(_mB), matrix_size(size), output(out),
+        tiles(size, size, size, sizeof(int), NR, 4 * this->num_threads) {}
+
+    tiled_split& get_tiles() { return tiles; }
+
     void* locate(mm_data_t* d, uint64_t len) const
     {
-        return d->matrix_A + d->row_num * d->matrix_len;
+        return matrix_A + d->t.row_begin * matrix_size + d->t.depth_begin;
     }
 
     /** matrixmul_map()
-     * Multiplies the allocated regions of matrix to compute partial sums 
+     *  Computes a tile of the output. For each depth block, the block of 
+     *  B is packed into NR-column slivers (the last one zero padded), so 
+     *  that the kernel reads it sequentially from the L1 for each MR rows
+     *  of A.
      */
     void map(mm_data_t const& data, map_container& out) const
     {
-        int* a_ptr = data.matrix_A + data.row_num*data.matrix_len + 0;
-        int* b_ptr = data.matrix_B + 0;
-            
-        int* output = data.output + data.row_num*data.matrix_len;
-        for(int i = 0; i < data.matrix_len ; i++) {
-            for(int j=0;j<data.matrix_len ; j++) {
-                output[j] += a_ptr[i] * b_ptr[j];
+        tile const& t = data.t;
+        uint64_t n = matrix_size;
+        uint64_t cols = t.col_end - t.col_begin;
+        uint64_t slivers = (cols + NR - 1) / NR;
+        uint64_t k_block = tiles.depth_block();
+        std::vector<int> packed(
+            std::min(k_block, t.depth_end - t.depth_begin) * slivers * NR);
+
+        for(uint64_t k0 = t.depth_begin; k0 < t.depth_end; k0 += k_block) {
+            uint64_t k_len = std::min(k_block, t.depth_end - k0);
+
+            int* p = &packed[0];
+            for(uint64_t s = 0; s < slivers; s++) {
+                uint64_t j0 = t.col_begin + s*NR;
+                uint64_t w = std::min<uint64_t>(NR, t.col_end - j0);
+                int const* b = matrix_B + k0*n + j0;
+                for(uint64_t k = 0; k < k_len; k++, b += n, p += NR) {
+                    for(uint64_t j = 0; j < NR; j++)
+                        p[j] = j < w ? b[j] : 0;
+                }
+            }
+
+            uint64_t i = t.row_begin;
+            for(; i + MR <= t.row_end; i += MR) {
+                for(uint64_t s = 0; s < slivers; s++) {
+                    kernel<MR>(matrix_A + i*n + k0, n, 
+                        &packed[s*k_len*NR], k_len, 
+                        output + i*n + t.col_begin + s*NR, n, 
+                        std::min<uint64_t>(NR, cols - s*NR));
+                }
+            }
+            for(; i < t.row_end; i++) {
+                for(uint64_t s = 0; s < slivers; s++) {
+                    kernel<1>(matrix_A + i*n + k0, n, 
+                        &packed[s*k_len*NR], k_len, 
+                        output + i*n + t.col_begin + s*NR, n, 
+                        std::min<uint64_t>(NR, cols - s*NR));
+                }
             }
-            b_ptr += data.matrix_len;
         }
     }
 
     /** matrixmul_split()
-     *  Assign a set of rows of the output matrix to each map task 
-     * (for now, default to one row per task)
+     *  Assigns a tile of the output matrix to each map task. Tiles cover 
+     *  the whole depth, so each one owns its block of the output.
      */
     int split(mm_data_t& out)
     {
-        /* End of data reached, return FALSE. */
-        if (row >= matrix_size)
-        {
-            return 0;
-        }
-
-        out.matrix_A = matrix_A;
-        out.matrix_B = matrix_B;
-        out.matrix_len = matrix_size;
-        out.output = output;
-        out.rows = 1;
-        out.row_num = row++;
-        
-        /* Return true since the out data is valid. */
-        return 1;
+        return tiles.next(out.t);
     }
 };
 
@@ -102,7 +151,7 @@ int main(int argc, char *argv[]) {
     int i,j, create_files;
     int fd_A, fd_B, file_size;
     int * fdata_A, *fdata_B;
-    int matrix_len, row_block_len;
+    int matrix_len, tile_len;
     struct stat finfo_A, finfo_B;
     char const* fname_A, *fname_B;
     int ret;
@@ -116,7 +165,7 @@ int main(int argc, char *argv[]) {
     // Make sure a filename is specified
     if (argv[1] == NULL)
     {
-        dprintf("USAGE: %s [side of matrix] [size of Row block]\n", argv[0]);
+        dprintf("USAGE: %s [side of matrix] [side of tile] [create files]\n", argv[0]);
         exit(1);
     }
 
@@ -127,10 +176,11 @@ int main(int argc, char *argv[]) {
 
     fprintf(stderr, "***** file size is %d\n", file_size);
 
+    // A tile side of 0 or 1 picks the tile shape from the cache sizes
     if(argv[2] == NULL)
-        row_block_len = 1;
+        tile_len = 1;
     else
-        CHECK_ERROR ( (row_block_len = atoi(argv[2])) < 0);
+        CHECK_ERROR ( (tile_len = atoi(argv[2])) < 0);
 
     if(argv[3] != NULL)
         create_files = 1;
@@ -138,7 +188,6 @@ int main(int argc, char *argv[]) {
         create_files = 0;
 
     printf("MatrixMult: Side of the matrix is %d\n", matrix_len);
-    printf("MatrixMult: Row Block Len is %d\n", row_block_len);
     printf("MatrixMult: Running...\n");
 
     /* If the matrix files do not exist, create them */
@@ -233,13 +282,25 @@ int main(int argc, char *argv[]) {
     get_time (end);
     print_time("initialize", begin, end);
 
+    MatrixMulMR mapReduce(fdata_A, fdata_B, matrix_len, output);
+    tiled_split& tiles = mapReduce.get_tiles();
+    if(tile_len > 1)
+        tiles.set_tile_size(tile_len, tile_len);
+    printf("MatrixMult: Tile is %lu x %lu x %lu, depth block %lu\n",
+        (unsigned long)tiles.tile_rows(), (unsigned long)tiles.tile_cols(),
+        (unsigned long)tiles.tile_depth(), (unsigned long)tiles.depth_block());
+
     get_time (begin);
+    double start = metrics_now();
     std::vector<MatrixMulMR::keyval> result;
-    MatrixMulMR mapReduce(fdata_A, fdata_B, matrix_len, output);
     mapReduce.run(result);
+    double elapsed = metrics_now() - start;
     get_time (end);
     print_time("library", begin, end);
 
+    printf("MatrixMult: %.3f GOP/s\n", elapsed > 0 ? 
+        2.0 * matrix_len * matrix_len * matrix_len / elapsed / 1e9 : 0.0);
+
     get_time (begin);
     int sum = 0;
     for(i=0;i<matrix_len*matrix_len;i++)
@@ -27,12 +27,15 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <vector>
 
 #ifdef TBB
 #include "tbb/scalable_allocator.h"
 #endif
 
 #include "map_reduce.h"
+#include "tiling.h"
 
 typedef struct {
     int row_num;
@@ -40,10 +43,7 @@ typedef struct {
 } pca_map_data_t;
 
 typedef struct {
-    int const* matrix;
-    long long const* means;
-    int row_num;
-    int col_num;
+    tile t;
 } pca_cov_data_t;
 
 #define DEF_GRID_SIZE 100  // all values in the matrix are from 0 to this value 
@@ -132,7 +132,7 @@ class MeanMR : public MapReduce<MeanMR, pca_map_data_t, int, long long, hash_con
 #elif defined(MUST_USE_FIXED_HASH)
 class MeanMR : public MapReduce<MeanMR, pca_map_data_t, int, long long, fixed_hash_container<int, long long, one_combiner, 32768, std::tr1::hash<int>
 #else
-class MeanMR : public MapReduce<MeanMR, pca_map_data_t, int, long long, common_array_container<int, long long, one_combiner, 1000
+class MeanMR : public MapReduce<MeanMR, pca_map_data_t, int, long long, dynamic_common_array_container<int, long long, one_combiner
 #endif
 #ifdef TBB
     , tbb::scalable_allocator
@@ -143,7 +143,12 @@ class MeanMR : public MapReduce<MeanMR, pca_map_data_t, int, long long, common_a
     int row;
 
 public:
-    explicit MeanMR(int* _matrix) : matrix(_matrix), row(0) {}
+    explicit MeanMR(int* _matrix) : matrix(_matrix), row(0) 
+    {
+#if !defined(MUST_USE_HASH) && !defined(MUST_USE_FIXED_HASH)
+        this->container.set_num_keys(num_rows);
+#endif
+    }
 
     void* locate(data_type* d, uint64_t len) const
     {
@@ -185,74 +190,146 @@ class CovMR : public MapReduceSort<CovMR, pca_cov_data_t, intptr_t, long long, h
 #elif defined(MUST_USE_FIXED_HASH)
 class CovMR : public MapReduceSort<CovMR, pca_cov_data_t, intptr_t, long long, fixed_hash_container<intptr_t, long long, one_combiner, 256, std::tr1::hash<intptr_t>
 #else
-class CovMR : public MapReduceSort<CovMR, pca_cov_data_t, intptr_t, long long, common_array_container<intptr_t, long long, one_combiner, 1000*1000
+class CovMR : public MapReduceSort<CovMR, pca_cov_data_t, intptr_t, long long, dynamic_common_array_container<intptr_t, long long, one_combiner
 #endif
 #ifdef TBB
     , tbb::scalable_allocator
 #endif
 > >
 {
-    int *matrix;
-    long long const* means;
-    int row;
-    int col;
+    std::vector<int> centered;  // the rows minus their means
+    uint64_t chunk;             // terms that can be summed as int
+    tiled_split tiles;
+
+    /** cov_block()
+     *  Adds the inner products of R rows at x and C rows at y (rows of ld 
+     *  values, len long) to acc, which has rows of ld_acc. Products are 
+     *  summed in P in the register block, chunk terms at a time, so that 
+     *  the compiler can vectorize the loop over k.
+     */
+    template<typename P, int R, int C>
+    static inline void cov_block(int const* x, int const* y, uint64_t ld, 
+        uint64_t len, uint64_t chunk, long long* acc, uint64_t ld_acc)
+    {
+        for(uint64_t k0 = 0; k0 < len; k0 += chunk) {
+            uint64_t k1 = std::min(k0 + chunk, len);
+            P part[R][C] = {};
+            for(uint64_t k = k0; k < k1; k++) {
+                for(int r = 0; r < R; r++)
+                    for(int c = 0; c < C; c++)
+                        part[r][c] += (P)x[r*ld + k] * y[c*ld + k];
+            }
+            for(int r = 0; r < R; r++)
+                for(int c = 0; c < C; c++)
+                    acc[r*ld_acc + c] += part[r][c];
+        }
+    }
+
+    template<typename P>
+    void cov_tile(tile const& t, uint64_t k0, uint64_t len, uint64_t chunk,
+        long long* acc) const
+    {
+        uint64_t ld = num_cols;
+        uint64_t cols = t.col_end - t.col_begin;
+        int const* m = &centered[0] + k0;
+        for(uint64_t i = t.row_begin; i < t.row_end; i += 2) {
+            int const* x = m + i*ld;
+            long long* a = acc + (i - t.row_begin)*cols;
+            // Only pairs with col >= row; at the diagonal, the 2x2 block 
+            // also computes (i+1, i), which is never emitted
+            uint64_t j = std::max(t.col_begin, i);
+            if(i + 1 < t.row_end) {
+                for(; j + 1 < t.col_end; j += 2)
+                    cov_block<P, 2, 2>(x, m + j*ld, ld, len, chunk, 
+                        a + j - t.col_begin, cols);
+                if(j < t.col_end)
+                    cov_block<P, 2, 1>(x, m + j*ld, ld, len, chunk, 
+                        a + j - t.col_begin, cols);
+            } else {
+                for(; j + 1 < t.col_end; j += 2)
+                    cov_block<P, 1, 2>(x, m + j*ld, ld, len, chunk, 
+                        a + j - t.col_begin, cols);
+                if(j < t.col_end)
+                    cov_block<P, 1, 1>(x, m + j*ld, ld, len, chunk, 
+                        a + j - t.col_begin, cols);
+            }
+        }
+    }
 
 public:
-    explicit CovMR(int* _matrix, long long const* _means) : 
-        matrix(_matrix), means(_means), row(0), col(0) {}
+    explicit CovMR(int const* matrix, long long const* means) : 
+        centered((uint64_t)num_rows * num_cols), 
+        tiles(num_rows, num_rows, num_cols, sizeof(int), 2, 
+            4 * this->num_threads)
+    {
+#if !defined(MUST_USE_HASH) && !defined(MUST_USE_FIXED_HASH)
+        this->container.set_num_keys((uint64_t)num_rows * num_rows);
+#endif
+        // Center the rows, and find how many products of centered values
+        // can be summed without overflowing an int.
+        long long max_abs = 0;
+        for(int i = 0; i < num_rows; i++) {
+            for(int j = 0; j < num_cols; j++) {
+                long long v = matrix[i*num_cols + j] - means[i];
+                assert(v >= INT_MIN && v <= INT_MAX);
+                centered[i*num_cols + j] = (int)v;
+                max_abs = std::max(max_abs, v < 0 ? -v : v);
+            }
+        }
+        chunk = max_abs > 0 ? INT_MAX / (max_abs * max_abs) : num_cols;
+    }
 
     void* locate(data_type* d, uint64_t len) const
     {
-        return (void*)const_cast<int*>(d->matrix + d->row_num * num_cols);
+        return (void*)const_cast<int*>(&centered[0] + d->t.row_begin * num_cols);
     }
 
     /** pca_cov_map()
-     *  Map task for computing the covariance matrix
-     * 
+     *  Map task for computing a tile of the covariance matrix. The rows 
+     *  of the tile are taken one depth block at a time, so that they stay
+     *  in the cache while they are paired with the rows of the columns.
      */
     void map(data_type const& data, map_container& out) const
     {
-        int const* v1 = data.matrix + data.row_num*num_cols;
-        int const* v2 = data.matrix + data.col_num*num_cols;
-        long long m1 = data.means[data.row_num];
-        long long m2 = data.means[data.col_num];
-        long long sum = 0;
-        for(int i = 0; i < num_cols; i++)
-        {
-            sum += (v1[i] - m1) * (v2[i] - m2);
+        tile const& t = data.t;
+        uint64_t rows = t.row_end - t.row_begin;
+        uint64_t cols = t.col_end - t.col_begin;
+        uint64_t k_block = tiles.depth_block();
+        std::vector<long long> acc(rows * cols, 0);
+
+        for(uint64_t k0 = t.depth_begin; k0 < t.depth_end; k0 += k_block) {
+            uint64_t len = std::min(k_block, t.depth_end - k0);
+            if(chunk >= 16)
+                cov_tile<int>(t, k0, len, chunk, &acc[0]);
+            else
+                cov_tile<long long>(t, k0, len, len, &acc[0]);
+        }
+
+        for(uint64_t i = t.row_begin; i < t.row_end; i++) {
+            uint64_t j = std::max(t.col_begin, i);
+            if(j >= t.col_end)
+                continue;
+            long long* a = &acc[(i - t.row_begin)*cols + j - t.col_begin];
+            for(uint64_t c = 0; c < t.col_end - j; c++)
+                a[c] /= (num_cols-1);
+            emit_intermediate_tile(out, i*num_rows + j, num_rows, a, 
+                1, t.col_end - j);
         }
-        sum /= (num_cols-1);
-        emit_intermediate(out, data.row_num*num_cols + data.col_num, sum);
     }
 
     /** pca_cov_split()
      *  Splitter function for computing the covariance
-     *  Need to produce a task for each variable (row) pair
+     *  Produces a tile of (row, row) pairs per task. Only tiles that 
+     *  reach the upper right triangle are needed, since the covariance 
+     *  matrix is symmetric.
      */
     int split(pca_cov_data_t& out)
     {
-        /* End of data reached, return FALSE. */
-        if (row >= num_rows)
-        {
-            return 0;
+        while(tiles.next(out.t)) {
+            if(out.t.col_end > out.t.row_begin)
+                return 1;
         }
-
-        out.matrix = matrix;
-        out.means = means;
-        out.row_num = row;
-        out.col_num = col;
-
-        col++;
-        if(col >= num_rows) // yes, num_rows
-        {
-            row++;
-            // will only compute upper right triangle since 
-            // covariance matrix is symmetric
-            col = row;        
-        }
-        
-        /* Return true since the out data is valid. */
-        return 1;
+        return 0;
     }
 };
 
@@ -28,111 +28,72 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <string>
 
 #include "map_reduce.h"
+#include "matcher.h"
 
-#define DEFAULT_UNIT_SIZE 5
-#define SALT_SIZE 2
-#define MAX_REC_LEN 1024
-#define OFFSET 5
+#define DEFAULT_DISP_NUM 10
 
 typedef struct {
-  char *keys;
-  int keys_len;
-  char *encrypt_file;
+    char *data;
+    uint64_t len;
 } str_map_data_t;
 
- char const* key1 = "Helloworld";
- char const* key2 = "howareyou";
- char const* key3 = "ferrari";
- char const* key4 = "whotheman";
+// The words looked for when no patterns file is given.
+char const* default_keys[] = { "Helloworld", "howareyou", "ferrari", "whotheman" };
 
- char *key1_final;
- char *key2_final;
- char *key3_final;
- char *key4_final;
-
-/** compute_hashes()
- *  Simple Cipher to generate a hash of the word 
- */
-void compute_hashes(char const* word, unsigned int length, char* final_word)
-{
-    unsigned int i;
-    for(i=0;i<length;i++)
-        final_word[i] = word[i]+OFFSET;
-    final_word[i] = 0;
-}
-
-class MatchMR : public MapReduce<MatchMR, str_map_data_t, int, int>
+// Emits (pattern, offset in the file) for every occurrence of a pattern.
+class MatchMR : public MapReduce<MatchMR, str_map_data_t, int, uint64_t>
 {
-    char *keys_file, *encrypt_file;
-    int keys_file_len, encrypt_file_len;
-    int splitter_pos, chunk_size;    
+    char *file;
+    uint64_t file_len;
+    uint64_t splitter_pos, chunk_size;
+    multi_matcher const& matcher;
 
 public:
-    explicit MatchMR(char* keys, int keys_len, char* encrypt, int encrypt_len, int chunk_size) : keys_file(keys), encrypt_file(encrypt), keys_file_len(keys_len), encrypt_file_len(encrypt_len), splitter_pos(0), chunk_size(chunk_size) {}
+    explicit MatchMR(char* file, uint64_t file_len, uint64_t chunk_size, multi_matcher const& matcher) : file(file), file_len(file_len), splitter_pos(0), chunk_size(chunk_size), matcher(matcher) {}
 
     void *locate (data_type *data, uint64_t len) const
     {
-        return data->keys;
+        return data->data;
     }
 
-    void map(data_type& data, map_container& out) const
+    void map(data_type const& data, map_container& out) const
     {
-        char cur_word_final[MAX_REC_LEN];
-
-        int index = 0;
-        while(index < data.keys_len)
-        {
-            char* key = data.keys + index;
-            int len = 0;
-            while(index+len < data.keys_len && data.keys[index+len] != '\r' && data.keys[index+len] != '\n')
-                len++;
-
-            compute_hashes(key, len, cur_word_final);
-
-            if(!strcmp(key1_final, cur_word_final));
-                dprintf("FOUND: WORD IS %s\n", key1);
-
-            if(!strcmp(key2_final, cur_word_final));
-                dprintf("FOUND: WORD IS %s\n", key2);
-
-            if(!strcmp(key3_final, cur_word_final));
-                dprintf("FOUND: WORD IS %s\n", key3);
-
-            if(!strcmp(key4_final, cur_word_final));
-                dprintf("FOUND: WORD IS %s\n", key4);
-
-            index += len;
-            while(index < data.keys_len && (data.keys[index] == '\r' || data.keys[index] == '\n'))
-                index++;
-        }
+        uint64_t base = data.data - file;
+        matcher.scan(data.data, data.len, [&](int pattern, uint64_t pos) {
+            emit_intermediate(out, pattern, base + pos);
+        });
     }
 
     /** string_match_split()
-     *  Splitter Function to assign portions of the file to each map task
+     *  Splitter Function to assign portions of the file to each map task.
+     *  Chunks end at line breaks, so no match is cut in two.
      */
     int split(str_map_data_t& out)
     {
         /* End of data reached, return FALSE. */
-        if ((int)splitter_pos >= keys_file_len)
+        if (splitter_pos >= file_len)
         {
             return 0;
         }
 
         /* Determine the nominal end point. */
-        int end = std::min(splitter_pos + chunk_size, keys_file_len);
+        uint64_t end = std::min(splitter_pos + chunk_size, file_len);
 
-        /* Move end point to next word break */
-        while(end < keys_file_len && keys_file[end] != '\r' && keys_file[end] != '\n')
+        /* Move end point to next line break */
+        while(end < file_len && file[end] != '\r' && file[end] != '\n')
             end++;
 
         /* Set the start of the next data. */
-        out.keys = keys_file + splitter_pos;
-        out.keys_len = end - splitter_pos;
+        out.data = file + splitter_pos;
+        out.len = end - splitter_pos;
         
         // Skip line breaks...
-        while(end < keys_file_len && keys_file[end] == '\r' && keys_file[end] == '\n')
+        while(end < file_len && (file[end] == '\r' || file[end] == '\n'))
             end++;
         splitter_pos = end;
 
@@ -141,12 +102,33 @@ public:
     }
 };
 
+/** read_patterns()
+ *  Reads one literal pattern per line
+ */
+std::vector<std::string> read_patterns(char const* fname)
+{
+    std::vector<std::string> patterns;
+    std::ifstream in(fname);
+    std::string line;
+
+    CHECK_ERROR(!in);
+    while(std::getline(in, line)) {
+        if(!line.empty() && line[line.size()-1] == '\r')
+            line.erase(line.size()-1);
+        if(!line.empty())
+            patterns.push_back(line);
+    }
+    return patterns;
+}
+
 int main(int argc, char *argv[]) {
     
-    int fd_keys;
-    char *fdata_keys;
-    struct stat finfo_keys;
-    char *fname_keys;
+    int fd;
+    char *fdata;
+    struct stat finfo;
+    char *fname;
+    unsigned int disp_num;
+    std::vector<std::string> patterns;
 
     struct timespec begin, end;
 
@@ -154,46 +136,44 @@ int main(int argc, char *argv[]) {
 
     if (argv[1] == NULL)
     {
-        printf("USAGE: %s <keys filename>\n", argv[0]);
+        printf("USAGE: %s <filename> [<patterns filename>] [# of patterns to display]\n", argv[0]);
         exit(1);
     }
-    fname_keys = argv[1];
+    fname = argv[1];
 
     printf("String Match: Running...\n");
 
     // Read in the file
-    CHECK_ERROR((fd_keys = open(fname_keys,O_RDONLY)) < 0);
+    CHECK_ERROR((fd = open(fname,O_RDONLY)) < 0);
     // Get the file info (for file length)
-    CHECK_ERROR(fstat(fd_keys, &finfo_keys) < 0);
+    CHECK_ERROR(fstat(fd, &finfo) < 0);
 #ifndef NO_MMAP
 #ifdef MMAP_POPULATE
     // Memory map the file
-    CHECK_ERROR((fdata_keys = (char*)mmap(0, finfo_keys.st_size + 1, 
-        PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd_keys, 0)) == NULL);
+    CHECK_ERROR((fdata = (char*)mmap(0, finfo.st_size + 1, 
+        PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0)) == NULL);
 #else
     // Memory map the file
-    CHECK_ERROR((fdata_keys = (char*)mmap(0, finfo_keys.st_size + 1, 
-        PROT_READ, MAP_PRIVATE, fd_keys, 0)) == NULL);
+    CHECK_ERROR((fdata = (char*)mmap(0, finfo.st_size + 1, 
+        PROT_READ, MAP_PRIVATE, fd, 0)) == NULL);
 #endif
 #else
     int ret;
 
-    fdata_keys = (char *)malloc (finfo_keys.st_size);
-    CHECK_ERROR (fdata_keys == NULL);
+    fdata = (char *)malloc (finfo.st_size);
+    CHECK_ERROR (fdata == NULL);
 
-    ret = read (fd_keys, fdata_keys, finfo_keys.st_size);
-    CHECK_ERROR (ret != finfo_keys.st_size);
+    ret = read (fd, fdata, finfo.st_size);
+    CHECK_ERROR (ret != finfo.st_size);
 #endif
 
-    key1_final = (char*)malloc(strlen(key1)+1);
-    key2_final = (char*)malloc(strlen(key2)+1);
-    key3_final = (char*)malloc(strlen(key3)+1);
-    key4_final = (char*)malloc(strlen(key4)+1);
+    if (argc > 2)
+        patterns = read_patterns(argv[2]);
+    else
+        patterns.assign(default_keys, default_keys + 4);
+    CHECK_ERROR((disp_num = (argc > 3) ? atoi(argv[3]) : DEFAULT_DISP_NUM) <= 0);
 
-    compute_hashes(key1, strlen(key1), key1_final);
-    compute_hashes(key2, strlen(key2), key2_final);
-    compute_hashes(key3, strlen(key3), key3_final);
-    compute_hashes(key4, strlen(key4), key4_final);
+    multi_matcher matcher(patterns);
     
     get_time (end);
 
@@ -202,26 +182,45 @@ int main(int argc, char *argv[]) {
     printf("String Match: Calling String Match\n");
 
     get_time (begin);
-    MatchMR mr(fdata_keys, finfo_keys.st_size, NULL, 0, 64*1024);
+    double start = metrics_now();
+    MatchMR mr(fdata, finfo.st_size, 64*1024, matcher);
     std::vector<MatchMR::keyval> out;
     CHECK_ERROR (mr.run(out) < 0);
+    double elapsed = metrics_now() - start;
     get_time (end);
 
     print_time("library", begin, end);
 
     get_time (begin);
 
-    free(key1_final);
-    free(key2_final);
-    free(key3_final);
-    free(key4_final);
+    // Count the matches and find the first one of each pattern
+    std::vector<uint64_t> counts(patterns.size(), 0);
+    std::vector<uint64_t> first(patterns.size(), UINT64_MAX);
+    for (size_t i = 0; i < out.size(); i++)
+    {
+        counts[out[i].key]++;
+        first[out[i].key] = std::min(first[out[i].key], out[i].val);
+    }
+
+    printf("\nString Match: Results (%lu matches of %lu patterns in %lu bytes, %.3f GB/s):\n", 
+        (unsigned long)out.size(), (unsigned long)patterns.size(), 
+        (unsigned long)finfo.st_size, 
+        elapsed > 0 ? finfo.st_size / elapsed / 1e9 : 0.0);
+    for (size_t i = 0, shown = 0; i < patterns.size() && shown < disp_num; i++)
+    {
+        if (counts[i] == 0)
+            continue;
+        printf("%15s - %lu, first at %lu\n", patterns[i].c_str(), 
+            (unsigned long)counts[i], (unsigned long)first[i]);
+        shown++;
+    }
 
 #ifndef NO_MMAP
-    CHECK_ERROR(munmap(fdata_keys, finfo_keys.st_size + 1) < 0);
+    CHECK_ERROR(munmap(fdata, finfo.st_size + 1) < 0);
 #else
-    free (fdata_keys);
+    free (fdata);
 #endif
-    CHECK_ERROR(close(fd_keys) < 0);
+    CHECK_ERROR(close(fd) < 0);
 
     get_time (end);
 
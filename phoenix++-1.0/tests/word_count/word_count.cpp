@@ -35,6 +35,7 @@
 #endif
 
 #include "map_reduce.h"
+#include "intern.h"
 #define DEFAULT_DISP_NUM 10
 
 // a passage from the text. The input data to the Map-Reduce
@@ -71,54 +72,18 @@ struct wc_word_hash
     }
 };
 
-#ifdef MUST_USE_FIXED_HASH
-class WordsMR : public MapReduceSort<WordsMR, wc_string, wc_word, uint64_t, fixed_hash_container<wc_word, uint64_t, sum_combiner, 32768, wc_word_hash
-#else
-class WordsMR : public MapReduceSort<WordsMR, wc_string, wc_word, uint64_t, hash_container<wc_word, uint64_t, sum_combiner, wc_word_hash 
-#endif
-#ifdef TBB
-    , tbb::scalable_allocator
-#endif
-> >
+// Splits the text into chunks on word breaks.
+class wc_splitter
 {
     char* data;
     uint64_t data_size;
     uint64_t chunk_size;
     uint64_t splitter_pos;
 public:
-    explicit WordsMR(char* _data, uint64_t length, uint64_t _chunk_size) :
+    wc_splitter(char* _data, uint64_t length, uint64_t _chunk_size) :
         data(_data), data_size(length), chunk_size(_chunk_size), 
             splitter_pos(0) {}
 
-    void* locate(data_type* str, uint64_t len) const
-    {
-        return str->data;
-    }
-
-    void map(data_type const& s, map_container& out) const
-    {
-        for (uint64_t i = 0; i < s.len; i++)
-        {
-            s.data[i] = toupper(s.data[i]);
-        }
-
-        uint64_t i = 0;
-        while(i < s.len)
-        {            
-            while(i < s.len && (s.data[i] < 'A' || s.data[i] > 'Z'))
-                i++;
-            uint64_t start = i;
-            while(i < s.len && ((s.data[i] >= 'A' && s.data[i] <= 'Z') || s.data[i] == '\''))
-                i++;
-            if(i > start)
-            {
-                s.data[i] = 0;
-                wc_word word = { s.data+start };
-                emit_intermediate(out, word, 1);
-            }
-        }
-    }
-
     /** wordcount split()
      *  Memory map the file and divide file on a word border i.e. a space.
      */
@@ -148,13 +113,173 @@ public:
         /* Return true since the out data is valid. */
         return 1;
     }
+};
+
+// Upper-cases a chunk and calls f(word, length) for each word in it; the 
+// words are NUL-terminated in place.
+template<class F>
+static inline void for_each_word(wc_string const& s, F const& f)
+{
+    for (uint64_t i = 0; i < s.len; i++)
+    {
+        s.data[i] = toupper(s.data[i]);
+    }
+
+    uint64_t i = 0;
+    while(i < s.len)
+    {            
+        while(i < s.len && (s.data[i] < 'A' || s.data[i] > 'Z'))
+            i++;
+        uint64_t start = i;
+        while(i < s.len && ((s.data[i] >= 'A' && s.data[i] <= 'Z') || s.data[i] == '\''))
+            i++;
+        if(i > start)
+        {
+            s.data[i] = 0;
+            f(s.data+start, i-start);
+        }
+    }
+}
+
+#ifdef MUST_USE_FIXED_HASH
+typedef fixed_hash_container<wc_word, uint64_t, sum_combiner, 32768, wc_word_hash
+#else
+typedef spill_hash_container<wc_word, uint64_t, sum_combiner, wc_word_hash 
+#endif
+#ifdef TBB
+    , tbb::scalable_allocator
+#endif
+> wc_container;
+
+// One table of words for all threads (-s), rather than one per thread.
+typedef shared_hash_container<wc_word, uint64_t, sum_combiner, wc_word_hash
+#ifdef TBB
+    , tbb::scalable_allocator
+#endif
+> wc_shared_container;
+
+template<class Container>
+class WordsMR : public MapReduceSort<WordsMR<Container>, wc_string, wc_word, uint64_t, Container>, public wc_splitter
+{
+    typedef MapReduceSort<WordsMR<Container>, wc_string, wc_word, uint64_t, Container> base;
+public:
+    typedef typename base::data_type data_type;
+    typedef typename base::map_container map_container;
+    typedef typename base::keyval keyval;
+
+    explicit WordsMR(char* _data, uint64_t length, uint64_t _chunk_size) :
+        wc_splitter(_data, length, _chunk_size) {}
+
+    using wc_splitter::split;
+
+    void* locate(data_type* str, uint64_t len) const
+    {
+        return str->data;
+    }
+
+    void map(data_type const& s, map_container& out) const
+    {
+        for_each_word(s, [&](char* w, uint64_t len) {
+            wc_word word = { w };
+            this->emit_intermediate(out, word, 1);
+        });
+    }
 
     bool sort(keyval const& a, keyval const& b) const
     {
         return a.val < b.val || (a.val == b.val && strcmp(a.key.data, b.key.data) > 0);
     }
+
+    char const* word(keyval const& kv) const { return kv.key.data; }
 };
 
+// Word count over interned words (-i): map tasks turn each word into its 
+// id in a shared string_interner and count ids in per-thread arrays, so 
+// no string is hashed into or compared in a container.
+class WordIdsMR : public MapReduceSort<WordIdsMR, wc_string, uint32_t, uint64_t, id_array_container<uint32_t, uint64_t, sum_combiner
+#ifdef TBB
+    , tbb::scalable_allocator
+#endif
+> >, public wc_splitter
+{
+    string_interner& words;
+public:
+    explicit WordIdsMR(string_interner& _words, char* _data, uint64_t length,
+        uint64_t _chunk_size) : 
+        wc_splitter(_data, length, _chunk_size), words(_words) {}
+
+    using wc_splitter::split;
+
+    void* locate(data_type* str, uint64_t len) const
+    {
+        return str->data;
+    }
+
+    void map(data_type const& s, map_container& out) const
+    {
+        // intern a window of words at a time so their lookups overlap
+        static const int WINDOW = 64;
+        char const* w[WINDOW] = {};
+        uint32_t len[WINDOW] = {}, ids[WINDOW];
+        int n = 0;
+        auto flush = [&]() {
+            words.intern(w, len, n, ids);
+            for(int i = 0; i < n; i++)
+                emit_intermediate(out, ids[i], 1);
+            n = 0;
+        };
+        for_each_word(s, [&](char* word, uint64_t length) {
+            w[n] = word;
+            len[n] = (uint32_t)length;
+            if(++n == WINDOW)
+                flush();
+        });
+        flush();
+    }
+
+    bool sort(keyval const& a, keyval const& b) const
+    {
+        return a.val < b.val || (a.val == b.val && 
+            strcmp(words.str(a.key), words.str(b.key)) > 0);
+    }
+
+    char const* word(keyval const& kv) const { return words.str(kv.key); }
+};
+
+// Runs the job and prints the top DISP_NUM words; BEGIN is left at the 
+// end of the run.
+template<class MR>
+static void count_words(MR& mr, unsigned int disp_num, 
+    struct timespec& begin)
+{
+    struct timespec end;
+    std::vector<typename MR::keyval> result;    
+    CHECK_ERROR( mr.run(result) < 0);
+    get_time (end);
+
+#ifdef TIMING
+    print_time("library", begin, end);
+#endif
+    printf("Wordcount: MapReduce Completed\n");
+
+    get_time (begin);
+
+    unsigned int dn = std::min(disp_num, (unsigned int)result.size());
+    printf("\nWordcount: Results (TOP %d of %lu):\n", dn, result.size());
+    uint64_t total = 0;
+    for (size_t i = 0; i < dn; i++)
+    {
+        printf("%15s - %lu\n", mr.word(result[result.size()-1-i]), result[result.size()-1-i].val);
+    }
+
+    for(size_t i = 0; i < result.size(); i++)
+    {
+        total += result[i].val;
+    }
+
+    printf("Total: %lu\n", total);
+}
+
 #define NO_MMAP
 
 int main(int argc, char *argv[]) 
@@ -165,18 +290,36 @@ int main(int argc, char *argv[])
     struct stat finfo;
     char * fname, * disp_num_str;
     struct timespec begin, end;
+    bool intern = false, shared = false;
+    int c;
 
     get_time (begin);
 
+    while ((c = getopt(argc, argv, "is")) != EOF)
+    {
+        switch (c)
+        {
+            case 'i':
+                intern = true;
+                break;
+            case 's':
+                shared = true;
+                break;
+            default:
+                printf("USAGE: %s [-i | -s] <filename> [Top # of results to display]\n", argv[0]);
+                exit(1);
+        }
+    }
+
     // Make sure a filename is specified
-    if (argv[1] == NULL)
+    if (optind >= argc)
     {
-        printf("USAGE: %s <filename> [Top # of results to display]\n", argv[0]);
+        printf("USAGE: %s [-i | -s] <filename> [Top # of results to display]\n", argv[0]);
         exit(1);
     }
 
-    fname = argv[1];
-    disp_num_str = argv[2];
+    fname = argv[optind];
+    disp_num_str = optind + 1 < argc ? argv[optind + 1] : NULL;
 
     printf("Wordcount: Running...\n");
 
@@ -216,32 +359,22 @@ int main(int argc, char *argv[])
 
     printf("Wordcount: Calling MapReduce Scheduler Wordcount\n");
     get_time (begin);
-    std::vector<WordsMR::keyval> result;    
-    WordsMR mapReduce(fdata, finfo.st_size, 1024*1024);
-    CHECK_ERROR( mapReduce.run(result) < 0);
-    get_time (end);
-
-#ifdef TIMING
-    print_time("library", begin, end);
-#endif
-    printf("Wordcount: MapReduce Completed\n");
-
-    get_time (begin);
-
-    unsigned int dn = std::min(disp_num, (unsigned int)result.size());
-    printf("\nWordcount: Results (TOP %d of %lu):\n", dn, result.size());
-    uint64_t total = 0;
-    for (size_t i = 0; i < dn; i++)
+    if (intern)
     {
-        printf("%15s - %lu\n", result[result.size()-1-i].key.data, result[result.size()-1-i].val);
+        string_interner words;
+        WordIdsMR mapReduce(words, fdata, finfo.st_size, 1024*1024);
+        count_words(mapReduce, disp_num, begin);
     }
-
-    for(size_t i = 0; i < result.size(); i++)
+    else if (shared)
     {
-        total += result[i].val;
+        WordsMR<wc_shared_container> mapReduce(fdata, finfo.st_size, 1024*1024);
+        count_words(mapReduce, disp_num, begin);
+    }
+    else
+    {
+        WordsMR<wc_container> mapReduce(fdata, finfo.st_size, 1024*1024);
+        count_words(mapReduce, disp_num, begin);
     }
-
-    printf("Total: %lu\n", total);
 
 #ifndef NO_MMAP
     CHECK_ERROR(munmap(fdata, finfo.st_size + 1) < 0);
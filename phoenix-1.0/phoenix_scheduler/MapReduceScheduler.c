@@ -24,6 +24,10 @@
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */ 
 
+#ifdef _LINUX_
+#define _GNU_SOURCE
+#endif
+
 #include "MapReduceScheduler.h"
 
 #include <assert.h>
@@ -38,6 +42,12 @@
 #include <string.h>
 
 #include <strings.h>
+#include <stdint.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #ifdef _LINUX_
 #include <sched.h>
@@ -56,6 +66,12 @@
 #define DEFAULT_CACHE_SIZE (64 * 1024)
 #define DEFAULT_KEYVAL_ARR_LEN 10
 #define DEFAULT_VALS_ARR_LEN 10
+#define DEFAULT_FILES_BATCH_SIZE (64 * 1024)
+#define FILES_CRAWL_BATCH 64
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
 
 //#ifdef MAPRED_TIMING
 //#include <time.h>
@@ -104,6 +120,40 @@ typedef struct
    int curr_task;
 } thread_info_t;
 
+typedef struct
+{
+   char * name;
+   off_t size;
+} file_entry_t;
+
+struct mr_files
+{
+   int batch_size;            // # of bytes to put in a map task
+   off_t max_size;            // # of bytes after which no files are added
+   long page_size;
+
+   char ** dirs;              // stack of directories left to crawl
+   int num_dirs;
+   int dirs_alloc_len;
+   int num_crawlers;          // # of workers crawling a directory
+
+   file_entry_t * pending;    // files found but not handed out yet
+   int pending_start;
+   int pending_end;
+   int pending_alloc_len;
+   off_t pending_size;
+
+   mr_file_t ** tasks;        // files handed out, one array per map task
+   int num_tasks;
+   int tasks_alloc_len;
+
+   int num_files;             // files added so far
+   off_t total_size;
+
+   pthread_mutex_t lock;
+   pthread_cond_t cond;       // signalled when a crawl adds files or ends
+};
+
 // Global state, only one of these 
 // thus this program is not thread-safe
 struct
@@ -120,6 +170,7 @@ struct
    partition_t partition;     // partition function to use
    splitter_t splitter;       // splitter function to use
    int splitter_pos;          // Used by array_splitter() to track position
+   int isSplitterLocked;      // whether splitter is called under splitter_lock
    int isOneQueuePerTask;         // used to indicate if each map/reduce task should
                               // share an output queue with the other tasks
                               // running on the same processor or not
@@ -141,6 +192,12 @@ struct
    int permanent_merge_faults;
 
    pthread_mutex_t fault_lock; // Lock for splitter_func()
+
+#ifdef _LINUX_
+   cpu_set_t * cpu_set;       // affinity mask of the process
+   size_t cpu_set_size;       // size of cpu_set in bytes
+   int max_cpus;              // number of cpus cpu_set can hold
+#endif
 } g_state;
 
 typedef enum {      // constants for func_type in the thread_wrapper_arg_t struct
@@ -161,11 +218,43 @@ typedef struct
    keyval_arr_t * merge_input;
 }  thread_wrapper_arg_t;
 
+typedef struct
+{
+   pthread_t tid;
+   int bound_cpu;                // CPU this worker is bound to, -1 if none
+   unsigned int phase;           // last phase this worker has seen
+   thread_wrapper_arg_t arg;     // arguments for the current phase
+} pool_worker_t;
+
+// Worker threads are created once and reused by every phase of every run.
+// A phase gives the first num_active workers their arguments, wakes them 
+// up and waits until they are all done.
+static struct
+{
+   int num_workers;
+   pool_worker_t * workers;
+   int num_active;            // number of workers taking part in the phase
+   int num_done;              // number of those that are done
+   unsigned int phase;        // incremented when a phase starts
+
+   pthread_mutex_t lock;
+   pthread_cond_t start_cond; // signalled when a phase starts
+   pthread_cond_t done_cond;  // signalled when the last worker is done
+} g_pool = { 
+   0, NULL, 0, 0, 0, 
+   PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
 static inline void scheduler_init(scheduler_args_t *args);
 static inline void schedule_tasks(thread_wrapper_arg_t *);
 static inline int getNumProcs(void);
-static inline int isCpuAvailable(unsigned long, int);
-static inline void setCpuAvailable(unsigned long *, int);
+static inline void bindToCpu(int);
+static inline void pool_grow(int);
+static inline void pool_run(int);
+#ifdef _LINUX_
+static inline void getCpuSet(void);
+static inline int isCpuAvailable(cpu_set_t *, int);
+#endif
 static inline void * MALLOC(size_t);
 static inline void * CALLOC(size_t, size_t);
 static inline void * REALLOC(void *, size_t);
@@ -181,6 +270,7 @@ static int array_splitter(void *, int, map_args_t *);
 static void identity_reduce(void *, void **, int);
 static inline void merge_results(keyval_arr_t*, int);
 
+static void *pool_worker(void *);
 static void *map_worker(void *);
 static void *reduce_worker(void *);
 static void *merge_worker(void *);
@@ -256,6 +346,10 @@ int map_reduce_scheduler(scheduler_args_t * args)
       free(g_state.merge_vals);
    }
 
+#ifdef _LINUX_
+   CPU_FREE(g_state.cpu_set);
+#endif
+
    return 0;
 }
 
@@ -267,6 +361,10 @@ static void scheduler_init(scheduler_args_t *args)
    memset(&g_state, 0, sizeof(g_state));
    g_state.args = args;
 
+#ifdef _LINUX_
+   getCpuSet();
+#endif
+
    // Determine the number of processors to use   
    int num_procs = getNumProcs();
    if (args->num_procs > 0)
@@ -279,6 +377,7 @@ static void scheduler_init(scheduler_args_t *args)
 
    g_state.isOneQueuePerTask = args->use_one_queue_per_task;
    g_state.isOneQueuePerReduceTask = 1;
+   g_state.isSplitterLocked = !args->splitter_is_thread_safe;
    
    // Determine the number of threads to schedule for each task
    g_state.num_map_threads = (args->num_map_threads > 0) ? 
@@ -373,18 +472,15 @@ static void scheduler_init(scheduler_args_t *args)
 }
 
 /** schedule_tasks()
- *  thread_func - function pointer to process splitter data
- *  splitter_func - splitter function pointer
- *  splitter_init - splitter_init function pointer
- *  runs map tasks in a new thread on each the available processors.
- *  returns pointer intermediate value array 
+ *  th_arg - arguments for the threads, which run the task type in func_type
+ *  runs the tasks on the worker pool, with one worker bound to each of the 
+ *  available processors, and returns once all of them are done.
  */
 static inline void schedule_tasks(thread_wrapper_arg_t *th_arg)
 {
    assert(th_arg);
 
-   pthread_attr_t attr;   // parameter for pthread creation
-   thread_wrapper_arg_t * curr_th_arg; // arg for thread_wrapper()
+   thread_wrapper_arg_t * curr_th_arg; // arg for the worker
    
    int thread_cnt;        // counter of number threads assigned assigned
    int curr_proc;
@@ -407,19 +503,17 @@ static inline void schedule_tasks(thread_wrapper_arg_t *th_arg)
    th_arg->pos = &pos;
    th_arg->splitter_lock = &splitter_lock;
    
-   // thread must be scheduled systemwide
-   pthread_attr_init(&attr);
-   pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+   // Make sure there is a worker for each thread
+   pool_grow(num_threads);
 
 #ifdef _LINUX_
-   unsigned long cpu_set; // bit array of available processors
-   // Create a thread for each availble processor to handle the split data
-   CHECK_ERROR(sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == -1);
+   int max_procs = g_state.max_cpus;
+   // Assign a worker to each availble processor to handle the split data
    for (thread_cnt = curr_proc = 0; 
-        curr_proc < sizeof(cpu_set) && thread_cnt < num_threads; 
+        curr_proc < max_procs && thread_cnt < num_threads; 
         curr_proc++)
    {
-      if (isCpuAvailable(cpu_set, curr_proc))
+      if (isCpuAvailable(g_state.cpu_set, curr_proc))
       {
 #endif
 #ifdef _SOLARIS_
@@ -434,32 +528,13 @@ static inline void schedule_tasks(thread_wrapper_arg_t *th_arg)
               curr_thread <= threads_per_proc && thread_cnt < num_threads; 
               curr_thread++, thread_cnt++)
          {
-            // Setup data to be passed to each thread
-            curr_th_arg = (thread_wrapper_arg_t*)MALLOC(sizeof(thread_wrapper_arg_t));
+            // Setup data to be passed to each worker
+            curr_th_arg = &g_pool.workers[thread_cnt].arg;
             memcpy(curr_th_arg, th_arg, sizeof(thread_wrapper_arg_t));
             curr_th_arg->cpu_id = curr_proc;
 
             g_state.tinfo[thread_cnt].cpuid = curr_proc;
-
-            //fprintf(stderr, "Starting thread %d on cpu %d\n", thread_cnt, curr_th_arg->cpu_id);
-            switch (th_arg->func_type)
-            {
-            case MAP:
-               CHECK_ERROR(pthread_create(&g_state.tinfo[thread_cnt].tid, &attr, 
-                                                map_worker, curr_th_arg) != 0);
-               break;
-            case REDUCE:
-               CHECK_ERROR(pthread_create(&g_state.tinfo[thread_cnt].tid, &attr, 
-                                                reduce_worker, curr_th_arg) != 0);
-               break;
-            case MERGE:
-               CHECK_ERROR(pthread_create(&g_state.tinfo[thread_cnt].tid, &attr, 
-                                                merge_worker, curr_th_arg) != 0);
-               break;
-            default:
-               assert(0);
-               break;
-            }
+            g_state.tinfo[thread_cnt].tid = g_pool.workers[thread_cnt].tid;
          }
       }
       
@@ -476,28 +551,133 @@ static inline void schedule_tasks(thread_wrapper_arg_t *th_arg)
       }
    }
 
+   assert(thread_cnt == num_threads);
    
-   dprintf("Status: All %d threads have been created\n", num_threads);
+   dprintf("Status: All %d threads have been assigned\n", num_threads);
    
-   // barrier, wait for all threads to finish           
-   for (thread_cnt = 0; thread_cnt < num_threads; thread_cnt++)
-   {
-      int ret_val;
-      CHECK_ERROR(pthread_join(g_state.tinfo[thread_cnt].tid, (void **)(void *)&ret_val) != 0);
-      
-      // The thread returned and error. Restart the thread.
-      //if (ret_val != 0)
-      //{
-      //}
-   }
+   // Run the workers and wait for all of them to finish
+   pool_run(num_threads);
    
-   pthread_attr_destroy(&attr);
+   pthread_mutex_destroy(&splitter_lock);
    free(g_state.tinfo);
    dprintf("Status: All tasks have completed\n"); 
    
    return;
 }
 
+/** pool_grow()
+ *  num_threads - number of workers needed
+ *  creates workers until the pool has num_threads of them. Must not be called
+ *  while a phase is running.
+ */
+static inline void pool_grow(int num_threads)
+{
+   pthread_attr_t attr;   // parameter for pthread creation
+   int i;
+
+   if (num_threads <= g_pool.num_workers) return;
+
+   // thread must be scheduled systemwide
+   pthread_attr_init(&attr);
+   pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+   pthread_mutex_lock(&g_pool.lock);
+
+   g_pool.workers = (pool_worker_t *)REALLOC(g_pool.workers, 
+      num_threads * sizeof(pool_worker_t));
+
+   for (i = g_pool.num_workers; i < num_threads; i++)
+   {
+      memset(&g_pool.workers[i], 0, sizeof(pool_worker_t));
+      g_pool.workers[i].bound_cpu = -1;
+      g_pool.workers[i].phase = g_pool.phase;
+      CHECK_ERROR(pthread_create(&g_pool.workers[i].tid, &attr, 
+                                 pool_worker, (void *)(intptr_t)i) != 0);
+   }
+   g_pool.num_workers = num_threads;
+
+   pthread_mutex_unlock(&g_pool.lock);
+   pthread_attr_destroy(&attr);
+}
+
+/** pool_run()
+ *  num_threads - number of workers to run
+ *  starts a phase on the first num_threads workers, whose arguments are set,
+ *  and waits until they are done.
+ */
+static inline void pool_run(int num_threads)
+{
+   assert(num_threads <= g_pool.num_workers);
+
+   pthread_mutex_lock(&g_pool.lock);
+
+   g_pool.num_active = num_threads;
+   g_pool.num_done = 0;
+   g_pool.phase++;
+   pthread_cond_broadcast(&g_pool.start_cond);
+
+   while (g_pool.num_done < g_pool.num_active)
+      pthread_cond_wait(&g_pool.done_cond, &g_pool.lock);
+
+   pthread_mutex_unlock(&g_pool.lock);
+}
+
+/** pool_worker()
+ *  args - index of the worker in the pool
+ *  waits for phases to start and runs the tasks of each phase it takes part
+ *  in, binding itself to the CPU it is assigned to. Never returns.
+ */
+static void *pool_worker(void *args)
+{
+   int index = (int)(intptr_t)args;
+   pool_worker_t * worker;
+   thread_wrapper_arg_t th_arg;
+
+   pthread_mutex_lock(&g_pool.lock);
+   while (1)
+   {
+      while (g_pool.workers[index].phase == g_pool.phase)
+         pthread_cond_wait(&g_pool.start_cond, &g_pool.lock);
+
+      worker = &g_pool.workers[index];
+      worker->phase = g_pool.phase;
+      if (index >= g_pool.num_active) continue;
+
+      memcpy(&th_arg, &worker->arg, sizeof(thread_wrapper_arg_t));
+      if (worker->bound_cpu != th_arg.cpu_id)
+      {
+         worker->bound_cpu = th_arg.cpu_id;
+         pthread_mutex_unlock(&g_pool.lock);
+         bindToCpu(th_arg.cpu_id);
+      }
+      else
+         pthread_mutex_unlock(&g_pool.lock);
+
+      switch (th_arg.func_type)
+      {
+      case MAP:
+         map_worker(&th_arg);
+         break;
+      case REDUCE:
+         reduce_worker(&th_arg);
+         break;
+      case MERGE:
+         merge_worker(&th_arg);
+         break;
+      default:
+         assert(0);
+         break;
+      }
+
+      pthread_mutex_lock(&g_pool.lock);
+      if (++g_pool.num_done == g_pool.num_active)
+         pthread_cond_signal(&g_pool.done_cond);
+   }
+
+   return (void *)0;
+}
+
 /** map_worker()
 * args - pointer to thread_wrapper_arg_t
 * returns 0 on success
@@ -512,26 +692,20 @@ static void *map_worker(void *args)
    int num_assigned = 0;
    int ret; // return value of splitter func. 0 = no more data to provide
    int isOneQueuePerTask = g_state.isOneQueuePerTask;
+   int isSplitterLocked = g_state.isSplitterLocked;
 
    assert(th_arg);
-   
-#ifdef _LINUX_
-   // Bind thread to run on cpu_id
-   unsigned long cpu_set = 0;
-   setCpuAvailable(&cpu_set, th_arg->cpu_id);
-   CHECK_ERROR(sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0);
-#endif
-
-#ifdef _SOLARIS_
-   dprintf("Binding thread to processor %d\n", th_arg->cpu_id);
-   CHECK_ERROR(processor_bind(P_LWPID, P_MYID, th_arg->cpu_id, NULL)!= 0);
-#endif
 
    while (1)
    {
-      pthread_mutex_lock(th_arg->splitter_lock);
+      if (isSplitterLocked)
+         pthread_mutex_lock(th_arg->splitter_lock);
             
       ret = g_state.splitter(g_state.args->task_data, g_state.chunk_size, &thread_func_arg);
+
+      if (!isSplitterLocked)
+         pthread_mutex_lock(th_arg->splitter_lock);
+
       if (ret != 0) 
       {
          int alloc_len = g_state.intermediate_task_alloc_len;
@@ -571,8 +745,6 @@ static void *map_worker(void *args)
    dprintf("Status: Total of %d tasks were assigned to cpu_id %d\n", 
       num_assigned, th_arg->cpu_id);
 
-   free(args);
-   
    return (void *)0;
 }
 
@@ -584,34 +756,8 @@ static void *reduce_worker(void *args)
    int isOneQueuePerTask = g_state.isOneQueuePerTask;
    
    assert(th_arg);
-   
-	#ifdef _LINUX_
-	   // Bind thread to run on cpu_id
-	   unsigned long cpu_set = 0;
-	   setCpuAvailable(&cpu_set, th_arg->cpu_id);
-	   CHECK_ERROR(sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0);
-	#endif
-
-	#ifdef _SOLARIS_
-	   CHECK_ERROR(processor_bind(P_LWPID, P_MYID, th_arg->cpu_id, NULL)!= 0);
-	   /*if (processor_bind(P_LWPID, P_MYID, th_arg->cpu_id, NULL)!= 0) {
-	      switch(errno)
-         {
-            case EFAULT: dprintf("EFAULT\n");
-                           break;
-            case EINVAL: dprintf("EINVAL\n");
-                           break;
-            case EPERM:  dprintf("EPERM\n");
-                           break;
-            case ESRCH:  dprintf("ESRCH\n");
-                           break;
-            default: dprintf("Errno is %d\n",errno);
-            
-         }   
-	   }*/
-	#endif
 
-	int curr_thread, done;
+   int curr_thread, done;
    int curr_reduce_task = 0;
    int ret;
    int num_map_threads;
@@ -746,7 +892,6 @@ static void *reduce_worker(void *args)
 
    free(thread_position);
    free(vals);
-   free(args);
 
    return (void *)0;
 }
@@ -762,32 +907,6 @@ static void *merge_worker(void *args) {
 
    assert(th_arg);
    
-#ifdef _LINUX_
-   // Bind thread to run on cpu_id
-   unsigned long cpu_set = 0;
-   setCpuAvailable(&cpu_set, th_arg->cpu_id);
-   CHECK_ERROR(sched_setaffinity(0, sizeof(cpu_set), &cpu_set) != 0);
-#endif
-
-#ifdef _SOLARIS_
-   CHECK_ERROR(processor_bind(P_LWPID, P_MYID, th_arg->cpu_id, NULL)!= 0);
-   /*if (processor_bind(P_LWPID, P_MYID, th_arg->cpu_id, NULL)!= 0) {
-      switch(errno)
-      {
-         case EFAULT: dprintf("EFAULT\n");
-                        break;
-         case EINVAL: dprintf("EINVAL\n");
-                        break;
-         case EPERM:  dprintf("EPERM\n");
-                        break;
-         case ESRCH:  dprintf("ESRCH\n");
-                        break;
-         default: dprintf("Errno is %d\n",errno);
-         
-      }
-      
-   }*/
-#endif
 
    // Assumes num_merge_threads is modified before each call
    int length = th_arg->merge_len / g_state.num_merge_threads;
@@ -814,7 +933,6 @@ static void *merge_worker(void *args) {
       dprintf("Thread %d: cpu_id -> %d - Done\n", 
          curr_thread, th_arg->cpu_id);
    }
-   free(args);
 
    return (void *)0;
 }
@@ -1139,14 +1257,8 @@ static inline int getNumProcs(void)
    int num_procs = 0;
 
 #ifdef _LINUX_
-   unsigned long cpus;
-   int i;
    // Returns number of processors available to process (based on affinity mask)
-   CHECK_ERROR(sched_getaffinity(0, sizeof(cpus), &cpus) == -1);
-   for (i = 0; i < sizeof(cpus); i++)
-   {
-      num_procs += isCpuAvailable(cpus, i);
-   }
+   num_procs = CPU_COUNT_S(g_state.cpu_set_size, g_state.cpu_set);
 #endif
 
 #ifdef _SOLARIS_
@@ -1164,26 +1276,68 @@ static inline int getNumProcs(void)
    return num_procs;
 }
 
+#ifdef _LINUX_
+/** getCpuSet()
+ *  reads the affinity mask of the process into g_state. The mask is grown
+ *  until it covers all the processors the kernel knows about.
+ */
+static inline void getCpuSet(void)
+{
+   int max_cpus = CPU_SETSIZE;
+   cpu_set_t * cpu_set;
+   size_t cpu_set_size;
+
+   while (1)
+   {
+      CHECK_ERROR((cpu_set = CPU_ALLOC(max_cpus)) == NULL);
+      cpu_set_size = CPU_ALLOC_SIZE(max_cpus);
+      CPU_ZERO_S(cpu_set_size, cpu_set);
+
+      if (sched_getaffinity(0, cpu_set_size, cpu_set) == 0) break;
+
+      // The mask is too small for the kernel's, so try a larger one
+      CHECK_ERROR(errno != EINVAL);
+      CPU_FREE(cpu_set);
+      max_cpus *= 2;
+   }
+
+   g_state.cpu_set = cpu_set;
+   g_state.cpu_set_size = cpu_set_size;
+   g_state.max_cpus = max_cpus;
+}
+
 /** isCpuAvailable()
- *  cpu_set - bit array of processors available
+ *  cpu_set - processors available, of size g_state.cpu_set_size
  *  cpu - index of cpu to check in cpu_set
  *  return 1 if available, 0 if not.
  */
-static inline int isCpuAvailable(unsigned long cpu_set, int cpu)
+static inline int isCpuAvailable(cpu_set_t * cpu_set, int cpu)
 {
-   assert(cpu < sizeof(cpu_set) * 8 && cpu >= 0);
-   return ((1<<cpu) & cpu_set) != 0;
+   assert(cpu < g_state.max_cpus && cpu >= 0);
+   return CPU_ISSET_S(cpu, g_state.cpu_set_size, cpu_set) != 0;
 }
+#endif
 
-/** setCpuAvailable()
- *  cpu_set - bit array of processors available
- *  cpu - index of cpu to check in cpu_set
- *  this makes cpu index available in cpu_set.
+/** bindToCpu()
+ *  cpu - processor to run on
+ *  binds the calling thread to cpu.
  */
-static inline void setCpuAvailable(unsigned long * cpu_set, int cpu)
+static inline void bindToCpu(int cpu)
 {
-   assert(cpu < sizeof(*cpu_set) * 8 && cpu >= 0);
-   *cpu_set |= (1<<cpu);
+#ifdef _LINUX_
+   cpu_set_t * cpu_set;
+
+   CHECK_ERROR((cpu_set = CPU_ALLOC(g_state.max_cpus)) == NULL);
+   CPU_ZERO_S(g_state.cpu_set_size, cpu_set);
+   CPU_SET_S(cpu, g_state.cpu_set_size, cpu_set);
+   CHECK_ERROR(sched_setaffinity(0, g_state.cpu_set_size, cpu_set) != 0);
+   CPU_FREE(cpu_set);
+#endif
+
+#ifdef _SOLARIS_
+   dprintf("Binding thread to processor %d\n", cpu);
+   CHECK_ERROR(processor_bind(P_LWPID, P_MYID, cpu, NULL)!= 0);
+#endif
 }
 
 static inline void * MALLOC(size_t size)
@@ -1243,6 +1397,372 @@ static void identity_reduce(void *key, void **vals, int vals_len)
    }
 }
 
+/** files_add()
+ *  files - multi-file input source
+ *  dirs - directories found
+ *  entries - regular files found
+ *  adds what a crawl has found to files and wakes up any waiting workers. 
+ *  Files past the maximum size are dropped. Must be called with files->lock.
+ *  returns 1 if more files are wanted, 0 if not.
+ */
+static inline int files_add(mr_files_t *files, char **dirs, int num_dirs,
+                            file_entry_t *entries, int num_entries)
+{
+   int i;
+
+   if (files->max_size > 0 && files->total_size >= files->max_size)
+   {
+      for (i = 0; i < num_dirs; i++)
+         free(dirs[i]);
+      num_dirs = 0;
+   }
+
+   if (files->num_dirs + num_dirs > files->dirs_alloc_len)
+   {
+      files->dirs_alloc_len = 
+         max(files->dirs_alloc_len * 2, files->num_dirs + num_dirs);
+      files->dirs = (char **)REALLOC(files->dirs, 
+         files->dirs_alloc_len * sizeof(char *));
+   }
+   memcpy(&files->dirs[files->num_dirs], dirs, num_dirs * sizeof(char *));
+   files->num_dirs += num_dirs;
+
+   for (i = 0; i < num_entries; i++)
+   {
+      if (files->max_size > 0 && files->total_size >= files->max_size)
+      {
+         free(entries[i].name);
+         continue;
+      }
+
+      if (files->pending_end == files->pending_alloc_len)
+      {
+         // Move the pending files to the front, or make room for more
+         if (files->pending_start > files->pending_alloc_len / 2)
+         {
+            memmove(files->pending, &files->pending[files->pending_start], 
+               (files->pending_end - files->pending_start) * 
+               sizeof(file_entry_t));
+            files->pending_end -= files->pending_start;
+            files->pending_start = 0;
+         }
+         else
+         {
+            files->pending_alloc_len *= 2;
+            files->pending = (file_entry_t *)REALLOC(files->pending, 
+               files->pending_alloc_len * sizeof(file_entry_t));
+         }
+      }
+
+      files->pending[files->pending_end++] = entries[i];
+      files->pending_size += entries[i].size;
+      files->total_size += entries[i].size;
+      files->num_files++;
+   }
+
+   pthread_cond_broadcast(&files->cond);
+
+   return files->max_size <= 0 || files->total_size < files->max_size;
+}
+
+/** files_crawl()
+ *  files - multi-file input source
+ *  name - directory to crawl, freed when done
+ *  adds the files and subdirectories of name to files, a few at a time so 
+ *  that the other workers can start on them.
+ */
+static void files_crawl(mr_files_t *files, char *name)
+{
+   DIR *dp;
+   struct dirent *ep;
+   struct stat finfo;
+   char *path;
+   char *dirs[FILES_CRAWL_BATCH];
+   file_entry_t entries[FILES_CRAWL_BATCH];
+   int num_dirs = 0, num_entries = 0;
+   int wanted = 1;
+
+   dp = opendir(name);
+   if (dp != NULL)
+   {
+      while (wanted && (ep = readdir(dp)) != NULL) 
+      {
+         if (strcmp(ep->d_name, ".") == 0) continue;
+         if (strcmp(ep->d_name, "..") == 0) continue;
+
+         path = (char *)MALLOC(strlen(ep->d_name) + strlen(name) + 2);
+         sprintf(path, "%s/%s", name, ep->d_name);
+
+         if (stat(path, &finfo) < 0) 
+            free(path);
+         else if (S_ISDIR(finfo.st_mode))
+            dirs[num_dirs++] = path;
+         else if (S_ISREG(finfo.st_mode))
+         {
+            entries[num_entries].name = path;
+            entries[num_entries].size = finfo.st_size;
+            num_entries++;
+         }
+         else
+            free(path);
+
+         if (num_dirs == FILES_CRAWL_BATCH || num_entries == FILES_CRAWL_BATCH)
+         {
+            pthread_mutex_lock(&files->lock);
+            wanted = files_add(files, dirs, num_dirs, entries, num_entries);
+            pthread_mutex_unlock(&files->lock);
+            num_dirs = num_entries = 0;
+         }
+      }
+      closedir(dp);
+   }
+
+   pthread_mutex_lock(&files->lock);
+   if (!wanted) num_entries = 0;
+   files_add(files, dirs, num_dirs, entries, num_entries);
+   files->num_crawlers--;
+   pthread_cond_broadcast(&files->cond);
+   pthread_mutex_unlock(&files->lock);
+
+   free(name);
+}
+
+/** files_map()
+ *  files - multi-file input source
+ *  file - file to map, with name set
+ *  maps the file privately, followed by a 0 byte.
+ *  returns 1 on success, 0 if the file could not be mapped.
+ */
+static inline int files_map(mr_files_t *files, mr_file_t *file)
+{
+   struct stat finfo;
+   size_t map_len;
+   char *data;
+   int fd;
+
+   if ((fd = open(file->name, O_RDONLY)) < 0) return 0;
+   if (fstat(fd, &finfo) < 0)
+   {
+      close(fd);
+      return 0;
+   }
+
+   // Reserve zeroed pages for the file and the 0 byte after it
+   map_len = (finfo.st_size / files->page_size + 1) * files->page_size;
+   data = (char *)mmap(NULL, map_len, PROT_READ | PROT_WRITE, 
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   CHECK_ERROR(data == MAP_FAILED);
+
+   if (finfo.st_size > 0 && 
+       mmap(data, finfo.st_size, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+   {
+      munmap(data, map_len);
+      close(fd);
+      return 0;
+   }
+   close(fd);
+
+   file->data = data;
+   file->size = finfo.st_size;
+   return 1;
+}
+
+mr_files_t * mr_files_create(char ** paths, int num_paths, 
+                             int batch_size, off_t max_size)
+{
+   mr_files_t *files;
+   struct stat finfo;
+   char *path;
+   int i;
+
+   assert(paths);
+
+   files = (mr_files_t *)CALLOC(1, sizeof(mr_files_t));
+   files->batch_size = (batch_size > 0) ? batch_size : DEFAULT_FILES_BATCH_SIZE;
+   files->max_size = max_size;
+   files->page_size = sysconf(_SC_PAGESIZE);
+
+   files->dirs_alloc_len = FILES_CRAWL_BATCH;
+   files->dirs = (char **)MALLOC(files->dirs_alloc_len * sizeof(char *));
+   files->pending_alloc_len = FILES_CRAWL_BATCH;
+   files->pending = (file_entry_t *)MALLOC(
+      files->pending_alloc_len * sizeof(file_entry_t));
+
+   CHECK_ERROR(pthread_mutex_init(&files->lock, NULL) != 0);
+   CHECK_ERROR(pthread_cond_init(&files->cond, NULL) != 0);
+
+   for (i = 0; i < num_paths; i++)
+   {
+      if (stat(paths[i], &finfo) < 0) continue;
+
+      path = (char *)MALLOC(strlen(paths[i]) + 1);
+      strcpy(path, paths[i]);
+
+      if (S_ISDIR(finfo.st_mode))
+         files_add(files, &path, 1, NULL, 0);
+      else if (S_ISREG(finfo.st_mode))
+      {
+         file_entry_t entry;
+         entry.name = path;
+         entry.size = finfo.st_size;
+         files_add(files, NULL, 0, &entry, 1);
+      }
+      else
+         free(path);
+   }
+
+   return files;
+}
+
+/** mr_files_splitter()
+ *  Hands out the next pending files, about batch_size bytes of them, and
+ *  crawls a directory whenever there is not a full batch pending. 
+ *  req_units is not used.
+ */
+int mr_files_splitter(void *data_in, int req_units, map_args_t *out)
+{
+   mr_files_t *files = (mr_files_t *)data_in;
+   mr_file_t *task;
+   int num_files, i, j;
+   off_t size;
+
+   assert(files);
+   assert(out);
+
+   pthread_mutex_lock(&files->lock);
+
+   while (1)
+   {
+      int num_pending = files->pending_end - files->pending_start;
+
+      // Hand out a full batch, or what there is if there is nothing to crawl
+      if (files->pending_size >= files->batch_size || 
+          (num_pending > 0 && files->num_dirs == 0))
+      {
+         for (num_files = 0, size = 0; 
+              num_files < num_pending && size < files->batch_size; 
+              num_files++)
+         {
+            size += files->pending[files->pending_start + num_files].size;
+         }
+
+         task = (mr_file_t *)MALLOC(num_files * sizeof(mr_file_t));
+         for (i = 0; i < num_files; i++)
+            task[i].name = files->pending[files->pending_start++].name;
+         files->pending_size -= size;
+         if (files->pending_start == files->pending_end)
+            files->pending_start = files->pending_end = 0;
+
+         pthread_mutex_unlock(&files->lock);
+
+         // Map the files, dropping those that cannot be
+         for (i = j = 0; i < num_files; i++)
+         {
+            if (files_map(files, &task[i]))
+            {
+               task[j] = task[i];
+               if (j > 0) task[j - 1].next = &task[j];
+               j++;
+            }
+            else
+               free(task[i].name);
+         }
+
+         pthread_mutex_lock(&files->lock);
+
+         if (j == 0)
+         {
+            free(task);
+            continue;
+         }
+         task[j - 1].next = NULL;
+
+         if (files->num_tasks == files->tasks_alloc_len)
+         {
+            files->tasks_alloc_len = max(files->tasks_alloc_len * 2, 
+                                         FILES_CRAWL_BATCH);
+            files->tasks = (mr_file_t **)REALLOC(files->tasks, 
+               files->tasks_alloc_len * sizeof(mr_file_t *));
+         }
+         files->tasks[files->num_tasks++] = task;
+
+         pthread_mutex_unlock(&files->lock);
+
+         out->data = (void *)task;
+         out->length = j;
+         return 1;
+      }
+
+      if (files->num_dirs > 0)
+      {
+         char *dir = files->dirs[--files->num_dirs];
+         files->num_crawlers++;
+         pthread_mutex_unlock(&files->lock);
+
+         files_crawl(files, dir);
+
+         pthread_mutex_lock(&files->lock);
+         continue;
+      }
+
+      // Nothing left to crawl or hand out
+      if (files->num_crawlers == 0) break;
+
+      pthread_cond_wait(&files->cond, &files->lock);
+   }
+
+   pthread_mutex_unlock(&files->lock);
+   return 0;
+}
+
+int mr_files_count(mr_files_t * files, off_t * size)
+{
+   int num_files;
+
+   assert(files);
+
+   pthread_mutex_lock(&files->lock);
+   num_files = files->num_files;
+   if (size != NULL) *size = files->total_size;
+   pthread_mutex_unlock(&files->lock);
+
+   return num_files;
+}
+
+void mr_files_destroy(mr_files_t * files)
+{
+   mr_file_t *file;
+   int i;
+
+   assert(files);
+   assert(files->num_crawlers == 0);
+
+   for (i = 0; i < files->num_tasks; i++)
+   {
+      for (file = files->tasks[i]; file != NULL; file = file->next)
+      {
+         munmap(file->data, 
+            (file->size / files->page_size + 1) * files->page_size);
+         free(file->name);
+      }
+      free(files->tasks[i]);
+   }
+
+   for (i = 0; i < files->num_dirs; i++)
+      free(files->dirs[i]);
+   for (i = files->pending_start; i < files->pending_end; i++)
+      free(files->pending[i].name);
+
+   pthread_mutex_destroy(&files->lock);
+   pthread_cond_destroy(&files->cond);
+
+   free(files->tasks);
+   free(files->dirs);
+   free(files->pending);
+   free(files);
+}
+
 int default_partition(int reduce_tasks, void* key, int key_size)
 {
    unsigned long hash = 5381;
@@ -108,6 +108,12 @@ typedef void* (*locator_t)(map_args_t *);
  */
 typedef int (*partition_t)(int, void *, int);
 
+/* Hash function takes in a pointer to a key and the length of the key in 
+ * bytes, and returns a hash of the key. Keys that are equal under key_cmp
+ * must hash to the same value.
+ */
+typedef unsigned int (*hash_t)(void *, int);
+
 /* key_cmp(key1, key2) returns:
  *   0 if key1 == key2
  *   + if key1 > key2
@@ -141,6 +147,23 @@ typedef struct
     partition_t partition;      /* Default partition function is a 
                                  * hash function */
 
+    /* Keeps each map thread's intermediate keys in hash tables and sorts 
+     * every partition once before the reduce phase, instead of keeping 
+     * them sorted on every emit. This pays off when there are many 
+     * distinct keys per partition. */
+    bool use_hash_intermediate;
+    hash_t hash;                /* Key hash used by use_hash_intermediate.
+                                 * Default is default_hash. */
+
+    /* Stores fixed-size values inline in a contiguous buffer per key 
+     * instead of as pointers. If val_size > 0, the val passed to 
+     * emit_intermediate() points to val_size bytes that are copied in, 
+     * iter_next() returns a pointer into the buffer, and the combiner 
+     * returns a pointer to val_size bytes holding the combined value. 
+     * The pointers are valid until the reduce function returns, so a 
+     * reduce function is required. */
+    int val_size;
+
     /* Creates one emit queue for each reduce task,
     * instead of per reduce thread. This improves
     * time to emit if data is emitted in order,
@@ -190,6 +213,13 @@ int map_reduce (map_reduce_args_t * args);
  */
 void emit_intermediate(void *key, void *val, int key_size);
 
+/* Same as calling emit_intermediate() on each of the NUM pairs of keys[i] 
+ * and vals[i], with every key KEY_SIZE bytes long. The runtime partitions 
+ * the batch at once and inserts it grouped by reduce task, which is cheaper
+ * for map functions that emit many keys at a time.
+ */
+void emit_intermediate_batch(void **keys, void **vals, int key_size, int num);
+
 /* This should be called from the reduce function. It stores a key and a value 
  * in the reduce queue. This will be in the final result array.
  */
@@ -200,4 +230,9 @@ void emit(void *key, void *val);
  */
 int default_partition(int reduce_tasks, void* key, int key_size);
 
+/* This is the built in hash function for use_hash_intermediate. It hashes
+ * the key_size bytes of the key. 
+ */
+unsigned int default_hash(void* key, int key_size);
+
 #endif // MAP_REDUCE_H_
@@ -53,6 +53,7 @@ int iter_init (iterator_t *itr, int num_lists)
     itr->current_index = 0;
     itr->val = NULL;
     itr->size = 0;
+    itr->val_size = 0;
 
     return 0;
 }
@@ -77,6 +78,16 @@ void iter_rewind (iterator_t *itr)
     itr->val = itr->list_array[0]->vals;
 }
 
+/* Makes iter_next() return pointers to inline values of VAL_SIZE bytes
+   rather than the stored pointers themselves. */
+void iter_set_val_size (iterator_t *itr, int val_size)
+{
+    assert (itr);
+    assert (val_size >= 0);
+
+    itr->val_size = val_size;
+}
+
 void iter_finalize (iterator_t *itr)
 {
     assert (itr);
@@ -148,7 +159,11 @@ int iter_next (iterator_t *itr, void **addr)
         }
     }
 
-    *addr = itr->val->array[itr->current_index++];
+    if (itr->val_size > 0)
+        *addr = (char *)itr->val->array + 
+            itr->current_index++ * itr->val_size;
+    else
+        *addr = itr->val->array[itr->current_index++];
 
     return 1;
 }
@@ -38,6 +38,7 @@ struct iterator_t
     int                 current_index;
     val_t               *val;
     int                 size;
+    int                 val_size;   /* Bytes of an inline value, 0 if boxed. */
 };
 
 inline int iter_init (struct iterator_t *, int);
@@ -45,6 +46,7 @@ inline void iter_reset (struct iterator_t *);
 inline void iter_rewind (struct iterator_t *);
 inline int iter_next_list (struct iterator_t *, keyvals_t **);
 inline void iter_finalize (struct iterator_t *);
+inline void iter_set_val_size (struct iterator_t *, int);
 
 inline int iter_add (struct iterator_t *, keyvals_t *);
 
@@ -24,6 +24,10 @@
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */ 
 
+#ifdef _LINUX_
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <unistd.h>
 
@@ -32,6 +36,128 @@
 #include "processor.h"
 
 #ifdef _LINUX_
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+/* Flags of get_mempolicy(2), so that libnuma is not needed. */
+#ifndef MPOL_F_NODE
+#define MPOL_F_NODE             (1 << 0)
+#define MPOL_F_ADDR             (1 << 1)
+#endif
+
+#define LOC_MAX_NODES           1024
+#define LOC_SYSFS_NODE_DIR      "/sys/devices/system/node"
+
+/* NUMA nodes with processors are the locality groups, numbered in order
+   of node id. Nodes without processors belong to no locality group. */
+static pthread_once_t   loc_once = PTHREAD_ONCE_INIT;
+static int              loc_num_lgrps = 1;
+static int              loc_node_lgrp[LOC_MAX_NODES];
+static int              loc_lgrp_size[LOC_MAX_NODES];
+static int              loc_cpu_lgrp[CPU_SETSIZE];
+
+/* Parses a sysfs cpu list such as "0-3,8-11" and adds the processors in 
+   it to locality group LGRP. Returns the number of processors added. */
+static int loc_parse_cpulist (const char *list, int lgrp)
+{
+    int     first, last, cpu, num_cpus = 0;
+    char    *end;
+
+    while (*list >= '0' && *list <= '9')
+    {
+        first = last = (int)strtol (list, &end, 10);
+        if (*end == '-')
+            last = (int)strtol (end + 1, &end, 10);
+
+        for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            loc_cpu_lgrp[cpu] = lgrp;
+            num_cpus++;
+        }
+
+        list = (*end == ',') ? end + 1 : end;
+    }
+
+    return num_cpus;
+}
+
+/* Reads the node topology from sysfs. Without it, or on a single node, 
+   all processors form one locality group. */
+static void loc_init (void)
+{
+    DIR             *dir;
+    struct dirent   *entry;
+    FILE            *file;
+    char            path[256], list[4096];
+    char            is_node[LOC_MAX_NODES];
+    int             node, lgrp, num_cpus;
+
+    memset (is_node, 0, sizeof (is_node));
+    memset (loc_cpu_lgrp, 0, sizeof (loc_cpu_lgrp));
+    for (node = 0; node < LOC_MAX_NODES; ++node)
+        loc_node_lgrp[node] = -1;
+
+    loc_num_lgrps = 1;
+    loc_node_lgrp[0] = 0;
+    loc_lgrp_size[0] = proc_get_num_cpus ();
+
+    dir = opendir (LOC_SYSFS_NODE_DIR);
+    if (dir == NULL)
+        return;
+
+    while ((entry = readdir (dir)) != NULL)
+    {
+        if (sscanf (entry->d_name, "node%d", &node) == 1 && 
+            node >= 0 && node < LOC_MAX_NODES)
+            is_node[node] = 1;
+    }
+    closedir (dir);
+
+    lgrp = 0;
+    for (node = 0; node < LOC_MAX_NODES; ++node)
+    {
+        if (!is_node[node]) continue;
+
+        snprintf (path, sizeof (path), 
+            LOC_SYSFS_NODE_DIR "/node%d/cpulist", node);
+        file = fopen (path, "r");
+        if (file == NULL) continue;
+
+        num_cpus = 0;
+        if (fgets (list, sizeof (list), file) != NULL)
+            num_cpus = loc_parse_cpulist (list, lgrp);
+        fclose (file);
+
+        if (num_cpus == 0) continue;
+
+        loc_node_lgrp[node] = lgrp;
+        loc_lgrp_size[lgrp] = num_cpus;
+        lgrp++;
+    }
+
+    if (lgrp > 1) {
+        loc_num_lgrps = lgrp;
+    } else {
+        /* One group after all: keep every processor in it. */
+        memset (loc_cpu_lgrp, 0, sizeof (loc_cpu_lgrp));
+        for (node = 0; node < LOC_MAX_NODES; ++node)
+            loc_node_lgrp[node] = 0;
+    }
+}
+
+/* Locality group of NUMA node NODE, -1 if it has none. */
+static int loc_node_to_lgrp (int node)
+{
+    if (node < 0 || node >= LOC_MAX_NODES)
+        return -1;
+
+    return loc_node_lgrp[node];
+}
 
 #elif defined (_SOLARIS_)
 #include <sys/lgrp_user.h>
@@ -46,8 +172,11 @@
 int loc_get_lgrp_size ()
 {
 #ifdef _LINUX_
-    /* XXX smarter implementation? have all cpus local to this thread */
-    return proc_get_num_cpus ();
+    pthread_once (&loc_once, loc_init);
+    if (loc_num_lgrps == 1)
+        return proc_get_num_cpus ();
+
+    return loc_lgrp_size[loc_get_lgrp ()];
 #elif defined (_SOLARIS_)
     int ret, num_cpus;
     lgrp_id_t lgrp;
@@ -70,8 +199,8 @@ int loc_get_lgrp_size ()
 int loc_get_num_lgrps ()
 {
 #ifdef _LINUX_
-    /* XXX only one locality group, all processors */
-    return 1;
+    pthread_once (&loc_once, loc_init);
+    return loc_num_lgrps;
 #elif defined (_SOLARIS_)
     int ret;
     lgrp_cookie_t cookie;
@@ -97,7 +226,7 @@ int loc_get_num_lgrps ()
 int loc_get_lgrp ()
 {
 #ifdef _LINUX_
-    return 0;
+    return loc_cpu_to_lgrp (sched_getcpu ());
 #elif defined (_SOLARIS_)
     int lgrp = lgrp_home (P_LWPID, P_MYID);
 
@@ -112,13 +241,46 @@ int loc_get_lgrp ()
 #endif
 }
 
+/* Retrieve the locality group of processor CPU. */
+int loc_cpu_to_lgrp (int cpu)
+{
+#ifdef _LINUX_
+    pthread_once (&loc_once, loc_init);
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return 0;
+
+    return loc_cpu_lgrp[cpu];
+#elif defined (_SOLARIS_)
+    /* Processors are numbered chip by chip. */
+    return cpu / loc_get_lgrp_size ();
+#endif
+}
+
 /* Retrieve the locality group of the physical memory that backs
-   the virtual address ADDR. */
+   the virtual address ADDR. On Linux, -1 is returned if the memory has 
+   not been allocated yet or its node is unknown. */
 int loc_mem_to_lgrp (void *addr)
 {
 #ifdef _LINUX_
-    /* XXX just one for now */
-    return 0;
+    void    *page;
+    int     node;
+
+    pthread_once (&loc_once, loc_init);
+    if (loc_num_lgrps == 1)
+        return 0;
+
+    /* move_pages() without target nodes only reports where the page is,
+       and unlike get_mempolicy() does not fault it in. */
+    page = (void *)((uintptr_t)addr & ~(uintptr_t)(getpagesize () - 1));
+    if (syscall (SYS_move_pages, 0, 1UL, &page, NULL, &node, 0) == 0)
+        return loc_node_to_lgrp (node);
+
+    /* move_pages() can be denied in containers. */
+    if (syscall (SYS_get_mempolicy, &node, NULL, 0UL, addr, 
+            (unsigned long)(MPOL_F_NODE | MPOL_F_ADDR)) == 0)
+        return loc_node_to_lgrp (node);
+
+    return -1;
 #elif defined (_SOLARIS_)
     uint_t info = MEMINFO_VLGRP;
     uint64_t inaddr;
@@ -30,6 +30,7 @@
 inline int loc_get_lgrp_size ();
 inline int loc_get_num_lgrps ();
 inline int loc_get_lgrp ();
+inline int loc_cpu_to_lgrp (int);
 inline int loc_mem_to_lgrp (void *);
 
 #endif /* LOCALITY_H_ */
@@ -48,7 +48,6 @@
 #include "scheduler.h"
 #include "synch.h"
 #include "taskQ.h"
-#include "queue.h"
 #include "stddefines.h"
 #include "iterator.h"
 #include "locality.h"
@@ -64,11 +63,16 @@
 
 #define DEFAULT_NUM_REDUCE_TASKS    256
 #define EXTENDED_NUM_REDUCE_TASKS   (DEFAULT_NUM_REDUCE_TASKS * 128)
+#define KEYS_PER_REDUCE_TASK        8   /* Target of the adaptive count. */
+#define MIN_REDUCE_TASKS_PER_THREAD 4
 #define DEFAULT_CACHE_SIZE          (64 * 1024)
 //#define DEFAULT_CACHE_SIZE        (8 * 1024)
 #define DEFAULT_KEYVAL_ARR_LEN      10
 #define DEFAULT_VALS_ARR_LEN        10
+#define DEFAULT_KEYVAL_INDEX_LEN    16
 #define L2_CACHE_LINE_SIZE          64
+#define MERGE_OVERSAMPLING          32  /* Samples per merge thread. */
+#define EMIT_BATCH_LEN              64  /* Keys partitioned at a time. */
 /* End tunables. */
 
 /* Debug printf */
@@ -96,6 +100,13 @@ typedef struct
     };
 } keyval_arr_t;
 
+/* Slot of the hash index over a keyvals_arr_t. */
+typedef struct
+{
+    unsigned int hash;
+    int pos;                        /* Index into arr plus one, 0 if free. */
+} keyvals_slot_t;
+
 /* Array of keyvals_t. */
 typedef struct 
 {
@@ -103,6 +114,10 @@ typedef struct
     int alloc_len;
     int pos;
     keyvals_t *arr;
+    keyvals_slot_t *index;          /* Hash index, use_hash_intermediate. */
+    int index_len;                  /* Power of two. */
+    mem_region_t region;            /* Holds arr and the value chunks; 
+                                       released by the reduce task. */
 } keyvals_arr_t;
 
 /* Thread information.
@@ -125,11 +140,6 @@ typedef struct
     uintptr_t combiner_time;
 } thread_timing_t;
 
-typedef struct {
-    task_t          task;
-    queue_elem_t    queue_elem;
-} task_queued;
-
 /* Internal map reduce state. */
 typedef struct
 {
@@ -146,6 +156,9 @@ typedef struct
 
     bool oneOutputQueuePerMapTask;      /* One output queue per map task? */
     bool oneOutputQueuePerReduceTask;   /* One output queue per reduce task? */
+    bool useHashIntermediate;       /* Hash intermediate keys, sort later? */
+    bool sampling;                  /* Map tasks are sampling key counts? */
+    int val_size;                   /* Bytes of an inline value, 0 if boxed. */
 
     int intermediate_task_alloc_len;
 
@@ -157,16 +170,19 @@ typedef struct
     splitter_t splitter;            /* Splitter function. */
     locator_t locator;              /* Locator function. */
     key_cmp_t key_cmp;              /* Key comparator function. */
+    hash_t hash;                    /* Key hash function. */
 
     /* Structures. */
     map_reduce_args_t * args;       /* Args passed in by the user. */
     thread_info_t * tinfo;          /* Thread information array. */
 
     keyvals_arr_t **intermediate_vals;
-                                    /* Array to send to reduce task. */
+                                    /* Array to send to reduce task. 
+                                       Rows are allocated on first emit. */
 
     keyval_arr_t *final_vals;       /* Array to send to merge task. */
-    keyval_arr_t *merge_vals;       /* Array to send to user. */
+    keyval_t *merge_vals;           /* Array to send to user. */
+    void **merge_splitters;         /* Key ranges of the merge threads. */
 
     uintptr_t splitter_pos;         /* Tracks position in array_splitter(). */
 
@@ -181,7 +197,8 @@ typedef struct
 #ifdef TIMING
 static pthread_key_t emit_time_key;
 #endif
-static pthread_key_t env_key;       /* Environment for current thread. */
+static __thread mr_env_t *curr_env;     /* Environment for current thread. */
+static __thread int curr_map_thread;    /* Map thread index of this thread. */
 static pthread_key_t tpool_key;
 
 /* Data passed on to each worker thread. */
@@ -192,7 +209,6 @@ typedef struct
     TASK_TYPE_T     task_type;          /* Assigned task type. */
     int             merge_len;
     keyval_arr_t    *merge_input;
-    int             merge_round;
     mr_env_t        *env;
 } thread_arg_t;
 
@@ -208,18 +224,19 @@ static inline int getNumTaskThreads (mr_env_t* env, TASK_TYPE_T);
 static inline void insert_keyval (
     mr_env_t* env, keyval_arr_t *, void *, void *);
 static inline void insert_keyval_merged (
-    mr_env_t* env, keyvals_arr_t *, void *, void *);
+    mr_env_t* env, keyvals_arr_t *, void *, void *, int);
+static void sort_intermediate (mr_env_t* env, int thread_idx);
 
 static int array_splitter (void *, int, map_args_t *);
 static void identity_reduce (void *, iterator_t *itr);
-static inline void merge_results (mr_env_t* env, keyval_arr_t*, int);
+static inline void merge_results (
+    mr_env_t* env, keyval_arr_t*, int, int, int);
 
 static void *map_worker (void *);
 static void *reduce_worker (void *);
 static void *merge_worker (void *);
 
 static int gen_map_tasks (mr_env_t* env);
-static int gen_map_tasks_split(mr_env_t* env, queue_t* q);
 static int gen_reduce_tasks (mr_env_t* env);
 
 static void map(mr_env_t* mr);
@@ -251,6 +268,8 @@ map_reduce (map_reduce_args_t * args)
     assert (args->key_cmp != NULL);
     assert (args->unit_size > 0);
     assert (args->result != NULL);
+    assert (args->val_size >= 0);
+    assert (args->val_size == 0 || args->reduce != NULL);
 
     get_time (&begin);
 
@@ -279,9 +298,7 @@ map_reduce (map_reduce_args_t * args)
 #ifdef TIMING
     CHECK_ERROR (pthread_key_create (&emit_time_key, NULL));
 #endif
-    CHECK_ERROR (pthread_key_create (&env_key, NULL));
-
-    pthread_setspecific (env_key, env);
+    curr_env = env;
 
     get_time (&end);
 
@@ -322,7 +339,7 @@ map_reduce (map_reduce_args_t * args)
     /* Cleanup. */
     get_time (&begin);
     env_fini(env);
-    CHECK_ERROR (pthread_key_delete (env_key));
+    curr_env = NULL;
     get_time (&end);
 
 #ifdef TIMING
@@ -392,6 +409,8 @@ env_init (map_reduce_args_t *args)
 
     env->oneOutputQueuePerMapTask = false;
     env->oneOutputQueuePerReduceTask = args->use_one_queue_per_task;
+    env->useHashIntermediate = args->use_hash_intermediate;
+    env->val_size = args->val_size;
 
     /* Determine the number of threads to schedule for each type of task. */
     env->num_map_threads = (args->num_map_threads > 0) ? 
@@ -403,13 +422,6 @@ env_init (map_reduce_args_t *args)
     env->num_merge_threads = (args->num_merge_threads > 0) ? 
         args->num_merge_threads : env->num_reduce_threads;
 
-    if (env->oneOutputQueuePerReduceTask == false) {
-        env->num_merge_threads = env->num_reduce_threads / 2;
-    }
-
-    /* Assign at least one merge thread. */
-    env->num_merge_threads = MAX(env->num_merge_threads, 1);
-
     env->key_match_factor = (args->key_match_factor > 0) ? 
         args->key_match_factor : 2;
 
@@ -419,33 +431,18 @@ env_init (map_reduce_args_t *args)
     env->num_map_tasks = 0;
 
     if (args->L1_cache_size > 0)
-    {
         env->chunk_size = args->L1_cache_size / args->unit_size;
-        env->num_reduce_tasks = (int)
-            ( (env->key_match_factor * args->data_size) /
-                args->L1_cache_size);
-    }
     else
-    {
         env->chunk_size = DEFAULT_CACHE_SIZE / args->unit_size;
-        env->num_reduce_tasks = (int) 
-            ( (env->key_match_factor * args->data_size) / 
-                DEFAULT_CACHE_SIZE );
-    }
 
-    if (env->num_reduce_tasks <= 0) env->num_reduce_tasks = 1;
     if (env->chunk_size <= 0) env->chunk_size = 1;
 
-    if (env->oneOutputQueuePerReduceTask == false) 
-    {
-        env->num_reduce_tasks = EXTENDED_NUM_REDUCE_TASKS;
-    } 
-    else 
-    {
-        env->num_reduce_tasks = DEFAULT_NUM_REDUCE_TASKS;
-    }
-    env->num_merge_threads = MIN (
-        env->num_merge_threads, env->num_reduce_tasks / 2);
+    /* Provisional count for the first map tasks. map() settles the real 
+       one from the keys those tasks emit. */
+    env->num_reduce_tasks = DEFAULT_NUM_REDUCE_TASKS;
+
+    /* Assign at least one merge thread. */
+    env->num_merge_threads = MAX(env->num_merge_threads, 1);
 
     if (env->oneOutputQueuePerMapTask) 
         env->intermediate_task_alloc_len = 
@@ -461,30 +458,12 @@ env_init (map_reduce_args_t *args)
     env->splitter = (args->splitter) ? args->splitter : array_splitter;
     env->locator = args->locator;
     env->key_cmp = args->key_cmp;
+    env->hash = (args->hash) ? args->hash : default_hash;
 
     /* 2. Initialize structures. */
 
-    env->intermediate_vals = (keyvals_arr_t **)mem_malloc (
-        env->intermediate_task_alloc_len * sizeof (keyvals_arr_t*));
-
-    for (i = 0; i < env->intermediate_task_alloc_len; i++)
-    {
-        env->intermediate_vals[i] = (keyvals_arr_t *)mem_calloc (
-            env->num_reduce_tasks, sizeof (keyvals_arr_t));
-    }
-
-    if (env->oneOutputQueuePerReduceTask)
-    {
-        env->final_vals = 
-            (keyval_arr_t *)mem_calloc (
-                env->num_reduce_tasks, sizeof (keyval_arr_t));
-    }
-    else
-    {
-        env->final_vals =
-            (keyval_arr_t *)mem_calloc (
-                env->num_reduce_threads, sizeof (keyval_arr_t));
-    }
+    env->intermediate_vals = (keyvals_arr_t **)mem_calloc (
+        env->intermediate_task_alloc_len, sizeof (keyvals_arr_t*));
 
     for (i = 0; i < TASK_TYPE_TOTAL; i++) {
         /* TODO: Make this tunable */
@@ -746,17 +725,22 @@ map_worker (void *args)
     /* Bind thread. */
     CHECK_ERROR (proc_bind_thread (th_arg->cpu_id) != 0);
 
-    CHECK_ERROR (pthread_setspecific (env_key, env));
+    curr_env = env;
 #ifdef TIMING
     CHECK_ERROR (pthread_setspecific (emit_time_key, 0));
 #endif
 
+    curr_map_thread = thread_index;
     mwta.lgrp = loc_get_lgrp();
 
     get_time (&work_begin);
     while (map_worker_do_next_task (env, thread_index, &mwta)) {
         user_time += mwta.run_time;
         num_assigned++;
+
+        /* A sampling round runs a single task per thread. */
+        if (env->sampling)
+            break;
     }
     get_time (&work_end);
 
@@ -768,7 +752,7 @@ map_worker (void *args)
 
     /* Apply combiner to local map results. */
 #ifndef INCREMENTAL_COMBINER
-    if (env->combiner != NULL)
+    if (env->combiner != NULL && !env->sampling)
         run_combiner (env, thread_index);
 #endif
 
@@ -778,6 +762,11 @@ map_worker (void *args)
     combiner_time = time_diff (&end, &begin);
 #endif
 
+    /* Hashed map results are sorted once here, in parallel, so the reduce
+       phase sees the same sorted arrays either way. */
+    if (env->useHashIntermediate && !env->sampling)
+        sort_intermediate (env, thread_index);
+
     dprintf("Status: Total of %d tasks were assigned to cpu_id %d\n", 
         num_assigned, th_arg->cpu_id);
 
@@ -796,16 +785,111 @@ map_worker (void *args)
 #endif
 }
 
+/* Loser tree over k sorted runs: the per-map-thread arrays of a reduce 
+   task (keyvals_arr_t) or the reduce outputs being merged (keyval_arr_t). 
+   Leaves are runs k..2k-1, node[1..k-1] hold the loser of each match and 
+   node[0] the overall winner, so finding the next smallest key takes 
+   O(log k) key comparisons. Exhausted runs compare greater than any key. */
+typedef struct {
+    mr_env_t            *env;
+    void                **run;      /* Non-empty runs. */
+    int                 *node;
+    int                 k;
+    bool                merge;      /* Runs are keyval_arr_t? */
+} loser_tree_t;
+
+static inline keyvals_arr_t *lt_run (loser_tree_t *lt, int r)
+{
+    return (keyvals_arr_t *)lt->run[r];
+}
+
+static inline keyval_arr_t *lt_merge_run (loser_tree_t *lt, int r)
+{
+    return (keyval_arr_t *)lt->run[r];
+}
+
+static inline bool lt_done (loser_tree_t *lt, int r)
+{
+    if (lt->merge)
+        return lt_merge_run (lt, r)->pos >= lt_merge_run (lt, r)->len;
+    return lt_run (lt, r)->pos >= lt_run (lt, r)->len;
+}
+
+static inline keyvals_t *lt_head (loser_tree_t *lt, int r)
+{
+    return &lt_run (lt, r)->arr[lt_run (lt, r)->pos];
+}
+
+static inline keyval_t *lt_merge_head (loser_tree_t *lt, int r)
+{
+    return &lt_merge_run (lt, r)->arr[lt_merge_run (lt, r)->pos];
+}
+
+static inline void *lt_key (loser_tree_t *lt, int r)
+{
+    return lt->merge ? lt_merge_head (lt, r)->key : lt_head (lt, r)->key;
+}
+
+/* Does run A go before run B? Ties go to the lower run for stability. */
+static inline bool lt_less (loser_tree_t *lt, int a, int b)
+{
+    int cmp;
+
+    if (lt_done (lt, a)) return false;
+    if (lt_done (lt, b)) return true;
+
+    cmp = lt->env->key_cmp (lt_key (lt, a), lt_key (lt, b));
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+static int lt_build (loser_tree_t *lt, int n)
+{
+    int l, r;
+
+    if (n >= lt->k) return n - lt->k;
+
+    l = lt_build (lt, 2 * n);
+    r = lt_build (lt, 2 * n + 1);
+    if (lt_less (lt, r, l)) {
+        lt->node[n] = l;
+        return r;
+    }
+    lt->node[n] = r;
+    return l;
+}
+
+static inline void lt_init (loser_tree_t *lt)
+{
+    lt->node[0] = (lt->k > 1) ? lt_build (lt, 1) : 0;
+}
+
+/* Replays the matches of the winner after its run advanced. */
+static inline int lt_replay (loser_tree_t *lt)
+{
+    int w = lt->node[0];
+    int n, tmp;
+
+    for (n = (w + lt->k) / 2; n > 0; n /= 2) {
+        if (lt_less (lt, lt->node[n], w)) {
+            tmp = lt->node[n];
+            lt->node[n] = w;
+            w = tmp;
+        }
+    }
+    lt->node[0] = w;
+    return w;
+}
+
 typedef struct {
     struct iterator_t   itr;
     uint64_t            run_time;
     int                 num_map_threads;
     int                 lgrp;
+    loser_tree_t        lt;
 } reduce_worker_task_args_t;
 
 /**
  * Dequeue next reduce task and do it
- * TODO Refactor this even more. It is still gross.
  * @return true if did work, false otherwise
  */
 static bool reduce_worker_do_next_task (
@@ -813,11 +897,13 @@ static bool reduce_worker_do_next_task (
 {
     struct timeval  begin, end;
     intptr_t        curr_reduce_task = 0;
-    keyvals_t       *min_key_val, *next_min;
+    keyvals_t       *min_key_val;
     task_t          reduce_task;
     int             num_map_threads;
     int             curr_thread;
     int             lgrp = args->lgrp;
+    loser_tree_t    *lt = &args->lt;
+    int             w = 0;
 
     /* Get the next reduce task. */
     if (tq_dequeue (env->taskQueue, &reduce_task, lgrp, thread_index) == 0) {
@@ -832,93 +918,54 @@ static bool reduce_worker_do_next_task (
     num_map_threads =  args->num_map_threads;
 
     args->run_time = 0;
-    min_key_val = NULL;
-    next_min = NULL;
-
-    do {
-        for (curr_thread = 0; curr_thread < num_map_threads; curr_thread++) {
-            keyvals_t       *curr_key_val;
-            keyvals_arr_t   *thread_array;
-
-            /* Find the next array to search. */
-            thread_array = 
-                &env->intermediate_vals[curr_thread][curr_reduce_task];
-
-            /* Check if the current processor array has been 
-               completely searched. */
-            if (thread_array->pos >= thread_array->len) {
-                continue;
-            }
 
-            /* Get the next key in the processor array. */
-            curr_key_val = &thread_array->arr[thread_array->pos];
+    /* Only the non-empty runs take part in the merge. */
+    lt->k = 0;
+    for (curr_thread = 0; curr_thread < num_map_threads; curr_thread++) {
+        keyvals_arr_t   *thread_array;
 
-            /* If the key matches the minimum value, 
-               add the value to the list of values for that key. */
-            if (min_key_val != NULL &&
-                !env->key_cmp(curr_key_val->key, min_key_val->key)) {
-                CHECK_ERROR (iter_add (&args->itr, curr_key_val));
-                thread_array->pos += 1;
-                --curr_thread;
-            }
-            /* Find the location of the next min. */
-            else if (next_min == NULL || 
-                env->key_cmp(curr_key_val->key, next_min->key) < 0)
-            {
-                next_min = curr_key_val;
-            }
-        }
+        if (env->intermediate_vals[curr_thread] == NULL)
+            continue;
+
+        thread_array = &env->intermediate_vals[curr_thread][curr_reduce_task];
+        if (thread_array->pos < thread_array->len)
+            lt->run[lt->k++] = thread_array;
+    }
 
-        if (min_key_val != NULL) {
-            keyvals_t       *curr_key_val;
+    if (lt->k > 0) {
+        lt_init (lt);
+        w = lt->node[0];
+    }
 
-            if (env->reduce != identity_reduce) {
-                get_time (&begin);
-                env->reduce (min_key_val->key, &args->itr);
-                get_time (&end);
+    while (lt->k > 0 && !lt_done (lt, w)) {
+        /* Each run holds a key at most once, so gather one entry per run 
+           until the winner moves on to a different key. */
+        min_key_val = lt_head (lt, w);
+        do {
+            CHECK_ERROR (iter_add (&args->itr, lt_head (lt, w)));
+            lt_run (lt, w)->pos += 1;
+            w = lt_replay (lt);
+        } while (!lt_done (lt, w) && 
+            !env->key_cmp (lt_head (lt, w)->key, min_key_val->key));
+
+        if (env->reduce != identity_reduce) {
+            get_time (&begin);
+            env->reduce (min_key_val->key, &args->itr);
+            get_time (&end);
 #ifdef TIMING
-                args->run_time += time_diff (&end, &begin);
+            args->run_time += time_diff (&end, &begin);
 #endif
-            } else {
-                env->reduce (min_key_val->key, &args->itr);
-            }
-
-            /* Free up memory */
-            iter_rewind (&args->itr);
-            while (iter_next_list (&args->itr, &curr_key_val)) {
-                val_t   *vals, *next;
-
-                vals = curr_key_val->vals;
-                while (vals != NULL) {
-                    next = vals->next_val;
-                    mem_free (vals);
-                    vals = next;
-                }
-            }
-
-            iter_reset(&args->itr);
+        } else {
+            env->reduce (min_key_val->key, &args->itr);
         }
 
-        min_key_val = next_min;
-        next_min = NULL;
-
-        /* See if there are any elements left. */
-        for(curr_thread = 0;
-            curr_thread < num_map_threads &&
-            env->intermediate_vals[curr_thread][curr_reduce_task].pos >=
-            env->intermediate_vals[curr_thread][curr_reduce_task].len;
-            curr_thread++);
-    } while (curr_thread != num_map_threads);
-
-    /* Free up the memory. */
-    for (curr_thread = 0; curr_thread < num_map_threads; curr_thread++) {
-        keyvals_arr_t   *arr;
-
-        arr = &env->intermediate_vals[curr_thread][curr_reduce_task];
-        if (arr->alloc_len != 0)
-            mem_free(arr->arr);
+        iter_reset(&args->itr);
     }
 
+    /* Release the task's keys and values in bulk. */
+    for (curr_thread = 0; curr_thread < lt->k; curr_thread++)
+        mem_region_free (&lt_run (lt, curr_thread)->region);
+
     return true;
 }
 
@@ -943,7 +990,7 @@ reduce_worker (void *args)
     /* Bind thread. */
     CHECK_ERROR (proc_bind_thread (th_arg->cpu_id) != 0);
 
-    CHECK_ERROR (pthread_setspecific (env_key, env));
+    curr_env = env;
 #ifdef TIMING
     CHECK_ERROR (pthread_setspecific (emit_time_key, 0));
 #endif
@@ -955,9 +1002,16 @@ reduce_worker (void *args)
 
     /* Assuming !oneOutputQueuePerMapTask */
     CHECK_ERROR (iter_init (&rwta.itr, env->num_map_threads));
+    iter_set_val_size (&rwta.itr, env->val_size);
     rwta.num_map_threads = num_map_threads;
     rwta.lgrp = loc_get_lgrp();
 
+    rwta.lt.env = env;
+    rwta.lt.merge = false;
+    rwta.lt.run = (void **)mem_malloc (num_map_threads * sizeof (void *));
+    rwta.lt.node = (int *)mem_malloc (num_map_threads * sizeof (int));
+    CHECK_ERROR (rwta.lt.run == NULL || rwta.lt.node == NULL);
+
     get_time (&work_begin);
 
     while (reduce_worker_do_next_task (env, thread_index, &rwta)) {
@@ -971,6 +1025,8 @@ reduce_worker (void *args)
 #endif
 
     iter_finalize (&rwta.itr);
+    mem_free (rwta.lt.run);
+    mem_free (rwta.lt.node);
 
     /* Unbind thread. */
     CHECK_ERROR (proc_unbind_thread () != 0);
@@ -999,55 +1055,31 @@ merge_worker (void *args)
     thread_arg_t    *th_arg = (thread_arg_t *)args;
     int             thread_index = th_arg->thread_id;
     mr_env_t        *env = th_arg->env;
-    int             cpu;
 #ifdef TIMING
     uintptr_t       work_time = 0;
 #endif
 
     env->tinfo[thread_index].tid = pthread_self();
 
-    /* Bind thread.
-       Spread out the merge workers as much as possible. */
-    if (env->oneOutputQueuePerReduceTask)
-        cpu = th_arg->cpu_id * (1 << (th_arg->merge_round - 1));
-    else
-        cpu = th_arg->cpu_id * (1 << th_arg->merge_round);
-
-    CHECK_ERROR (proc_bind_thread (cpu) != 0);
-
-    CHECK_ERROR (pthread_setspecific (env_key, env));
-
-    /* Assumes num_merge_threads is modified before each call. */
-    int length = th_arg->merge_len / env->num_merge_threads;
-    int modlen = th_arg->merge_len % env->num_merge_threads;
-
-    /* Let's make some progress here. */
-    if (length <= 1) {
-        length = 2;
-        modlen = th_arg->merge_len % 2;
-    }
-
-    int pos = thread_index * length + 
-                ((thread_index < modlen) ? thread_index : modlen);
-
-    if (pos < th_arg->merge_len) {
+    /* Bind thread. */
+    CHECK_ERROR (proc_bind_thread (th_arg->cpu_id) != 0);
 
-        keyval_arr_t *vals = &th_arg->merge_input[pos];
+    curr_env = env;
 
-        dprintf("Thread %d: cpu_id -> %d - Started\n", 
-                    thread_index, th_arg->cpu_id);
+    dprintf("Thread %d: cpu_id -> %d - Started\n", 
+                thread_index, th_arg->cpu_id);
 
-        get_time (&work_begin);
-        merge_results (th_arg->env, vals, length + (thread_index < modlen));
-        get_time (&work_end);
+    get_time (&work_begin);
+    merge_results (th_arg->env, th_arg->merge_input, th_arg->merge_len, 
+        thread_index, env->num_merge_threads);
+    get_time (&work_end);
 
 #ifdef TIMING
-        work_time = time_diff (&work_end, &work_begin);
+    work_time = time_diff (&work_end, &work_begin);
 #endif
 
-        dprintf("Thread %d: cpu_id -> %d - Done\n", 
-                    thread_index, th_arg->cpu_id);
-    }
+    dprintf("Thread %d: cpu_id -> %d - Done\n", 
+                thread_index, th_arg->cpu_id);
 
     /* Unbind thread. */
     CHECK_ERROR (proc_unbind_thread () != 0);
@@ -1062,239 +1094,143 @@ merge_worker (void *args)
 }
 
 /**
- * Split phase of map task generation, creates all tasks and throws in single
- * queue.
- *
- * @param q     queue to place tasks into
- * @return number of tasks generated, or 0 on error
+ * Locality groups of the NUM_THREADS threads that run TASK_TYPE tasks,
+ * from the processors start_workers() binds them to.
+ * @return array to be freed by the caller
  */
-static int gen_map_tasks_split (mr_env_t* env, queue_t* q)
+static int *get_thread_lgrps (
+    mr_env_t* env, TASK_TYPE_T task_type, int num_threads)
 {
-    int                 cur_task_id;
-    map_args_t          args;
-    task_queued         *task = NULL;
-
-    /* split until complete */
-    cur_task_id = 0;
-    while (env->splitter (env->args->task_data, env->chunk_size, &args))
-    {
-        task = (task_queued *)mem_malloc (sizeof (task_queued));
-        task->task.id = cur_task_id;
-        task->task.len = (uint64_t)args.length;
-        task->task.data = (uint64_t)args.data;
-
-        queue_push_back (q, &task->queue_elem);
-
-        ++cur_task_id;
-    }
+    int     thread_index;
+    int     *lgrps;
 
-    if (task == NULL) {
-        /* not enough memory, undo what's been done, error out */
-        queue_elem_t    *queue_elem;
+    lgrps = (int *)mem_malloc (num_threads * sizeof (int));
+    CHECK_ERROR (lgrps == NULL);
 
-        while (queue_pop_front (q, &queue_elem))
-        {
-            task = queue_entry (queue_elem, task_queued, queue_elem);
-            assert (task != NULL);
-            mem_free (task);
-        }
-
-        return 0;
-    }
+    for (thread_index = 0; thread_index < num_threads; ++thread_index)
+        lgrps[thread_index] = loc_cpu_to_lgrp (sched_thr_to_cpu (
+            env->schedPolicies[task_type], 
+            thread_index + env->args->proc_offset));
 
-    return cur_task_id;
+    return lgrps;
 }
 
 /**
- * User provided own splitter function but did not supply a locator function.
- * Nothing to do here about locality, so just try to put consecutive tasks
- * in the same task queue.
+ * Locality group hint for a map task. If the user provided own splitter
+ * function but did not supply a locator function, nothing is known about
+ * locality, so just try to put consecutive tasks in the same locality group.
  */
-static int gen_map_tasks_distribute_lgrp (
-    mr_env_t* env, int num_map_tasks, queue_t* q)
+static inline int gen_map_task_lgrp (mr_env_t* env, map_args_t *args)
 {
-    queue_elem_t    *queue_elem;
-    int             tasks_per_lgrp;
-    int             tasks_leftover;
-    int             num_lgrps;
-    int             lgrp;
-
-    num_lgrps = env->num_map_threads / loc_get_lgrp_size();
-    if (num_lgrps == 0) num_lgrps = 1;
-
-    tasks_per_lgrp = num_map_tasks / num_lgrps;
-    tasks_leftover = num_map_tasks - tasks_per_lgrp * num_lgrps;
-
-    /* distribute tasks across locality groups */
-    for (lgrp = 0; lgrp < num_lgrps; ++lgrp)
-    {
-        int remaining_cur_lgrp_tasks;
-
-        remaining_cur_lgrp_tasks = tasks_per_lgrp;
-        if (tasks_leftover > 0) {
-            remaining_cur_lgrp_tasks++;
-            tasks_leftover--;
-        }
-        do {
-            task_queued *task;
-
-            if (queue_pop_front (q, &queue_elem) == 0) {
-                /* queue is empty, everything is distributed */
-                break;
-            }
-
-            task = queue_entry (queue_elem, task_queued, queue_elem);
-            assert (task != NULL);
-
-            if (tq_enqueue_seq (env->taskQueue, &task->task, lgrp) < 0) {
-                mem_free (task);
-                return -1;
-            }
-
-            mem_free (task);
-            remaining_cur_lgrp_tasks--;
-        } while (remaining_cur_lgrp_tasks);
-
-        if (remaining_cur_lgrp_tasks != 0) {
-            break;
-        }
+    if ((env->splitter != array_splitter) && 
+        (env->locator == NULL)) {
+        return -1;
     }
 
-    return 0;
+    if (env->locator != NULL)
+        return loc_mem_to_lgrp (env->locator (args));
+
+    return loc_mem_to_lgrp (args->data);
 }
 
 /**
- * We can try to queue tasks based on locality info
+ * Split phase of map task generation, creates all tasks and queues them
+ * with their locality hints.
+ *
+ * @return number of tasks generated, or -1 on error
  */
-static int gen_map_tasks_distribute_locator (
-    mr_env_t* env, int num_map_tasks, queue_t* q)
+static int gen_map_tasks_split (mr_env_t* env)
 {
-    queue_elem_t    *queue_elem;
-
-    while (queue_pop_front (q, &queue_elem))
-    {
-        task_queued *task;
-        int         lgrp;
-        map_args_t  args;
+    int                 cur_task_id;
+    int                 lgrp;
+    map_args_t          args;
+    task_t              task;
 
-        task = queue_entry (queue_elem, task_queued, queue_elem);
-        assert (task != NULL);
+    mem_memset (&task, 0, sizeof (task_t));
 
-        args.length = task->task.len;
-        args.data = (void*)task->task.data;
+    /* split until complete */
+    cur_task_id = 0;
+    while (env->splitter (env->args->task_data, env->chunk_size, &args))
+    {
+        task.id = cur_task_id;
+        task.len = (uint64_t)args.length;
+        task.data = (uint64_t)args.data;
 
-        if (env->locator != NULL) {
-            void    *addr;
-            addr = env->locator (&args);
-            lgrp = loc_mem_to_lgrp (addr);
-        } else {
-            lgrp = loc_mem_to_lgrp (args.data);
-        }
+        lgrp = gen_map_task_lgrp (env, &args);
+        task.v[3] = lgrp;               /* For debugging. */
 
-        task->task.v[3] = lgrp;         /* For debugging. */
-        if (tq_enqueue_seq (env->taskQueue, &task->task, lgrp) != 0) {
-            mem_free (task);
+        if (tq_enqueue_seq (env->taskQueue, &task, lgrp) < 0) {
             return -1;
         }
 
-        mem_free (task);
-    }
-
-    return 0;
-}
-
-/**
- * Distributes tasks to threads
- * @param num_map_tasks number of map tasks in queue
- * @param q queue of tasks to distribute
- * @return 0 on success, less than 0 on failure
- */
-static int gen_map_tasks_distribute (
-    mr_env_t* env, int num_map_tasks, queue_t* q)
-{
-    if ((env->splitter != array_splitter) && 
-        (env->locator == NULL)) {
-        return gen_map_tasks_distribute_lgrp (env, num_map_tasks, q);
-    } else {
-        return gen_map_tasks_distribute_locator (env, num_map_tasks, q);
+        ++cur_task_id;
     }
 
-    return 0;
+    return cur_task_id;
 }
 
 /**
- * Generate all map tasks and queue them up
+ * Generate all map tasks and deal them to the map threads
  * @return number of map tasks created if successful, negative value on error
  */
 static int gen_map_tasks (mr_env_t* env)
 {
-    int             ret;
     int             num_map_tasks;
-    queue_t         temp_queue;
     int             num_map_threads;
+    int             *thread_lgrps;
 
-    queue_init (&temp_queue);
+    tq_reset (env->taskQueue);
 
-    num_map_tasks = gen_map_tasks_split (env, &temp_queue);
+    num_map_tasks = gen_map_tasks_split (env);
     if (num_map_tasks <= 0) {
         return -1;
     }
 
-    num_map_threads = env->num_map_threads;
-    if (num_map_tasks < num_map_threads)
-        num_map_threads = num_map_tasks;
-    tq_reset (env->taskQueue, num_map_threads);
-
-    ret = gen_map_tasks_distribute (env, num_map_tasks, &temp_queue);
-    if (ret == 0) ret = num_map_tasks;
+    num_map_threads = MIN (env->num_map_threads, num_map_tasks);
+    thread_lgrps = get_thread_lgrps (env, TASK_TYPE_MAP, num_map_threads);
+    tq_distribute (env->taskQueue, num_map_threads, thread_lgrps);
+    mem_free (thread_lgrps);
 
     return num_map_tasks;
 }
 
 static int gen_reduce_tasks (mr_env_t* env)
 {
-    int ret, tid;
-    int tasks_per_thread;
-    int tasks_leftover;
     uint64_t task_id;
     task_t reduce_task;
+    int *thread_lgrps;
 
-    tq_reset (env->taskQueue, env->num_reduce_threads);
+    tq_reset (env->taskQueue);
+    mem_memset (&reduce_task, 0, sizeof (task_t));
 
-    tasks_per_thread = env->num_reduce_tasks / env->num_reduce_threads;
-    tasks_leftover = env->num_reduce_tasks - 
-        tasks_per_thread * env->num_map_threads;
+    for (task_id = 0; task_id < env->num_reduce_tasks; ++task_id) {
+        /* New task. */
+        reduce_task.id = task_id;
 
-    task_id = 0;
-    for (tid = 0; tid < env->num_reduce_threads; ++tid) {
-        int remaining_cur_thread_tasks;
-
-        remaining_cur_thread_tasks = tasks_per_thread;
-        if (tasks_leftover > 0) {
-            remaining_cur_thread_tasks += 1;
-            --tasks_leftover;
+        /* TODO: Implement locality optimization. */
+        if (tq_enqueue_seq (env->taskQueue, &reduce_task, -1) < 0) {
+            return -1;
         }
-        do {
-            if (task_id == env->num_reduce_tasks) {
-                return 0;
-            }
-
-            /* New task. */
-            reduce_task.id = task_id;
-
-            /* TODO: Implement locality optimization. */
-            ret = tq_enqueue_seq (env->taskQueue, &reduce_task,  -1);
-            if (ret < 0) {
-                return -1;
-            }
-            ++task_id;
-            --remaining_cur_thread_tasks;
-        } while (remaining_cur_thread_tasks);
     }
 
+    /* Each reduce thread gets a contiguous range of tasks. */
+    thread_lgrps = get_thread_lgrps (
+        env, TASK_TYPE_REDUCE, env->num_reduce_threads);
+    tq_distribute (env->taskQueue, env->num_reduce_threads, thread_lgrps);
+    mem_free (thread_lgrps);
+
     return 0;
 }
 
+/* Bytes of a value chunk holding LEN values. */
+static inline size_t vals_chunk_size (mr_env_t* env, int len)
+{
+    if (env->val_size > 0)
+        return sizeof (val_t) + (size_t)len * env->val_size;
+
+    return sizeof (val_t) + (size_t)len * sizeof (void *);
+}
+
 #ifndef INCREMENTAL_COMBINER
 static void run_combiner (mr_env_t* env, int thread_index)
 {
@@ -1307,7 +1243,11 @@ static void run_combiner (mr_env_t* env, int thread_index)
     iterator_t itr;
     val_t *val, *next;
 
+    if (env->intermediate_vals[thread_index] == NULL)
+        return;
+
     CHECK_ERROR (iter_init (&itr, 1));
+    iter_set_val_size (&itr, env->val_size);
 
     for (i = 0; i < env->num_reduce_tasks; ++i)
     {
@@ -1321,23 +1261,28 @@ static void run_combiner (mr_env_t* env, int thread_index)
 
             reduced_val = env->combiner (&itr);
 
-            /* Shed off trailing chunks. */
             assert (reduce_pos->vals);
-            val = reduce_pos->vals->next_val;
-            while (val)
-            {
-                next = val->next_val;
-                mem_free (val);
-                val = next;
-            }
 
             /* Update the entry. */
             val = reduce_pos->vals;
-            val->next_insert_pos = 0;
-            val->next_val = NULL;
-            val->array[val->next_insert_pos++] = reduced_val;
+            if (env->val_size > 0)
+                memmove (val->array, reduced_val, env->val_size);
+            else
+                val->array[0] = reduced_val;
+            val->next_insert_pos = 1;
             reduce_pos->len = 1;
 
+            /* Shed off trailing chunks, back to the region. */
+            next = val->next_val;
+            val->next_val = NULL;
+            while (next != NULL)
+            {
+                val = next;
+                next = val->next_val;
+                mem_region_release (&my_output->region, val, 
+                    vals_chunk_size (env, val->size));
+            }
+
             iter_reset (&itr);
         }
     }
@@ -1346,6 +1291,74 @@ static void run_combiner (mr_env_t* env, int thread_index)
 }
 #endif
 
+/* Key comparator of the sort in progress; qsort() takes no context. */
+static __thread key_cmp_t sort_key_cmp;
+
+static int keyvals_cmp (const void *a, const void *b)
+{
+    return sort_key_cmp (((keyvals_t *)a)->key, ((keyvals_t *)b)->key);
+}
+
+/** sort_intermediate()
+ *  Sorts each hashed partition of a map thread by key and drops its index.
+ */
+static void sort_intermediate (mr_env_t* env, int thread_index)
+{
+    int i;
+    keyvals_arr_t *arr;
+
+    assert (! env->oneOutputQueuePerMapTask);
+
+    if (env->intermediate_vals[thread_index] == NULL)
+        return;
+
+    sort_key_cmp = env->key_cmp;
+
+    for (i = 0; i < env->num_reduce_tasks; ++i)
+    {
+        arr = &env->intermediate_vals[thread_index][i];
+
+        if (arr->len > 1)
+            qsort (arr->arr, arr->len, sizeof (keyvals_t), keyvals_cmp);
+
+        if (arr->index != NULL)
+        {
+            mem_free (arr->index);
+            arr->index = NULL;
+            arr->index_len = 0;
+        }
+    }
+}
+
+/* Returns the partitions the current map thread emits into, allocating 
+   them on its first emit. */
+static inline keyvals_arr_t *
+get_intermediate_row (mr_env_t* env)
+{
+    int curr_task;
+
+    if (env->oneOutputQueuePerMapTask)
+        curr_task = env->tinfo[curr_map_thread].curr_task;
+    else
+        curr_task = curr_map_thread;
+
+    if (env->intermediate_vals[curr_task] == NULL)
+        env->intermediate_vals[curr_task] = (keyvals_arr_t *)mem_calloc (
+            env->num_reduce_tasks, sizeof (keyvals_arr_t));
+
+    return env->intermediate_vals[curr_task];
+}
+
+#ifdef TIMING
+static inline void add_emit_time (struct timeval *end, struct timeval *begin)
+{
+    uintptr_t total_emit_time = (uintptr_t)pthread_getspecific (emit_time_key);
+    uintptr_t emit_time = time_diff (end, begin);
+    total_emit_time += emit_time;
+    CHECK_ERROR (pthread_setspecific (emit_time_key, (void *)total_emit_time));
+}
+#endif
+
 /** emit_intermediate()
  *  inserts the key, val pair into the intermediate array
  */
@@ -1353,40 +1366,76 @@ void
 emit_intermediate (void *key, void *val, int key_size)
 {
     struct timeval  begin, end;
-    static __thread int curr_thread = -1;
-    int             curr_task;
-    bool            oneOutputQueuePerMapTask;
     keyvals_arr_t   *arr;
     mr_env_t        *env;
 
     get_time (&begin);
 
     env = get_env();
-    if (curr_thread < 0)
-        curr_thread = getCurrThreadIndex (TASK_TYPE_MAP);
-
-    oneOutputQueuePerMapTask = env->oneOutputQueuePerMapTask;
-
-    if (oneOutputQueuePerMapTask)
-        curr_task = env->tinfo[curr_thread].curr_task;
-    else
-        curr_task = curr_thread;
    
     int reduce_pos = env->partition (env->num_reduce_tasks, key, key_size);
     reduce_pos %= env->num_reduce_tasks;
 
     /* Insert sorted in global queue at pos curr_proc */
-    arr = &env->intermediate_vals[curr_task][reduce_pos];
+    arr = &get_intermediate_row (env)[reduce_pos];
 
-    insert_keyval_merged (env, arr, key, val);
+    insert_keyval_merged (env, arr, key, val, key_size);
 
     get_time (&end);
 
 #ifdef TIMING
-    uintptr_t total_emit_time = (uintptr_t)pthread_getspecific (emit_time_key);
-    uintptr_t emit_time = time_diff (&end, &begin);
-    total_emit_time += emit_time;
-    CHECK_ERROR (pthread_setspecific (emit_time_key, (void *)total_emit_time));
+    add_emit_time (&end, &begin);
+#endif
+}
+
+/** emit_intermediate_batch()
+ *  inserts NUM key, val pairs, all with keys of KEY_SIZE bytes. The keys are 
+ *  partitioned EMIT_BATCH_LEN at a time and inserted grouped by partition.
+ */
+void 
+emit_intermediate_batch (void **keys, void **vals, int key_size, int num)
+{
+    struct timeval  begin, end;
+    keyvals_arr_t   *row;
+    mr_env_t        *env;
+    int             part[EMIT_BATCH_LEN];
+    int             order[EMIT_BATCH_LEN];
+    int             base, len, i, j, k;
+
+    get_time (&begin);
+
+    env = get_env();
+    row = get_intermediate_row (env);
+
+    for (base = 0; base < num; base += EMIT_BATCH_LEN)
+    {
+        len = MIN (EMIT_BATCH_LEN, num - base);
+
+        /* Partition the batch, keeping it ordered by partition. The sort is
+           stable so values of a key keep their emit order. */
+        for (i = 0; i < len; i++)
+        {
+            part[i] = env->partition (
+                env->num_reduce_tasks, keys[base + i], key_size);
+            part[i] %= env->num_reduce_tasks;
+
+            for (j = i; j > 0 && part[order[j - 1]] > part[i]; j--)
+                order[j] = order[j - 1];
+            order[j] = i;
+        }
+
+        for (i = 0; i < len; i++)
+        {
+            k = order[i];
+            insert_keyval_merged (env, &row[part[k]], 
+                keys[base + k], vals[base + k], key_size);
+        }
+    }
+
+    get_time (&end);
+
+#ifdef TIMING
+    add_emit_time (&end, &begin);
 #endif
 }
 
@@ -1429,20 +1478,42 @@ emit (void *key, void *val)
     get_time (&end);
 
 #ifdef TIMING
-    uintptr_t total_emit_time = (uintptr_t)pthread_getspecific (emit_time_key);
-    uintptr_t emit_time = time_diff (&end, &begin);
-    total_emit_time += emit_time;
-    CHECK_ERROR (pthread_setspecific (emit_time_key, (void *)total_emit_time));
+    add_emit_time (&end, &begin);
 #endif
 }
 
-static inline void 
-insert_keyval_merged (mr_env_t* env, keyvals_arr_t *arr, void *key, void *val)
+/* Makes room for one more entry at the end of ARR. The old array is 
+   handed back to the region. */
+static inline void
+grow_keyvals_arr (keyvals_arr_t *arr)
+{
+    keyvals_t *old_arr = arr->arr;
+    int old_len = arr->alloc_len;
+
+    if (arr->len < arr->alloc_len)
+        return;
+
+    arr->alloc_len = (arr->alloc_len == 0) ? 
+        DEFAULT_KEYVAL_ARR_LEN : arr->alloc_len * 2;
+    arr->arr = (keyvals_t *)mem_region_alloc (
+        &arr->region, arr->alloc_len * sizeof (keyvals_t));
+
+    if (arr->len > 0)
+        mem_memcpy (arr->arr, old_arr, arr->len * sizeof (keyvals_t));
+    if (old_arr != NULL)
+        mem_region_release (&arr->region, old_arr, 
+            old_len * sizeof (keyvals_t));
+}
+
+/** find_keyval_sorted()
+ *  Returns the entry for KEY in ARR, inserting it in key order if missing.
+ */
+static inline keyvals_t *
+find_keyval_sorted (
+    mr_env_t* env, keyvals_arr_t *arr, void *key, int key_size)
 {
     int high = arr->len, low = -1, next;
     int cmp = 1;
-    keyvals_t *insert_pos;
-    val_t *new_vals;
 
     assert(arr->len <= arr->alloc_len);
     if (arr->len > 0)
@@ -1472,40 +1543,116 @@ insert_keyval_merged (mr_env_t* env, keyvals_arr_t *arr, void *key, void *val)
 
     if (arr->len == 0 || cmp)
     {
-        /* if array is full, double and copy over. */
-        if (arr->len == arr->alloc_len)
-        {
-            if (arr->alloc_len == 0)
-            {
-                arr->alloc_len = DEFAULT_KEYVAL_ARR_LEN;
-                arr->arr = (keyvals_t *)
-                    mem_malloc (arr->alloc_len * sizeof (keyvals_t));
-            }
-            else
-            {
-                arr->alloc_len *= 2;
-                arr->arr = (keyvals_t *)
-                    mem_realloc (arr->arr, arr->alloc_len * sizeof (keyvals_t));
-            }
-        }
+        grow_keyvals_arr (arr);
 
         /* Insert into array. */
         memmove (&arr->arr[low+1], &arr->arr[low], 
                         (arr->len - low) * sizeof(keyvals_t));
 
         arr->arr[low].key = key;
+        arr->arr[low].key_size = key_size;
         arr->arr[low].len = 0;
         arr->arr[low].vals = NULL;
         arr->len++;
     }
 
-    insert_pos = &(arr->arr[low]);
+    return &(arr->arr[low]);
+}
+
+/* Scrambles a key hash into an index slot. The partition function has 
+   usually fixed the low bits of the hash for every key in ARR, so take the 
+   slot from the high half of a multiplicative hash. */
+static inline int
+keyval_slot (unsigned int hash, int index_len)
+{
+    return (int)(((hash * 0x9E3779B97F4A7C15ULL) >> 32) & (index_len - 1));
+}
+
+/* Doubles the hash index of ARR, keeping the load factor at most 1/2. */
+static void
+grow_keyvals_index (keyvals_arr_t *arr)
+{
+    keyvals_slot_t  *old_index = arr->index;
+    int             old_len = arr->index_len;
+    int             i, slot;
+
+    arr->index_len = (old_len == 0) ? DEFAULT_KEYVAL_INDEX_LEN : old_len * 2;
+    arr->index = (keyvals_slot_t *)
+        mem_calloc (arr->index_len, sizeof (keyvals_slot_t));
+
+    for (i = 0; i < old_len; i++)
+    {
+        if (old_index[i].pos == 0) continue;
+
+        slot = keyval_slot (old_index[i].hash, arr->index_len);
+        while (arr->index[slot].pos != 0)
+            slot = (slot + 1) & (arr->index_len - 1);
+        arr->index[slot] = old_index[i];
+    }
+
+    if (old_index != NULL)
+        mem_free (old_index);
+}
+
+/** find_keyval_hashed()
+ *  Returns the entry for KEY in ARR, appending it if missing. Entries are 
+ *  left unsorted until sort_intermediate().
+ */
+static inline keyvals_t *
+find_keyval_hashed (
+    mr_env_t* env, keyvals_arr_t *arr, void *key, int key_size)
+{
+    unsigned int    hash;
+    int             slot;
+
+    if ((arr->len + 1) * 2 > arr->index_len)
+        grow_keyvals_index (arr);
+
+    hash = env->hash (key, key_size);
+    slot = keyval_slot (hash, arr->index_len);
+
+    /* Linear probing. */
+    while (arr->index[slot].pos != 0)
+    {
+        keyvals_t *entry = &arr->arr[arr->index[slot].pos - 1];
+
+        if (arr->index[slot].hash == hash && !env->key_cmp(entry->key, key))
+            return entry;
+
+        slot = (slot + 1) & (arr->index_len - 1);
+    }
+
+    grow_keyvals_arr (arr);
+
+    arr->arr[arr->len].key = key;
+    arr->arr[arr->len].key_size = key_size;
+    arr->arr[arr->len].len = 0;
+    arr->arr[arr->len].vals = NULL;
+    arr->len++;
+
+    arr->index[slot].hash = hash;
+    arr->index[slot].pos = arr->len;
+
+    return &arr->arr[arr->len - 1];
+}
+
+static inline void 
+insert_keyval_merged (
+    mr_env_t* env, keyvals_arr_t *arr, void *key, void *val, int key_size)
+{
+    keyvals_t *insert_pos;
+    val_t *new_vals;
+
+    if (env->useHashIntermediate)
+        insert_pos = find_keyval_hashed (env, arr, key, key_size);
+    else
+        insert_pos = find_keyval_sorted (env, arr, key, key_size);
 
     if (insert_pos->vals == NULL)
     {
         /* Allocate a chunk for the first time. */
-        new_vals = mem_malloc 
-            (sizeof (val_t) + DEFAULT_VALS_ARR_LEN * sizeof (void *));
+        new_vals = mem_region_alloc (&arr->region, 
+            vals_chunk_size (env, DEFAULT_VALS_ARR_LEN));
         assert (new_vals);
 
         new_vals->size = DEFAULT_VALS_ARR_LEN;
@@ -1522,11 +1669,15 @@ insert_keyval_merged (mr_env_t* env, keyvals_arr_t *arr, void *key, void *val)
             void *reduced_val;
 
             CHECK_ERROR (iter_init (&itr, 1));
+            iter_set_val_size (&itr, env->val_size);
             CHECK_ERROR (iter_add (&itr, insert_pos));
 
             reduced_val = env->combiner (&itr);
 
-            insert_pos->vals->array[0] = reduced_val;
+            if (env->val_size > 0)
+                memmove (insert_pos->vals->array, reduced_val, env->val_size);
+            else
+                insert_pos->vals->array[0] = reduced_val;
             insert_pos->vals->next_insert_pos = 1;
             insert_pos->len = 1;
 
@@ -1537,12 +1688,28 @@ insert_keyval_merged (mr_env_t* env, keyvals_arr_t *arr, void *key, void *val)
             int alloc_size;
 
             alloc_size = insert_pos->vals->size * 2;
-            new_vals = mem_malloc (sizeof (val_t) + alloc_size * sizeof (void *));
+            new_vals = mem_region_alloc (&arr->region, 
+                vals_chunk_size (env, alloc_size));
             assert (new_vals);
 
             new_vals->size = alloc_size;
-            new_vals->next_insert_pos = 0;
-            new_vals->next_val = insert_pos->vals;
+
+            if (env->val_size > 0)
+            {
+                /* Keep inline values contiguous: move them over instead 
+                   of chaining, and hand the old chunk back. */
+                mem_memcpy (new_vals->array, insert_pos->vals->array, 
+                    (size_t)insert_pos->vals->next_insert_pos * env->val_size);
+                new_vals->next_insert_pos = insert_pos->vals->next_insert_pos;
+                new_vals->next_val = NULL;
+                mem_region_release (&arr->region, insert_pos->vals, 
+                    vals_chunk_size (env, insert_pos->vals->size));
+            }
+            else
+            {
+                new_vals->next_insert_pos = 0;
+                new_vals->next_val = insert_pos->vals;
+            }
 
             insert_pos->vals = new_vals;
 #ifdef INCREMENTAL_COMBINER
@@ -1550,7 +1717,12 @@ insert_keyval_merged (mr_env_t* env, keyvals_arr_t *arr, void *key, void *val)
 #endif
     }
 
-    insert_pos->vals->array[insert_pos->vals->next_insert_pos++] = val;
+    if (env->val_size > 0)
+        mem_memcpy ((char *)insert_pos->vals->array + 
+            insert_pos->vals->next_insert_pos++ * env->val_size, 
+            val, env->val_size);
+    else
+        insert_pos->vals->array[insert_pos->vals->next_insert_pos++] = val;
 
     insert_pos->len += 1;
 }
@@ -1621,63 +1793,125 @@ insert_keyval (mr_env_t* env, keyval_arr_t *arr, void *key, void *val)
     arr->len++;
 }
 
+/* Returns the index of the first entry of ARR whose key is not less than 
+   KEY. */
+static inline int
+keyval_lower_bound (mr_env_t* env, keyval_arr_t *arr, void *key)
+{
+    int low = 0, high = arr->len, mid;
+
+    while (low < high)
+    {
+        mid = low + (high - low) / 2;
+        if (env->key_cmp (arr->arr[mid].key, key) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/** merge_results()
+ *  Merges the key range of merge thread THREAD_INDEX out of LENGTH sorted 
+ *  arrays directly into its slice of env->merge_vals. The range runs from 
+ *  the thread's splitter key (inclusive) to the next thread's (exclusive), 
+ *  so the slice starts after every key less than the thread's splitter.
+ */
 static inline void 
-merge_results (mr_env_t* env, keyval_arr_t *vals, int length) 
+merge_results (mr_env_t* env, keyval_arr_t *vals, int length, 
+    int thread_index, int num_threads) 
 {
-    int data_idx;
-    int total_num_keys = 0;
-    int i;
-    static __thread int curr_thread = -1;
-    
-    if (curr_thread < 0)
-        curr_thread = getCurrThreadIndex (TASK_TYPE_MERGE);
+    keyval_arr_t    *runs;
+    loser_tree_t    lt;
+    int             i, w;
+    int             out;
+
+    runs = (keyval_arr_t *)mem_malloc (length * sizeof (keyval_arr_t));
+    lt.run = (void **)mem_malloc (length * sizeof (void *));
+    lt.node = (int *)mem_malloc (length * sizeof (int));
+    CHECK_ERROR (runs == NULL || lt.run == NULL || lt.node == NULL);
+    lt.env = env;
+    lt.merge = true;
+    lt.k = 0;
+
+    out = 0;
+    for (i = 0; i < length; i++)
+    {
+        runs[i].arr = vals[i].arr;
+        runs[i].pos = (thread_index == 0) ? 0 : keyval_lower_bound (
+            env, &vals[i], env->merge_splitters[thread_index - 1]);
+        runs[i].len = (thread_index == num_threads - 1) ? vals[i].len : 
+            keyval_lower_bound (
+                env, &vals[i], env->merge_splitters[thread_index]);
+
+        out += runs[i].pos;
+        if (runs[i].pos < runs[i].len)
+            lt.run[lt.k++] = &runs[i];
+    }
 
-    for (i = 0; i < length; i++) {
-        total_num_keys += vals[i].len;
+    if (lt.k > 0)
+    {
+        lt_init (&lt);
+        for (w = lt.node[0]; !lt_done (&lt, w); w = lt_replay (&lt))
+        {
+            env->merge_vals[out++] = *lt_merge_head (&lt, w);
+            lt_merge_run (&lt, w)->pos += 1;
+        }
     }
 
-    env->merge_vals[curr_thread].len = total_num_keys;
-    env->merge_vals[curr_thread].alloc_len = total_num_keys;
-    env->merge_vals[curr_thread].pos = 0;
-    env->merge_vals[curr_thread].arr = (keyval_t *)
-        mem_malloc(sizeof(keyval_t) * total_num_keys);
+    mem_free (lt.node);
+    mem_free (lt.run);
+    mem_free (runs);
+}
 
-    for (data_idx = 0; data_idx < total_num_keys; data_idx++) {
-        /* For each keyval_t. */
-        int         min_idx;
-        keyval_t    *min_keyval;
+/* Key comparator for sorting an array of key pointers. */
+static int key_ptr_cmp (const void *a, const void *b)
+{
+    return sort_key_cmp (*(void **)a, *(void **)b);
+}
 
-        for (i = 0; i < length && vals[i].pos >= vals[i].len; i++);
+/** choose_splitters()
+ *  Picks num_threads - 1 keys that cut the LENGTH sorted arrays of VALS,
+ *  TOTAL entries in all, into ranges of about equal size. Every array is 
+ *  sampled in proportion to its length and the samples are sorted.
+ */
+static void **
+choose_splitters (mr_env_t* env, keyval_arr_t *vals, int length, 
+    int total, int num_threads)
+{
+    void    **samples, **splitters;
+    int     num_samples, max_samples;
+    int     i, j, n;
 
-        if (i == length) break;
+    max_samples = num_threads * MERGE_OVERSAMPLING + length;
+    samples = (void **)mem_malloc (max_samples * sizeof (void *));
+    splitters = (void **)mem_malloc (num_threads * sizeof (void *));
+    CHECK_ERROR (samples == NULL || splitters == NULL);
 
-        /* Determine the minimum key. */
-        min_idx = i;
-        min_keyval = &vals[i].arr[vals[i].pos];
+    num_samples = 0;
+    for (i = 0; i < length; i++)
+    {
+        if (vals[i].len == 0) continue;
 
-        for (i++; i < length; i++) {
-            if (vals[i].pos < vals[i].len)
-            {
-                int cmp_ret;
-                cmp_ret = env->key_cmp(
-                    min_keyval->key, 
-                    vals[i].arr[vals[i].pos].key);
-
-                if (cmp_ret > 0) {
-                    min_idx = i;
-                    min_keyval = &vals[i].arr[vals[i].pos];
-                }
-            }
+        n = (int)(((int64_t)vals[i].len * num_threads * MERGE_OVERSAMPLING 
+            + total - 1) / total);
+        n = MIN (n, vals[i].len);
+        for (j = 0; j < n && num_samples < max_samples; j++)
+        {
+            samples[num_samples++] = 
+                vals[i].arr[(int64_t)j * vals[i].len / n].key;
         }
-
-        mem_memcpy (&env->merge_vals[curr_thread].arr[data_idx], 
-                        min_keyval, sizeof(keyval_t));
-        vals[min_idx].pos += 1;
     }
 
-    for (i = 0; i < length; i++) {
-        mem_free(vals[i].arr);
-    }
+    sort_key_cmp = env->key_cmp;
+    qsort (samples, num_samples, sizeof (void *), key_ptr_cmp);
+
+    for (i = 1; i < num_threads; i++)
+        splitters[i - 1] = samples[(int64_t)i * num_samples / num_threads];
+
+    mem_free (samples);
+    return splitters;
 }
 
 static inline int 
@@ -1792,6 +2026,141 @@ default_partition (int num_reduce_tasks, void* key, int key_size)
     return hash % num_reduce_tasks;
 }
 
+unsigned int 
+default_hash (void* key, int key_size)
+{
+    unsigned int hash = 2166136261u;
+    unsigned char *str = (unsigned char *)key;
+    int i;
+
+    for (i = 0; i < key_size; i++)
+    {
+        hash = (hash ^ str[i]) * 16777619u;     /* FNV-1a */
+    }
+
+    return hash;
+}
+
+/** estimate_num_reduce_tasks()
+ *  Picks the number of reduce tasks from the keys emitted by the sampling
+ *  round, aiming at KEYS_PER_REDUCE_TASK keys per task. Keys seen once in 
+ *  the sample estimate how many new keys the remaining tasks will bring 
+ *  (Good-Turing), so a saturated key set such as histogram's 768 bins 
+ *  gets few tasks while a growing vocabulary gets many.
+ */
+static int estimate_num_reduce_tasks (mr_env_t* env, int num_map_tasks)
+{
+    int         thread, i, j;
+    int         sampled_tasks;
+    int         max_tasks, num_tasks;
+    uint64_t    keys, max_keys = 0, singletons = 0;
+    double      est_keys;
+    keyvals_arr_t *row;
+
+    for (thread = 0; thread < env->intermediate_task_alloc_len; thread++)
+    {
+        row = env->intermediate_vals[thread];
+        if (row == NULL) continue;
+
+        keys = 0;
+        for (i = 0; i < env->num_reduce_tasks; i++)
+        {
+            keys += row[i].len;
+            for (j = 0; j < row[i].len; j++)
+                singletons += (row[i].arr[j].len == 1);
+        }
+        max_keys = MAX (max_keys, keys);
+    }
+
+    sampled_tasks = MIN (env->num_map_threads, num_map_tasks);
+    est_keys = (double)max_keys;
+    if (sampled_tasks > 0)
+        est_keys += (double)singletons * 
+            (num_map_tasks - sampled_tasks) / sampled_tasks;
+
+    max_tasks = env->oneOutputQueuePerReduceTask ? 
+        DEFAULT_NUM_REDUCE_TASKS : EXTENDED_NUM_REDUCE_TASKS;
+
+    num_tasks = 1;
+    while (num_tasks < max_tasks && 
+        num_tasks * (double)KEYS_PER_REDUCE_TASK < est_keys)
+        num_tasks *= 2;
+
+    /* Leave every reduce thread a few tasks to balance with. */
+    num_tasks = MAX (num_tasks, 
+        MIN_REDUCE_TASKS_PER_THREAD * env->num_reduce_threads);
+
+    return MIN (num_tasks, max_tasks);
+}
+
+/* Copies a chain of value chunks into REGION, keeping its order. */
+static val_t *
+copy_vals (mr_env_t* env, mem_region_t *region, val_t *vals)
+{
+    val_t   *copy;
+    size_t  size;
+
+    if (vals == NULL)
+        return NULL;
+
+    size = vals_chunk_size (env, vals->size);
+    copy = (val_t *)mem_region_alloc (region, size);
+    mem_memcpy (copy, vals, size);
+    copy->next_val = copy_vals (env, region, vals->next_val);
+
+    return copy;
+}
+
+/** repartition()
+ *  Moves the keys emitted so far into NUM_REDUCE_TASKS partitions. Each 
+ *  thread holds a key at most once, so entries move as a whole; their 
+ *  values are copied since every partition owns its memory region.
+ */
+static void repartition (mr_env_t* env, int num_reduce_tasks)
+{
+    int             thread, i, j, pos;
+    keyvals_arr_t   *row, *new_row;
+    keyvals_t       *kv, *moved;
+
+    for (thread = 0; thread < env->intermediate_task_alloc_len; thread++)
+    {
+        row = env->intermediate_vals[thread];
+        if (row == NULL) continue;
+
+        new_row = (keyvals_arr_t *)mem_calloc (
+            num_reduce_tasks, sizeof (keyvals_arr_t));
+
+        for (i = 0; i < env->num_reduce_tasks; i++)
+        {
+            for (j = 0; j < row[i].len; j++)
+            {
+                kv = &row[i].arr[j];
+                pos = env->partition (num_reduce_tasks, kv->key, kv->key_size);
+                pos %= num_reduce_tasks;
+
+                if (env->useHashIntermediate)
+                    moved = find_keyval_hashed (
+                        env, &new_row[pos], kv->key, kv->key_size);
+                else
+                    moved = find_keyval_sorted (
+                        env, &new_row[pos], kv->key, kv->key_size);
+
+                moved->len = kv->len;
+                moved->vals = copy_vals (env, &new_row[pos].region, kv->vals);
+            }
+
+            mem_region_free (&row[i].region);
+            if (row[i].index != NULL)
+                mem_free (row[i].index);
+        }
+
+        mem_free (row);
+        env->intermediate_vals[thread] = new_row;
+    }
+
+    env->num_reduce_tasks = num_reduce_tasks;
+}
+
 /**
  * Run map tasks and get intermediate values
  */
@@ -1799,6 +2168,7 @@ static void map (mr_env_t* env)
 {
     thread_arg_t   th_arg;
     int            num_map_tasks;
+    int            num_reduce_tasks;
 
     num_map_tasks = gen_map_tasks (env);
     assert (num_map_tasks >= 0);
@@ -1812,6 +2182,16 @@ static void map (mr_env_t* env)
     mem_memset (&th_arg, 0, sizeof(thread_arg_t));
     th_arg.task_type = TASK_TYPE_MAP;
 
+    /* Run one task per thread first and size the partitions from the keys
+       they emit. */
+    env->sampling = true;
+    start_workers (env, &th_arg);
+    env->sampling = false;
+
+    num_reduce_tasks = estimate_num_reduce_tasks (env, num_map_tasks);
+    if (num_reduce_tasks != env->num_reduce_tasks)
+        repartition (env, num_reduce_tasks);
+
     start_workers (env, &th_arg);
 }
 
@@ -1823,6 +2203,19 @@ static void reduce (mr_env_t* env)
     int            i;
     thread_arg_t   th_arg;
 
+    if (env->oneOutputQueuePerReduceTask)
+    {
+        env->final_vals = 
+            (keyval_arr_t *)mem_calloc (
+                env->num_reduce_tasks, sizeof (keyval_arr_t));
+    }
+    else
+    {
+        env->final_vals =
+            (keyval_arr_t *)mem_calloc (
+                env->num_reduce_threads, sizeof (keyval_arr_t));
+    }
+
     CHECK_ERROR (gen_reduce_tasks (env));
 
     mem_memset (&th_arg, 0, sizeof(thread_arg_t));
@@ -1844,6 +2237,7 @@ static void reduce (mr_env_t* env)
 static void merge (mr_env_t* env)
 {
     thread_arg_t   th_arg;
+    int            i, total;
 
     mem_memset (&th_arg, 0, sizeof (thread_arg_t));
     th_arg.task_type = TASK_TYPE_MERGE;
@@ -1865,35 +2259,34 @@ static void merge (mr_env_t* env)
         return;
     }
 
-    /* have work to merge! */
-    while (th_arg.merge_len > 1) {
-        th_arg.merge_round += 1;
-
-        /* This is the worst case length, 
-           depending on the value of num_merge_threads. */
-        env->merge_vals = (keyval_arr_t*) 
-            mem_malloc (env->num_merge_threads * sizeof(keyval_arr_t));
-
-        /* Run merge tasks and get merge values. */
-        start_workers (env, &th_arg);
+    /* Split the key space once so every merge thread can merge its own 
+       range straight into the final array. */
+    total = 0;
+    for (i = 0; i < th_arg.merge_len; i++)
+        total += th_arg.merge_input[i].len;
 
-        mem_free (th_arg.merge_input);
-        th_arg.merge_len = env->num_merge_threads;
+    env->num_merge_threads = MAX (MIN (env->num_merge_threads, total), 1);
+    env->merge_vals = (keyval_t *)mem_malloc (total * sizeof (keyval_t));
+    CHECK_ERROR (total > 0 && env->merge_vals == NULL);
+    env->merge_splitters = choose_splitters (env, th_arg.merge_input, 
+        th_arg.merge_len, total, env->num_merge_threads);
 
-        env->num_merge_threads /= 2;
-        if (env->num_merge_threads == 0)
-            env->num_merge_threads = 1;
+    /* Run merge tasks and get merge values. */
+    start_workers (env, &th_arg);
 
-        th_arg.merge_input = env->merge_vals;
+    for (i = 0; i < th_arg.merge_len; i++)
+    {
+        if (th_arg.merge_input[i].alloc_len != 0)
+            mem_free (th_arg.merge_input[i].arr);
     }
+    mem_free (th_arg.merge_input);
+    mem_free (env->merge_splitters);
 
-    env->args->result->data = env->merge_vals[0].arr;
-    env->args->result->length = env->merge_vals[0].len;
-
-    mem_free(env->merge_vals);
+    env->args->result->data = env->merge_vals;
+    env->args->result->length = total;
 }
 
 static inline mr_env_t* get_env (void)
 {
-    return (mr_env_t*)pthread_getspecific (env_key);
+    return curr_env;
 }
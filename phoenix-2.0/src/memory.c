@@ -47,11 +47,28 @@ void *mem_malloc (size_t size)
     return temp;
 }
 
+/* Allocates memory backed by the locality group of the calling thread. */
 void *mem_malloc_here (size_t size)
 {
     void *temp = malloc (size);
     assert(temp);
 
+    if (size >= PAGE_SIZE)
+    {
+#ifdef _SOLARIS_
+        /* Next thread to touch the pages gets them. */
+        madvise (ALIGN_PAGE (temp), size, MADV_ACCESS_LWP);
+#endif
+        /* Touch every page so that first-touch placement puts fresh pages
+           on this thread's node. */
+        char *page;
+        for (page = (char *)temp; page < (char *)temp + size; 
+            page += PAGE_SIZE)
+        {
+            *(volatile char *)page = 0;
+        }
+    }
+
     return temp;
 }
 
@@ -85,3 +102,158 @@ void mem_free (void *ptr)
 {
     free (ptr);
 }
+
+#define MEM_SLAB_MIN    512             /* First slab of a region. */
+#define MEM_SLAB_MAX    (64 * 1024)     /* Slabs stop doubling here. */
+#define MEM_LARGE       (MEM_SLAB_MAX / 4)  /* Blocks that get their own 
+                                           slab. */
+#define MEM_ALIGN       sizeof (void *)
+
+struct mem_slab_t
+{
+    mem_slab_t  *next;
+    mem_slab_t  *prev;                  /* Only kept for large slabs. */
+    size_t      size;                   /* Usable bytes after the header. */
+};
+
+struct mem_free_t
+{
+    mem_free_t  *next;
+    size_t      size;
+};
+
+/* Free list of an aligned block size below MEM_LARGE: class c holds the 
+   sizes in (2^(c+3), 2^(c+4)], so a block of class c+1 fits any request 
+   of class c. */
+static inline int mem_free_class (size_t size)
+{
+    int c = 0;
+
+    size = (size - 1) >> 4;
+    while (size > 0)
+    {
+        size >>= 1;
+        c++;
+    }
+    return c;
+}
+
+static inline size_t mem_region_align (size_t size)
+{
+    size = (size + MEM_ALIGN - 1) & ~(MEM_ALIGN - 1);
+    return (size < sizeof (mem_free_t)) ? sizeof (mem_free_t) : size;
+}
+
+void *mem_region_alloc (mem_region_t *region, size_t size)
+{
+    mem_slab_t  *slab;
+    mem_free_t  **f;
+    size_t      slab_size;
+    void        *temp;
+    int         c;
+
+    size = mem_region_align (size);
+
+    if (size >= MEM_LARGE)
+    {
+        slab = (mem_slab_t *)mem_malloc_here (sizeof (mem_slab_t) + size);
+        slab->size = size;
+        slab->prev = NULL;
+        slab->next = region->large;
+        if (region->large != NULL)
+            region->large->prev = slab;
+        region->large = slab;
+        return slab + 1;
+    }
+
+    /* Reuse a released block: the first that fits in the request's class,
+       else any of the next class. */
+    c = mem_free_class (size);
+    for (f = &region->free[c]; *f != NULL; f = &(*f)->next)
+    {
+        if ((*f)->size >= size)
+        {
+            temp = *f;
+            *f = (*f)->next;
+            return temp;
+        }
+    }
+    if (c + 1 < MEM_FREE_CLASSES && region->free[c + 1] != NULL)
+    {
+        temp = region->free[c + 1];
+        region->free[c + 1] = region->free[c + 1]->next;
+        return temp;
+    }
+
+    if (region->slabs == NULL || (size_t)(region->end - region->cur) < size)
+    {
+        /* Need a new slab, twice the last one. */
+        slab_size = (region->slabs == NULL) ? 
+            MEM_SLAB_MIN : region->slabs->size * 2;
+        if (slab_size > MEM_SLAB_MAX)
+            slab_size = MEM_SLAB_MAX;
+        if (slab_size < size)
+            slab_size = size;
+
+        slab = (mem_slab_t *)mem_malloc_here (sizeof (mem_slab_t) + slab_size);
+        slab->next = region->slabs;
+        slab->size = slab_size;
+
+        region->slabs = slab;
+        region->cur = (char *)(slab + 1);
+        region->end = region->cur + slab_size;
+    }
+
+    temp = region->cur;
+    region->cur += size;
+
+    return temp;
+}
+
+/* Hands back a block of SIZE bytes, as passed to mem_region_alloc(), that
+   is no longer used. */
+void mem_region_release (mem_region_t *region, void *ptr, size_t size)
+{
+    mem_slab_t  *slab;
+    mem_free_t  *block;
+    int         c;
+
+    size = mem_region_align (size);
+
+    if (size >= MEM_LARGE)
+    {
+        slab = (mem_slab_t *)ptr - 1;
+        if (slab->prev != NULL)
+            slab->prev->next = slab->next;
+        else
+            region->large = slab->next;
+        if (slab->next != NULL)
+            slab->next->prev = slab->prev;
+        free (slab);
+        return;
+    }
+
+    c = mem_free_class (size);
+    block = (mem_free_t *)ptr;
+    block->size = size;
+    block->next = region->free[c];
+    region->free[c] = block;
+}
+
+static void mem_slabs_free (mem_slab_t *slab)
+{
+    mem_slab_t *next;
+
+    for (; slab != NULL; slab = next)
+    {
+        next = slab->next;
+        free (slab);
+    }
+}
+
+void mem_region_free (mem_region_t *region)
+{
+    mem_slabs_free (region->slabs);
+    mem_slabs_free (region->large);
+    memset (region, 0, sizeof (mem_region_t));
+}
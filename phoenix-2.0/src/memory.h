@@ -37,4 +37,32 @@ inline void *mem_memcpy (void *dest, const void *src, size_t size);
 inline void *mem_memset (void *s, int c, size_t n);
 inline void mem_free (void *ptr);
 
+/* Region allocator. A region hands out memory from a chain of slabs by 
+ * bumping a pointer and gives it all back at once with mem_region_free(). 
+ * Slabs start small and double in size, so a region holding a few bytes 
+ * stays cheap. A block that is outgrown, such as an array copied into a 
+ * bigger one, can be handed back with mem_region_release(): small blocks 
+ * are kept on free lists by size class and reused by later allocations, 
+ * and large ones, which get a slab of their own, are freed at once. A 
+ * region must only be allocated from by one thread at a time; its slabs 
+ * are placed near that thread with mem_malloc_here(). A zeroed 
+ * mem_region_t is an empty region. */
+typedef struct mem_slab_t mem_slab_t;
+typedef struct mem_free_t mem_free_t;
+
+#define MEM_FREE_CLASSES    12      /* Size classes of released blocks. */
+
+typedef struct
+{
+    char        *cur;               /* Next free byte of the newest slab. */
+    char        *end;               /* End of the newest slab. */
+    mem_slab_t  *slabs;             /* Newest slab first. */
+    mem_slab_t  *large;             /* Slabs of single large blocks. */
+    mem_free_t  *free[MEM_FREE_CLASSES];    /* Released small blocks. */
+} mem_region_t;
+
+inline void *mem_region_alloc (mem_region_t *region, size_t size);
+inline void mem_region_release (mem_region_t *region, void *ptr, size_t size);
+inline void mem_region_free (mem_region_t *region);
+
 #endif // MEMORY_H_
@@ -39,6 +39,7 @@ typedef struct _val_t
 typedef struct
 {
     int len;
+    int key_size;
     void *key;
     val_t *vals;
 } keyvals_t;
@@ -24,6 +24,7 @@
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */ 
 
+
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -32,417 +33,294 @@
 
 #include "memory.h"
 #include "taskQ.h"
-#include "queue.h"
-#include "synch.h"
+#include "atomic.h"
 #include "locality.h"
 
-static int num_strands_per_chip = 0;
-
-typedef struct {
-    task_t              task; 
-    queue_elem_t        queue_elem;
-} tq_entry_t;
+#define TQ_CACHE_LINE_SIZE      64
+#define TQ_DEFAULT_LEN          256
 
+/* Tasks [next, end) of the task array are left for a thread. Threads claim
+   tasks by incrementing next, so next can run past end. */
 typedef struct {
-    mr_lock_t  parent;
-    uintptr_t  chksum;
-    mr_lock_t  *per_thread;
-} tq_lock_t;
-
+    unsigned int    next;
+    unsigned int    end;
+    char            pad[TQ_CACHE_LINE_SIZE - 2 * sizeof (unsigned int)];
+} tq_range_t;
+
+/* All tasks of a phase sit in one array. They are queued without locking, 
+   grouped by locality group and dealt to per-thread ranges once, after 
+   which threads dequeue from their own range and steal from the ranges of 
+   the threads next to them. Ranges are laid out group by group, so the 
+   next ranges of a thread belong to its own locality group first. */
 struct taskQ_t {
-    int             num_queues;
-    int             num_threads;
-    queue_t         **queues;
-    queue_t         **free_queues;
-    tq_lock_t       *locks;
-    /* putting all seeds together may lead to extra coherence traffic among cpus
-     * if it's a problem we can pad it by l1 line size */
-    /* per-thread random seed */
-    unsigned int    *seeds;
- };
-
-typedef int (*dequeue_fn)(taskQ_t *, int, int, queue_elem_t**);
-
-static inline taskQ_t* tq_init_normal(int numThreads);
-static inline void tq_finalize_normal(taskQ_t* tq);
-static inline int tq_dequeue_normal(
-    taskQ_t* tq, task_t* task, int lgrp, int tid);
-static inline int tq_dequeue_normal_seq (
-    taskQ_t* tq, task_t* task, int lgrp, int tid);
-static inline int tq_dequeue_normal_internal (
-    taskQ_t* tq, task_t* task, int lgrp, int tid, dequeue_fn dequeue_fn);
-
-static queue_t* tq_alloc_queue(void);
-static void tq_free_queue(queue_t* q);
-static int tq_queue_init(taskQ_t* tq, unsigned int idx);
-static void tq_queue_destroy(taskQ_t* tq, unsigned int idx);
-static void tq_empty_queue(queue_t* q);
+    int             num_queues;     /* # of locality groups. */
+    int             max_threads;    /* # of ranges allocated. */
+    int             num_threads;    /* # of ranges tasks are dealt to. */
+    int             len;
+    int             alloc_len;
+    task_t          *tasks;
+    task_t          *scratch;       /* Tasks being grouped by lgrp. */
+    int             *lgrps;         /* Locality hint of each task. */
+    int             *counts;        /* Tasks per lgrp while dealing. */
+    int             *thread_counts; /* Threads per lgrp while dealing. */
+    int             *queue_map;     /* Lgrp whose threads take its tasks. */
+    int             *slots;         /* Range of each thread. */
+    tq_range_t      *ranges;
+};
 
 taskQ_t* tq_init (int num_threads)
 {
-    return tq_init_normal(num_threads);
-}
+    taskQ_t         *tq;
 
-void tq_reset (taskQ_t* tq, int num_threads)
-{
-}
+    assert (num_threads > 0);
 
-/**
- * Initialize task queue for a normal machine
- */
-static inline taskQ_t* tq_init_normal(int numThreads)
-{
-    int             i;
-    taskQ_t         *tq = NULL;
-
-    tq = mem_calloc(1, sizeof(taskQ_t));
+    tq = (taskQ_t *)mem_calloc (1, sizeof (taskQ_t));
     if (tq == NULL) {
         return NULL;
     }
 
-    /* XXX should this be local? */
-    num_strands_per_chip = loc_get_lgrp_size ();
-    tq->num_threads = numThreads;
-    tq->num_queues = tq->num_threads / num_strands_per_chip;
-
-    if (tq->num_queues == 0)
+    tq->max_threads = num_threads;
+    tq->num_threads = num_threads;
+    tq->num_queues = loc_get_num_lgrps ();
+    if (tq->num_queues <= 0)
         tq->num_queues = 1;
 
-    tq->queues = (queue_t **)mem_calloc (tq->num_queues, sizeof (queue_t *));
-    if (tq->queues == NULL) goto fail_queues;
+    tq->ranges = (tq_range_t *)mem_calloc (num_threads, sizeof (tq_range_t));
+    if (tq->ranges == NULL) goto fail_ranges;
 
-    tq->free_queues = (queue_t **)mem_calloc (
-        tq->num_queues, sizeof (queue_t *));
-    if (tq->free_queues == NULL) goto fail_free_queues;
+    tq->slots = (int *)mem_calloc (num_threads, sizeof (int));
+    if (tq->slots == NULL) goto fail_slots;
 
-    tq->locks = (tq_lock_t *)mem_calloc (tq->num_queues, sizeof (tq_lock_t));
-    if (tq->locks == NULL) goto fail_locks;
-
-    tq->seeds = (unsigned int*)mem_calloc(
-        tq->num_threads, sizeof(unsigned int));
-    if (tq->seeds == NULL) goto fail_seeds;
-    mem_memset(tq->seeds, 0, sizeof(unsigned int) * tq->num_threads);
-
-    for (i = 0; i < tq->num_queues; ++i)
-        if (!tq_queue_init(tq, i))
-            goto fail_tq_init;
+    /* counts, thread_counts and queue_map share one block. */
+    tq->counts = (int *)mem_calloc (3 * (tq->num_queues + 1), sizeof (int));
+    if (tq->counts == NULL) goto fail_counts;
+    tq->thread_counts = tq->counts + (tq->num_queues + 1);
+    tq->queue_map = tq->thread_counts + (tq->num_queues + 1);
 
     return tq;
 
-fail_tq_init:
-    /* destroy all queues that have been allocated */
-    i--;
-    while (i >= 0) {
-        tq_queue_destroy(tq, i);
-        --i;
-    }
-    mem_free(tq->seeds);
-fail_seeds:
-    mem_free(tq->locks);
-fail_locks:
-    mem_free(tq->free_queues);
-fail_free_queues:
-    mem_free(tq->queues);
-fail_queues:
-    mem_free(tq);
+fail_counts:
+    mem_free (tq->slots);
+fail_slots:
+    mem_free (tq->ranges);
+fail_ranges:
+    mem_free (tq);
     return NULL;
 }
 
-/**
- * Destroys an initialized queue (i.e. free queue and alloc queue) in task queue
- * @param tq    tq to index
- * @param idx   index of queue to destroy in tq
- */
-static void tq_queue_destroy(taskQ_t* tq, unsigned int idx)
-{
-    int             j;
-    uintptr_t       chksum;
-
-    assert (idx < tq->num_queues);
-
-    tq_empty_queue(tq->queues[idx]);
-    tq_free_queue(tq->queues[idx]);
-
-    tq_empty_queue(tq->free_queues[idx]);
-    tq_free_queue(tq->free_queues[idx]);
-
-    /* free all lock data associated with queue */
-    chksum = 0;
-    for (j = 0; j < tq->num_threads; j++) {
-        chksum += (uintptr_t)tq->locks[idx].per_thread[j];
-        lock_free_per_thread(tq->locks[idx].per_thread[j]);
-    }
-
-    lock_free (tq->locks[idx].parent);
-
-    mem_free (tq->locks[idx].per_thread);
-    tq->locks[idx].per_thread = NULL;
-}
-
-/**
- * Initialize a queue for a given index in the task queue
- * @return zero on failure, nonzero on success
- */
-static int tq_queue_init(taskQ_t* tq, unsigned int idx)
+/* Empties TQ for the tasks of the next phase. The task array is kept. */
+void tq_reset (taskQ_t* tq)
 {
-    int     j;
-
-    assert (idx < tq->num_queues);
-
-    tq->queues[idx] = tq_alloc_queue();
-    if (tq->queues[idx] == NULL) return 0;
-
-    tq->free_queues[idx] = tq_alloc_queue();
-    if (tq->free_queues[idx] == NULL) goto fail_free_queue;
-
-    tq->locks[idx].parent = lock_alloc();
-
-    tq->locks[idx].per_thread = (mr_lock_t *)mem_calloc(
-        tq->num_threads, sizeof(mr_lock_t));
-    if (tq->locks[idx].per_thread == NULL) goto fail_priv_alloc;
-
-    tq->locks[idx].chksum = 0;
-    for (j = 0; j < tq->num_threads; ++j) {
-        mr_lock_t   per_thread;
-        per_thread = lock_alloc_per_thread(tq->locks[idx].parent);
-        tq->locks[idx].per_thread[j] = per_thread;
-        tq->locks[idx].chksum += (uintptr_t)per_thread;
-    }
-
-    return 1;
-
-fail_priv_alloc:
-    lock_free(&tq->locks[idx].parent);
-    tq_free_queue(tq->free_queues[idx]);
-    tq->free_queues[idx] = NULL;
-fail_free_queue:
-    tq_free_queue(tq->queues[idx]);
-    tq->queues[idx] = NULL;
+    int i;
 
-    return 0;
-}
+    assert (tq != NULL);
 
-/**
- * Allocates an initialized queue
- * @return NULL on failure, initialized queue pointer on success
- */
-static queue_t* tq_alloc_queue(void)
-{
-    queue_t *q;
+    tq->len = 0;
 
-    q = (queue_t*) mem_malloc (sizeof(queue_t));
-    if (q == NULL) {
-        return NULL;
+    for (i = 0; i < tq->max_threads; ++i) {
+        tq->ranges[i].next = 0;
+        tq->ranges[i].end = 0;
     }
-
-    queue_init(q);
-
-    return q;
-}
-
-/**
- * Frees an initialized queue that was allocated on the heap.
- */
-static void tq_free_queue(queue_t* q)
-{
-    mem_free(q);
-}
-
-/**
- * Empties out a queue in the task queue by dequeuing and freeing
- * every task.
- */
-static void tq_empty_queue(queue_t* q)
-{
-    do {
-        tq_entry_t      *entry;
-        queue_elem_t    *queue_elem;
-
-        if (queue_pop_front (q, &queue_elem) == 0)
-            break;
-
-        entry = queue_entry (queue_elem, tq_entry_t, queue_elem);
-        assert (entry != NULL);
-        mem_free (entry);
-    } while (1);
 }
 
-static inline void tq_finalize_normal(taskQ_t* tq)
+void tq_finalize (taskQ_t* tq)
 {
-    int i;
-
-    assert (tq->queues != NULL);
-    assert (tq->free_queues != NULL);
-    assert (tq->locks != NULL);
-
-    /* destroy all queues */
-    for (i = 0; i < tq->num_queues; ++i) {
-        tq_queue_destroy(tq, i);
-    }
-
-    /* destroy all first level pointers in tq */
-    mem_free (tq->queues);
-    mem_free (tq->free_queues);
-    mem_free (tq->locks);
-    mem_free (tq->seeds);
+    assert (tq != NULL);
 
-    /* finally kill tq */
+    mem_free (tq->tasks);
+    mem_free (tq->scratch);
+    mem_free (tq->lgrps);
+    mem_free (tq->counts);
+    mem_free (tq->slots);
+    mem_free (tq->ranges);
     mem_free (tq);
 }
 
-void tq_finalize (taskQ_t* tq)
-{
-    tq_finalize_normal(tq);
-}
-
-/* Queue TASK at LGRP task queue with locking.
-   LGRP is a locality hint denoting to which locality group this task 
-   should be queued at. If LGRP is less than 0, the locality group is 
-   randomly selected. TID is required for MCS locking. */
-int tq_enqueue (taskQ_t* tq, task_t *task, int lgrp, int tid)
+/* Doubles the task arrays of TQ. */
+static int tq_grow (taskQ_t* tq)
 {
-    tq_entry_t      *entry;
-    int             index;
+    int         alloc_len;
+    task_t      *tasks, *scratch;
+    int         *lgrps;
 
-    assert (tq != NULL);
-    assert (task != NULL);
+    alloc_len = (tq->alloc_len > 0) ? tq->alloc_len * 2 : TQ_DEFAULT_LEN;
 
-    entry = (tq_entry_t *)mem_malloc (sizeof (tq_entry_t));
-    if (entry == NULL) {
-        return -1;
-    }
+    tasks = (task_t *)mem_realloc (tq->tasks, alloc_len * sizeof (task_t));
+    if (tasks == NULL) return -1;
+    tq->tasks = tasks;
 
-    mem_memcpy (&entry->task, task, sizeof (task_t));
+    scratch = (task_t *)mem_realloc (
+        tq->scratch, alloc_len * sizeof (task_t));
+    if (scratch == NULL) return -1;
+    tq->scratch = scratch;
 
-    index = (lgrp < 0) ? rand_r(&tq->seeds[tid]) : lgrp;
-    index %= tq->num_queues;
+    lgrps = (int *)mem_realloc (tq->lgrps, alloc_len * sizeof (int));
+    if (lgrps == NULL) return -1;
+    tq->lgrps = lgrps;
 
-    lock_acquire (tq->locks[index].per_thread[tid]);
-    queue_push_back (tq->queues[index], &entry->queue_elem);
-    lock_release (tq->locks[index].per_thread[tid]);
+    tq->alloc_len = alloc_len;
 
     return 0;
 }
 
-/* Queue TASK at LGRP task queue without locking.
+/* Queue TASK at LGRP task queue. Tasks are only queued before they are
+   dealt with tq_distribute(), so no locking is done.
    LGRP is a locality hint denoting to which locality group this task
-   should be queued at. If LGRP is less than 0, the locality group is
-   randomly selected. */
+   should be queued at. If LGRP is less than 0, the task goes to the
+   locality group its position in the queue falls in, which keeps 
+   consecutive tasks together. */
 int tq_enqueue_seq (taskQ_t* tq, task_t *task, int lgrp)
 {
-    tq_entry_t      *entry;
-    int             index;
-
+    assert (tq != NULL);
     assert (task != NULL);
 
-    entry = (tq_entry_t *)mem_malloc (sizeof (tq_entry_t));
-    if (entry == NULL) {
+    if (tq->len == tq->alloc_len && tq_grow (tq) < 0) {
         return -1;
     }
 
-    mem_memcpy (&entry->task, task, sizeof (task_t));
-
-    index = (lgrp < 0) ? rand() % tq->num_queues : lgrp % tq->num_queues;
-    queue_push_back (tq->queues[index], &entry->queue_elem);
+    mem_memcpy (&tq->tasks[tq->len], task, sizeof (task_t));
+    tq->lgrps[tq->len] = lgrp;
+    tq->len++;
 
     return 0;
 }
 
-/**
- * Safely dequeues an element from the normal queue and queues onto free queue
- * @param tq        taskQ to operate on
- * @param idx       index of queue to use
- * @param tid       task id
- * @param qe        queue element of element we operated on
- * @return nonzero if normal queue was empty
- */
-static inline int tq_elem_into_free_seq (
-    taskQ_t* tq, int idx, int tid, queue_elem_t** qe)
+/* Deals the queued tasks to NUM_THREADS threads. THREAD_LGRPS holds the 
+   locality group of each thread; if it is NULL, the threads are split 
+   into locality groups in blocks of consecutive ids. Tasks are stably 
+   grouped by locality group, tasks of a group without threads go to the 
+   next group that has some, and the tasks of a group are split into 
+   contiguous ranges among the threads of that group. */
+void tq_distribute (taskQ_t* tq, int num_threads, const int *thread_lgrps)
 {
-    queue_elem_t    *queue_elem = NULL;
-    int             ret;
+    int         i, q, t, num_queues;
+    int         start, num_tasks, first, num_group_threads;
+    task_t      *tmp;
 
-    ret = queue_pop_front (tq->queues[idx], &queue_elem);
-    if (ret != 0)
-        queue_push_back (tq->free_queues[idx], queue_elem);
-
-    *qe = queue_elem;
-
-    return ret;
-}
+    assert (tq != NULL);
+    assert (num_threads > 0);
+
+    if (num_threads > tq->max_threads)
+        num_threads = tq->max_threads;
+    tq->num_threads = num_threads;
+    num_queues = tq->num_queues;
+
+    /* Group the threads, keeping them in id order within a group. */
+    mem_memset (tq->thread_counts, 0, (num_queues + 1) * sizeof (int));
+    for (t = 0; t < num_threads; ++t) {
+        if (thread_lgrps != NULL && thread_lgrps[t] >= 0)
+            q = thread_lgrps[t] % num_queues;
+        else
+            q = (int)((int64_t)t * num_queues / num_threads);
+        tq->slots[t] = q;
+        tq->thread_counts[q + 1]++;
+    }
+    for (q = 0; q < num_queues; ++q)
+        tq->thread_counts[q + 1] += tq->thread_counts[q];
+    for (t = 0; t < num_threads; ++t)
+        tq->slots[t] = tq->thread_counts[tq->slots[t]]++;
 
-/**
- * Safely dequeues an element from the normal queue and queues onto free queue
- * @param tq        taskQ to operate on
- * @param idx       index of queue to use
- * @param tid       task id
- * @param qe        queue element of element we operated on
- * @return nonzero if normal queue was empty
- */
-static inline int tq_elem_into_free (
-    taskQ_t* tq, int idx, int tid, queue_elem_t** qe)
-{
-    int             ret;
+    /* thread_counts[q] is the end of the threads of group q now. */
+    for (q = num_queues - 1; q >= 0; --q)
+    {
+        first = (q > 0) ? tq->thread_counts[q - 1] : 0;
+        if (tq->thread_counts[q] > first)
+            tq->queue_map[q] = q;
+        else
+            tq->queue_map[q] = (q + 1 < num_queues) ? 
+                tq->queue_map[q + 1] : -1;
+    }
+    for (q = num_queues - 1; q >= 0 && tq->queue_map[q] < 0; --q)
+        tq->queue_map[q] = tq->queue_map[0];
+
+    /* Group the tasks by locality group with a counting sort. */
+    mem_memset (tq->counts, 0, (num_queues + 1) * sizeof (int));
+    for (i = 0; i < tq->len; ++i) {
+        if (tq->lgrps[i] < 0)
+            q = (int)((int64_t)i * num_queues / tq->len);
+        else
+            q = tq->lgrps[i] % num_queues;
+        tq->lgrps[i] = tq->queue_map[q];
+        tq->counts[tq->lgrps[i] + 1]++;
+    }
 
-    lock_acquire (tq->locks[idx].per_thread[tid]);
-    ret = tq_elem_into_free_seq (tq, idx, tid, qe);
-    lock_release (tq->locks[idx].per_thread[tid]);
+    if (num_queues > 1) {
+        for (q = 0; q < num_queues; ++q)
+            tq->counts[q + 1] += tq->counts[q];
+
+        for (i = 0; i < tq->len; ++i)
+            mem_memcpy (&tq->scratch[tq->counts[tq->lgrps[i]]++], 
+                &tq->tasks[i], sizeof (task_t));
+
+        tmp = tq->tasks;
+        tq->tasks = tq->scratch;
+        tq->scratch = tmp;
+
+        /* The scatter left counts[q] at the end of group q; shift them 
+           back to the group starts. */
+        for (q = num_queues; q > 0; --q)
+            tq->counts[q] = tq->counts[q - 1];
+        tq->counts[0] = 0;
+    } else {
+        tq->counts[0] = 0;
+        tq->counts[1] = tq->len;
+    }
 
-    return ret;
+    /* Split every group among its threads. */
+    for (q = 0; q < num_queues; ++q) {
+        start = tq->counts[q];
+        num_tasks = tq->counts[q + 1] - start;
+        first = (q > 0) ? tq->thread_counts[q - 1] : 0;
+        num_group_threads = tq->thread_counts[q] - first;
+
+        for (t = 0; t < num_group_threads; ++t) {
+            tq->ranges[first + t].next = 
+                start + (int)((int64_t)t * num_tasks / num_group_threads);
+            tq->ranges[first + t].end = 
+                start + (int)((int64_t)(t + 1) * num_tasks / num_group_threads);
+        }
+    }
 }
 
-static inline int tq_dequeue_normal_seq (
-    taskQ_t* tq, task_t* task, int lgrp, int tid)
+/* Claims the next task of RANGE into POS. Returns nonzero on success. */
+static inline int tq_range_take (tq_range_t *range, unsigned int *pos)
 {
-    return tq_dequeue_normal_internal (
-        tq, task, lgrp, tid, tq_elem_into_free_seq);
-}
+    /* Skip the atomic once the range is known to be drained. */
+    if (*(volatile unsigned int *)&range->next >= range->end)
+        return 0;
 
-static inline int tq_dequeue_normal(
-    taskQ_t* tq, task_t* task, int lgrp, int tid)
-{
-    return tq_dequeue_normal_internal (
-        tq, task, lgrp, tid, tq_elem_into_free);
+    *pos = fetch_and_inc (&range->next);
+
+    return *pos < range->end;
 }
 
-static inline int tq_dequeue_normal_internal (
-    taskQ_t* tq, task_t* task, int lgrp, int tid, dequeue_fn dequeue_fn)
+/* Dequeue a task into TASK. Thread TID takes from its own range first and
+   then steals from the ranges that follow it, which belong to the threads 
+   of its own locality group before those further away. LGRP is implied by
+   TID and only kept for the interface.
+   Returns 1 if a task was dequeued, 0 if no tasks are left. */
+int tq_dequeue (taskQ_t* tq, task_t *task, int lgrp, int tid)
 {
-    int             i, ret, index;
-    queue_elem_t    *queue_elem;
-    tq_entry_t      *entry;
+    int             i, idx;
+    unsigned int    pos;
 
+    assert (tq != NULL);
     assert (task != NULL);
+    assert (tid >= 0);
 
-    mem_memset (task, 0, sizeof (task_t));
-
-    index = (lgrp < 0) ? rand_r(&tq->seeds[tid]) : lgrp;
-    index %= tq->num_queues;
-    ret = (*dequeue_fn)(tq, index, tid, &queue_elem);
-
-   /* Do task stealing if nothing on our queue.
-      Cycle through all indexes until success or exhaustion */
-    for (i = (index + 1) % tq->num_queues;
-        (ret == 0) && (i != index);
-        i = (i + 1) % tq->num_queues)
+    idx = tq->slots[tid % tq->num_threads];
+    for (i = 0; i < tq->num_threads; ++i)
     {
-        ret = (*dequeue_fn)(tq, i, tid, &queue_elem);
-    }
+        if (tq_range_take (&tq->ranges[idx], &pos)) {
+            mem_memcpy (task, &tq->tasks[pos], sizeof (task_t));
+            return 1;
+        }
 
-    if (ret == 0) {
-        /* There really is no more work. */
-        return 0;
+        if (++idx == tq->num_threads)
+            idx = 0;
     }
 
-    entry = queue_entry (queue_elem, tq_entry_t, queue_elem);
-    assert (entry != NULL);
-
-    mem_memcpy (task, &entry->task, sizeof (task_t));
-
-    return 1;
-}
-
-int tq_dequeue (taskQ_t* tq, task_t *task, int lgrp, int tid)
-{
-    return tq_dequeue_normal(tq, task, lgrp, tid);
+    /* There really is no more work. */
+    mem_memset (task, 0, sizeof (task_t));
+    return 0;
 }
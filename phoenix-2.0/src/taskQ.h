@@ -44,11 +44,11 @@ typedef struct {
 struct taskQ_t;
 typedef struct taskQ_t taskQ_t;
 
-int tq_enqueue (taskQ_t* tq, task_t *task, int lgrp, int tid);
 int tq_enqueue_seq (taskQ_t* tq, task_t *task, int lgrp);
+void tq_distribute (taskQ_t* tq, int num_threads, const int *thread_lgrps);
 int tq_dequeue (taskQ_t* tq, task_t *task, int lgrp, int tid);
 taskQ_t* tq_init (int num_threads);
-void tq_reset (taskQ_t* tq, int num_threads);
+void tq_reset (taskQ_t* tq);
 void tq_finalize (taskQ_t* tq);
 
 #endif /* TASK_Q_ */
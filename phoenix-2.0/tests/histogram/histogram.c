@@ -109,12 +109,13 @@ int myshortcmp(const void *s1, const void *s2)
  */
 void hist_map(map_args_t *args) 
 {
-    int i;
-    short *key;
+    int i, num = 0;
     unsigned char *val;
     intptr_t red[256];
     intptr_t green[256];
     intptr_t blue[256];
+    void *keys[768];
+    void *vals[768];
 
     assert(args);
     unsigned char *data = (unsigned char *)args->data;
@@ -139,20 +140,22 @@ void hist_map(map_args_t *args)
     for (i = 0; i < 256; i++) 
     {
         if (blue[i] > 0) {
-            key = &(blue_keys[i]);
-            emit_intermediate((void *)key, (void *)blue[i], (int)sizeof(short));
+            keys[num] = &(blue_keys[i]);
+            vals[num++] = (void *)blue[i];
         }
         
         if (green[i] > 0) {
-            key = &(green_keys[i]);
-            emit_intermediate((void *)key, (void *)green[i], (int)sizeof(short));
+            keys[num] = &(green_keys[i]);
+            vals[num++] = (void *)green[i];
         }
         
         if (red[i] > 0) {
-            key = &(red_keys[i]);
-            emit_intermediate((void *)key, (void *)red[i], (int)sizeof(short));
+            keys[num] = &(red_keys[i]);
+            vals[num++] = (void *)red[i];
         }
     }
+
+    emit_intermediate_batch(keys, vals, (int)sizeof(short), num);
 }
 
 /** hist_reduce()
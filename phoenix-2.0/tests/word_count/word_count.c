@@ -61,6 +61,12 @@ enum {
     unsigned int library_time = 0;
 #endif
 
+/* Every word is emitted with an inline count of one. */
+static int one = 1;
+
+/* Partial sum returned by the combiner, copied out by the runtime. */
+static __thread int combined;
+
 /** mystrcmp()
  *  Comparison function to compare 2 words
  */
@@ -169,7 +175,7 @@ void wordcount_map(map_args_t *args)
             if ((curr_ltr < 'A' || curr_ltr > 'Z') && curr_ltr != '\'')
             {
                 data[i] = 0;
-                emit_intermediate(curr_start, (void *)1, &data[i] - curr_start + 1);
+                emit_intermediate(curr_start, &one, &data[i] - curr_start + 1);
                 state = NOT_IN_WORD;
             }
             break;
@@ -190,7 +196,7 @@ void wordcount_map(map_args_t *args)
     if (state == IN_WORD)
     {
         data[args->length] = 0;
-        emit_intermediate(curr_start, (void *)1, &data[i] - curr_start + 1);
+        emit_intermediate(curr_start, &one, &data[i] - curr_start + 1);
     }
 }
 
@@ -208,7 +214,7 @@ void wordcount_reduce(void *key_in, iterator_t *itr)
 
     while (iter_next (itr, &val))
     {
-        sum += (intptr_t)val;
+        sum += *(int *)val;
     }
 
     emit(key, (void *)sum);
@@ -223,10 +229,11 @@ void *wordcount_combiner (iterator_t *itr)
 
     while (iter_next (itr, &val))
     {
-        sum += (intptr_t)val;
+        sum += *(int *)val;
     }
 
-    return (void *)sum;
+    combined = (int)sum;
+    return &combined;
 }
 
 int main(int argc, char *argv[]) 
@@ -298,6 +305,9 @@ int main(int argc, char *argv[])
     map_reduce_args.key_cmp = mystrcmp;
     map_reduce_args.unit_size = wc_data.unit_size;
     map_reduce_args.partition = NULL; // use default
+    map_reduce_args.use_hash_intermediate = true;
+    map_reduce_args.hash = NULL; // use default
+    map_reduce_args.val_size = sizeof(int);
     map_reduce_args.result = &wc_vals;
     map_reduce_args.data_size = finfo.st_size;
     map_reduce_args.L1_cache_size = atoi(GETENV("MR_L1CACHESIZE"));//1024 * 1024 * 2;
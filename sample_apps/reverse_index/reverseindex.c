@@ -50,133 +50,11 @@ enum {
    START_LINK
 };
 
-/* The list of files */
-typedef struct flist{
-   char *data;
-   char *name;
-   int fd;
-   off_t size;
-   struct flist *next;
-} filelist_t;
-
 typedef struct {
    char **vals;
    int length;   
 } vals_t;
 
-typedef struct {
-   filelist_t *filelist;
-   filelist_t *currfile;
-   int num_files;
-   int unit_size;
-} ri_data_t;
-
-ri_data_t ri_data;
-int data_size;
-int req_data;
-
-/** cleanup()
- *  
- */
-void cleanup() {
-   filelist_t *curr_ptr = ri_data.filelist;
-   filelist_t *prev_ptr;
-   
-   while(curr_ptr != NULL) {
-      /*munmap(curr_ptr->data, curr_ptr->size + 1);
-      close(curr_ptr->fd);*/
-      free(curr_ptr->data);
-      free(curr_ptr->name);
-
-      prev_ptr = curr_ptr;
-      curr_ptr = curr_ptr->next;
-      free(prev_ptr);   
-   }
-}
-
-/** addtolist()
- *  Create and update the list from links to files
- */
-void addtolist(filelist_t *file) {
-   
-   file->next = NULL;
-   
-   if (ri_data.filelist == NULL) {
-      ri_data.filelist = file;
-      ri_data.currfile = file;
-   }
-   else {
-      ri_data.currfile->next = file;
-      ri_data.currfile = file;
-   }
-   
-   ri_data.num_files++;
-}
-
-/** recursedirs()
- *  Recursively go througn the directories with the HTML files and memory
- *	map them
- */
-void recursedirs(char *name) {
-   
-   DIR *dp;
-   struct dirent *ep;
-   struct stat finfo;
-   char *path;
-   
-   if (((req_data > 0) && (data_size < req_data)) || (req_data <= 0)) {
-      dp = opendir (name);
-      if (dp != NULL)      // it's a directory
-      {
-         while ((ep = readdir (dp)) != NULL) {
-            if (strcmp(ep->d_name, ".") == 0) continue;
-            if (strcmp(ep->d_name, "..") == 0) continue;
-            
-            path = (char *)malloc(strlen(ep->d_name) + strlen(name) + 2);
-            sprintf(path, "%s/%s",name,ep->d_name);
-            
-            recursedirs(path);
-            free(path);
-         }
-         (void) closedir (dp);
-      }
-      else  // it's not a directory, mmap file and add it to the list
-      {
-         filelist_t *file;
-         CHECK_ERROR((file = (filelist_t *)malloc(sizeof(filelist_t))) == NULL);
-         file->fd = open(name, O_RDONLY);
-         if (file->fd < 0) {
-            free(file);   
-         }
-         else {
-            int ret = fstat(file->fd, &finfo);
-            if (ret < 0) {
-               free(file);
-            }
-            else {
-               file->size = finfo.st_size;
-               char *f_data = mmap(0, file->size + 1, PROT_READ | PROT_WRITE, 
-                                                       MAP_PRIVATE, file->fd, 0);
-               if (f_data == NULL) {
-                  free(file);
-               }
-               else {
-                  CHECK_ERROR((file->name = (char *)malloc(strlen(name) + 1)) == NULL);
-                  data_size += finfo.st_size;
-                  strcpy(file->name, name);
-                  file->data = (char *)malloc(finfo.st_size + 1);
-                  memcpy(file->data, f_data, finfo.st_size);
-                  addtolist(file);
-                  munmap(f_data, file->size + 1);
-                  close(file->fd);
-               }
-            }
-         }
-      }
-   }
-   return;
-}
-
 /** mystrcmp()
  *  String comparison function for keys
  */
@@ -186,41 +64,6 @@ int mystrcmp(const void *s1, const void *s2)
 }
 
 
-/** revidx_splitter()
- *  Allocate several files to each map task (until we run out of files).
- */
-int revidx_splitter(void *data_in, int req_units, map_args_t *out)
-{
-   ri_data_t *ri_data = (ri_data_t *)data_in; 
-   int i;
-   
-   assert(data_in);
-   assert(out);
-   
-   assert(ri_data->num_files >= 0);
-   assert(ri_data->filelist);
-   assert(req_units);
-   
-   // End of filelist reached, return FALSE for no more data
-   if (ri_data->currfile == NULL) return 0;
-
-   // Set the start of the next data
-   out->data = (void *)ri_data->currfile;
-   
-   out->length = 0;
-   
-   for (i=0; i<req_units; i++) 
-   {
-      out->length++;
-      ri_data->currfile = ri_data->currfile->next;
-      if (ri_data->currfile == NULL) return 1;
-   }
-
-   // Return true since the out data is valid
-   return 1;
-}
-
-
 /** revidx_map()
  *  Map task that goes through each file and finds the links
  *	and updates the relevant lists
@@ -234,7 +77,7 @@ void revidx_map(map_args_t *args)
    char *link_end;
    int state = START;
    
-   filelist_t *file = (filelist_t *)args->data;
+   mr_file_t *file = (mr_file_t *)args->data;
    
    
    // go through each file and look for links.
@@ -334,6 +177,9 @@ void revidx_reduce(void *key_in, void **vals_in, int vals_len)
 int main (int argc, char **argv)
 {
    final_data_t ri_vals;
+   mr_files_t *files;
+   off_t req_data, data_size;
+   int num_files;
    int i, j;
    
    if (argc != 2) {
@@ -342,46 +188,30 @@ int main (int argc, char **argv)
    }   
    CHECK_ERROR(argv[1] == NULL);
 
-   ri_data.filelist = NULL;
-   ri_data.currfile = NULL;
-   ri_data.num_files = 0;
-   ri_data.unit_size = UNIT_SIZE;
-   data_size = 0;
-   
    char *req_data_str = getenv("RI_DATASIZE");
    if (req_data_str != NULL)
       req_data = atoi(req_data_str);
    else
       req_data = 0;
    
-   printf("Reqd data = %d\n", req_data);
+   printf("Reqd data = %d\n", (int)req_data);
    
-   recursedirs(argv[1]);
-   
-   printf("Number of files added = %d, total size = %d\n", ri_data.num_files, data_size);
-   dprintf("Files are:\n");
-   ri_data.currfile = ri_data.filelist;
-   while (ri_data.currfile!= NULL) {
-      dprintf("%s\n", ri_data.currfile->name);
-      ri_data.currfile = ri_data.currfile->next;
-   }
-   
-   // set currfile to the start of the list before calling mapreduce so that
-   // the splitter starts from the first file.
-   ri_data.currfile = ri_data.filelist;   
+   // The directories are crawled and the files mapped by the map workers
+   CHECK_ERROR((files = mr_files_create(&argv[1], 1, 0, req_data)) == NULL);
    
    // Setup scheduler args
    scheduler_args_t sched_args;
    memset(&sched_args, 0, sizeof(scheduler_args_t));
-   sched_args.task_data = &ri_data;
+   sched_args.task_data = files;
    sched_args.map = revidx_map;
    sched_args.reduce = revidx_reduce;
-   sched_args.splitter = revidx_splitter;
+   sched_args.splitter = mr_files_splitter;
+   sched_args.splitter_is_thread_safe = 1;
    sched_args.key_cmp = mystrcmp;
-   sched_args.unit_size = ri_data.unit_size;
+   sched_args.unit_size = UNIT_SIZE;
    sched_args.partition = NULL; // use default
    sched_args.result = &ri_vals;
-   sched_args.data_size = data_size;
+   sched_args.data_size = 0; // not known until the crawl is done
    sched_args.L1_cache_size = atoi(GETENV("MR_L1CACHESIZE")); //1024 * 64;
    sched_args.num_map_threads = atoi(GETENV("MR_NUMTHREADS"));//8;
    sched_args.num_reduce_threads = atoi(GETENV("MR_NUMTHREADS"));//16;
@@ -397,6 +227,9 @@ int main (int argc, char **argv)
 
    printf("ReverseIndex: MapReduce Completed\n");  
 
+   num_files = mr_files_count(files, &data_size);
+   printf("Number of files added = %d, total size = %d\n", num_files, (int)data_size);
+
    for (i = 0; i < ri_vals.length; i++) {
       keyval_t *keyval = (keyval_t *)&(ri_vals.data[i]);
       dprintf("\nLink to \"%s\" found in:\n", (char *)keyval->key);
@@ -411,7 +244,7 @@ int main (int argc, char **argv)
 
    free(ri_vals.data);
    
-   cleanup();
+   mr_files_destroy(files);
    return 0;
 }
 
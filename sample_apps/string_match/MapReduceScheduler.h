@@ -27,6 +27,8 @@
 #ifndef _MAP_REDUCE_SCHEDULER_H_
 #define _MAP_REDUCE_SCHEDULER_H_
 
+#include <sys/types.h>
+
 /* Standard data types for the function arguments and results */
 
  
@@ -61,6 +63,25 @@ typedef struct
    keyval_t *data;
 } final_data_t;
 
+/* One file of a multi-file input source. The map function of a source gets 
+ * the first file of its task in map_args_t data, the number of files in 
+ * length, and follows next for the rest.
+ * name - path of the file
+ * data - contents of the file, privately mapped so it can be written to, and 
+ *        followed by a 0 byte
+ * size - # of bytes in the file
+ */
+typedef struct mr_file
+{
+   char * name;
+   char * data;
+   off_t size;
+   struct mr_file * next;
+} mr_file_t;
+
+/* Multi-file input source, see mr_files_create() */
+typedef struct mr_files mr_files_t;
+
 /* Scheduler function pointer type definitions */
 
 /* Map function takes in map_args_t, as supplied by the splitter
@@ -131,6 +152,9 @@ typedef struct
    float key_match_factor;     /* Magic number that describes the ratio of 
                                 * the input data size to the output data size.
                                 * This is used as a hint. */
+   int splitter_is_thread_safe;/* The splitter does its own locking, so the
+                                * map workers call it in parallel instead of
+                                * under the scheduler's splitter lock. */
 } scheduler_args_t;
 
 /* Scheduler defined functions */
@@ -169,4 +193,29 @@ inline void emit_inline(void *key, void *val);
  */
 int default_partition(int reduce_tasks, void* key, int key_size);
 
+/* Creates a multi-file input source for the files in paths and, recursively,
+ * in the directories among them. Pass it as task_data with mr_files_splitter
+ * as the splitter and splitter_is_thread_safe set. The map workers crawl the
+ * directories and map the files themselves, and hand out tasks of about 
+ * batch_size bytes (a default is used if 0) while the crawl continues. No 
+ * more files are added once max_size bytes have been found, unless max_size
+ * is 0. The files stay mapped, so keys and values may point into them, until
+ * mr_files_destroy() is called.
+ */
+mr_files_t * mr_files_create(char ** paths, int num_paths, 
+                             int batch_size, off_t max_size);
+
+/* Splitter for a multi-file input source. It is thread-safe, so that the 
+ * workers can crawl and map files in parallel.
+ */
+int mr_files_splitter(void *data_in, int req_units, map_args_t *out);
+
+/* Returns the number of files and, in size if not NULL, the number of bytes 
+ * that have been added to the source so far.
+ */
+int mr_files_count(mr_files_t * files, off_t * size);
+
+/* Unmaps all the files of the source and frees it. */
+void mr_files_destroy(mr_files_t * files);
+
 #endif // _MAP_REDUCE_SCHEDULER_H_